@@ -7,11 +7,30 @@
 #include <math.h> /* You may have to define _USE_MATH_DEFINES if you use MSVC */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2_MATH__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 #define M_PI       3.14159265358979323846
 
-/* This can be replaced by any BSD-like queue implementation. */
-#include "queue.h"
+/* Allocation functions. Can be replaced at compile time, e.g. to count the
+ * allocations; all four have to be defined together. */
+#ifndef EBUR128_MALLOC
+#define EBUR128_MALLOC  malloc
+#define EBUR128_CALLOC  calloc
+#define EBUR128_REALLOC realloc
+#define EBUR128_FREE    free
+#endif
 
 #define CHECK_ERROR(condition, errorcode, goto_point)                          \
   if ((condition)) {                                                           \
@@ -19,38 +38,759 @@
     goto goto_point;                                                           \
   }
 
-STAILQ_HEAD(ebur128_double_queue, ebur128_dq_entry);
-struct ebur128_dq_entry {
-  double z;
-  STAILQ_ENTRY(ebur128_dq_entry) entries;
+/* Order-statistic tree (treap) of block energies. Every node also knows the
+ * number and the sum of the energies in its subtree, so percentiles and
+ * gated sums can be found in logarithmic time. Nodes live in one array and
+ * are linked by index; index 0 is an empty sentinel and removed nodes are
+ * kept in a free list, so a tree of constant size does not allocate. */
+struct ebur128_tree_node {
+  double z;               /* block energy */
+  double sum;             /* sum of the energies in this subtree */
+  unsigned int count;     /* number of nodes in this subtree */
+  unsigned int priority;
+  unsigned int left;
+  unsigned int right;
 };
 
+struct ebur128_tree {
+  struct ebur128_tree_node* nodes;
+  unsigned int capacity;  /* size of the nodes array */
+  unsigned int used;      /* nodes that have been handed out at least once */
+  unsigned int free_list; /* removed nodes, linked through left */
+  unsigned int root;
+  unsigned int seed;      /* state of the priority generator */
+};
+
+static void ebur128_tree_init(struct ebur128_tree* t) {
+  t->nodes = NULL;
+  t->capacity = 0;
+  t->used = 0;
+  t->free_list = 0;
+  t->root = 0;
+  t->seed = 2463534242u;
+}
+
+static void ebur128_tree_destroy(struct ebur128_tree* t) {
+  EBUR128_FREE(t->nodes);
+  ebur128_tree_init(t);
+}
+
+/* Makes sure that the next ebur128_tree_insert does not need to allocate. */
+static int ebur128_tree_reserve(struct ebur128_tree* t) {
+  struct ebur128_tree_node* nodes;
+  unsigned int capacity;
+  if (t->free_list || t->used + 1 < t->capacity) return EBUR128_SUCCESS;
+  capacity = t->capacity ? t->capacity * 2 : 64;
+  if (capacity <= t->capacity) return EBUR128_ERROR_NOMEM;
+  nodes = (struct ebur128_tree_node*)
+          EBUR128_REALLOC(t->nodes,
+                          capacity * sizeof(struct ebur128_tree_node));
+  if (!nodes) return EBUR128_ERROR_NOMEM;
+  if (!t->nodes) {
+    /* the sentinel */
+    nodes[0].z = 0.0;
+    nodes[0].sum = 0.0;
+    nodes[0].count = 0;
+    nodes[0].priority = 0;
+    nodes[0].left = 0;
+    nodes[0].right = 0;
+  }
+  t->nodes = nodes;
+  t->capacity = capacity;
+  return EBUR128_SUCCESS;
+}
+
+static void ebur128_tree_update(struct ebur128_tree_node* nodes,
+                                unsigned int n) {
+  struct ebur128_tree_node* l = &nodes[nodes[n].left];
+  struct ebur128_tree_node* r = &nodes[nodes[n].right];
+  nodes[n].count = l->count + 1 + r->count;
+  nodes[n].sum = l->sum + nodes[n].z + r->sum;
+}
+
+static unsigned int ebur128_tree_insert_at(struct ebur128_tree_node* nodes,
+                                           unsigned int n, unsigned int x) {
+  unsigned int c;
+  if (!n) return x;
+  if (nodes[x].z < nodes[n].z) {
+    c = nodes[n].left = ebur128_tree_insert_at(nodes, nodes[n].left, x);
+    if (nodes[c].priority > nodes[n].priority) {
+      /* rotate right */
+      nodes[n].left = nodes[c].right;
+      nodes[c].right = n;
+      ebur128_tree_update(nodes, n);
+      n = c;
+    }
+  } else {
+    c = nodes[n].right = ebur128_tree_insert_at(nodes, nodes[n].right, x);
+    if (nodes[c].priority > nodes[n].priority) {
+      /* rotate left */
+      nodes[n].right = nodes[c].left;
+      nodes[c].left = n;
+      ebur128_tree_update(nodes, n);
+      n = c;
+    }
+  }
+  ebur128_tree_update(nodes, n);
+  return n;
+}
+
+/* ebur128_tree_reserve must have been called before. */
+static void ebur128_tree_insert(struct ebur128_tree* t, double z) {
+  unsigned int x;
+  if (t->free_list) {
+    x = t->free_list;
+    t->free_list = t->nodes[x].left;
+  } else {
+    x = ++t->used;
+  }
+  /* xorshift32 */
+  t->seed ^= t->seed << 13;
+  t->seed ^= t->seed >> 17;
+  t->seed ^= t->seed << 5;
+  t->nodes[x].z = z;
+  t->nodes[x].sum = z;
+  t->nodes[x].count = 1;
+  t->nodes[x].priority = t->seed;
+  t->nodes[x].left = 0;
+  t->nodes[x].right = 0;
+  t->root = ebur128_tree_insert_at(t->nodes, t->root, x);
+}
+
+/* Joins two trees, all energies in a must not be larger than those in b. */
+static unsigned int ebur128_tree_merge(struct ebur128_tree_node* nodes,
+                                       unsigned int a, unsigned int b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (nodes[a].priority > nodes[b].priority) {
+    nodes[a].right = ebur128_tree_merge(nodes, nodes[a].right, b);
+    ebur128_tree_update(nodes, a);
+    return a;
+  } else {
+    nodes[b].left = ebur128_tree_merge(nodes, a, nodes[b].left);
+    ebur128_tree_update(nodes, b);
+    return b;
+  }
+}
+
+static unsigned int ebur128_tree_remove_at(struct ebur128_tree* t,
+                                           unsigned int n, double z) {
+  struct ebur128_tree_node* nodes = t->nodes;
+  unsigned int m;
+  if (!n) return 0;
+  if (z < nodes[n].z) {
+    nodes[n].left = ebur128_tree_remove_at(t, nodes[n].left, z);
+  } else if (z > nodes[n].z) {
+    nodes[n].right = ebur128_tree_remove_at(t, nodes[n].right, z);
+  } else {
+    m = ebur128_tree_merge(nodes, nodes[n].left, nodes[n].right);
+    nodes[n].left = t->free_list;
+    t->free_list = n;
+    return m;
+  }
+  ebur128_tree_update(nodes, n);
+  return n;
+}
+
+static void ebur128_tree_remove(struct ebur128_tree* t, double z) {
+  t->root = ebur128_tree_remove_at(t, t->root, z);
+}
+
+/* Returns the k-th smallest energy, k must be smaller than the size. */
+static double ebur128_tree_select(const struct ebur128_tree* t,
+                                  unsigned int k) {
+  const struct ebur128_tree_node* nodes = t->nodes;
+  unsigned int n = t->root;
+  for (;;) {
+    unsigned int l = nodes[n].left;
+    if (k < nodes[l].count) {
+      n = l;
+    } else if (k == nodes[l].count) {
+      return nodes[n].z;
+    } else {
+      k -= nodes[l].count + 1;
+      n = nodes[n].right;
+    }
+  }
+}
+
+/* Returns how many energies are smaller than z. */
+static unsigned int ebur128_tree_count_below(const struct ebur128_tree* t,
+                                             double z) {
+  const struct ebur128_tree_node* nodes = t->nodes;
+  unsigned int n = t->root;
+  unsigned int count = 0;
+  while (n) {
+    if (nodes[n].z < z) {
+      count += nodes[nodes[n].left].count + 1;
+      n = nodes[n].right;
+    } else {
+      n = nodes[n].left;
+    }
+  }
+  return count;
+}
+
+/* Returns the sum of the energies that are not smaller than z and adds their
+ * number to *count. */
+static double ebur128_tree_sum_from(const struct ebur128_tree* t, double z,
+                                    size_t* count) {
+  const struct ebur128_tree_node* nodes = t->nodes;
+  unsigned int n = t->root;
+  double sum = 0.0;
+  while (n) {
+    if (nodes[n].z >= z) {
+      *count += nodes[nodes[n].right].count + 1;
+      sum += nodes[n].z + nodes[nodes[n].right].sum;
+      n = nodes[n].left;
+    } else {
+      n = nodes[n].right;
+    }
+  }
+  return sum;
+}
+
+/* EBUR128_MODE_HISTORY_LOG16 stores the loudness of a block as the number of
+ * steps of 0.005 LU above the absolute gate, below which no block is
+ * stored. The energy of code c is log16_energies_high[c >> 8] *
+ * log16_energies_low[c & 255]. Filled once, see
+ * ebur128_init_shared_tables. */
+#define EBUR128_LOG16_STEP 0.005
+#define EBUR128_LOG16_FLOOR -70.0
+static double log16_energies_high[256];
+static double log16_energies_low[256];
+
+static void ebur128_fill_log16_tables(void) {
+  int i;
+  for (i = 0; i < 256; ++i) {
+    log16_energies_high[i] =
+        pow(10.0, (EBUR128_LOG16_FLOOR + 0.691 +
+                   256 * i * EBUR128_LOG16_STEP) / 10.0);
+    log16_energies_low[i] = pow(10.0, i * EBUR128_LOG16_STEP / 10.0);
+  }
+}
+
+static double ebur128_energy_to_loudness(double energy);
+
+/* Rounds to the nearest step, so the loudness is off by at most half a
+ * step. */
+static unsigned short ebur128_log16_code(double energy) {
+  double code = (ebur128_energy_to_loudness(energy) - EBUR128_LOG16_FLOOR) /
+                EBUR128_LOG16_STEP + 0.5;
+  if (code < 0.0) return 0;
+  if (code >= 65535.0) return 65535;
+  return (unsigned short) code;
+}
+
+static double ebur128_log16_energy(unsigned short code) {
+  return log16_energies_high[code >> 8] * log16_energies_low[code & 255];
+}
+
+/* How a block store keeps its energies, see EBUR128_MODE_HISTORY_*.
+ * EBUR128_BLOCKS_BIN keeps the histogram bin of the energy instead. */
+enum ebur128_block_encoding {
+  EBUR128_BLOCKS_DOUBLE,
+  EBUR128_BLOCKS_FLOAT,
+  EBUR128_BLOCKS_LOG16,
+  EBUR128_BLOCKS_BIN
+};
+
+/* Block energies are stored in pages of this many blocks. */
+#define EBUR128_BLOCK_PAGE_SIZE 4096
+
+/* Contiguous store for block energies. The pages are only allocated when the
+ * history grows, so once the store holds max blocks it turns into a ring
+ * buffer and adding a block never allocates. Unless the store is full, the
+ * oldest block is always at position 0. If use_tree is set, the same
+ * energies are also kept sorted in tree; only for EBUR128_BLOCKS_DOUBLE,
+ * the compact encodings are read block by block instead. If histogram is
+ * set, the blocks are EBUR128_BLOCKS_BIN and are taken out of histogram
+ * again when they are dropped, which makes it a sliding window. */
+struct ebur128_block_store {
+  char** pages;
+  size_t page_count;      /* allocated pages */
+  size_t page_slots;      /* size of the pages array */
+  size_t head;            /* position of the oldest block */
+  size_t size;            /* number of stored blocks */
+  unsigned long max;      /* maximum number of blocks */
+  int encoding;           /* enum ebur128_block_encoding */
+  size_t block_size;      /* bytes per block */
+  int use_tree;
+  struct ebur128_tree tree;
+  unsigned long* histogram;
+};
+
+#define EBUR128_BLOCK_AT(bs, pos)                                              \
+  ((bs)->pages[(pos) / EBUR128_BLOCK_PAGE_SIZE] +                              \
+   (pos) % EBUR128_BLOCK_PAGE_SIZE * (bs)->block_size)
+
+static void ebur128_block_store_init(struct ebur128_block_store* bs,
+                                     unsigned long max, int encoding,
+                                     int use_tree) {
+  bs->pages = NULL;
+  bs->page_count = 0;
+  bs->page_slots = 0;
+  bs->head = 0;
+  bs->size = 0;
+  bs->max = max;
+  bs->encoding = encoding;
+  switch (encoding) {
+    case EBUR128_BLOCKS_FLOAT: bs->block_size = sizeof(float); break;
+    case EBUR128_BLOCKS_LOG16: bs->block_size = sizeof(unsigned short); break;
+    case EBUR128_BLOCKS_BIN: bs->block_size = sizeof(unsigned int); break;
+    default: bs->block_size = sizeof(double);
+  }
+  bs->use_tree = use_tree;
+  ebur128_tree_init(&bs->tree);
+  bs->histogram = NULL;
+}
+
+static void ebur128_block_store_destroy(struct ebur128_block_store* bs) {
+  size_t i;
+  for (i = 0; i < bs->page_count; ++i) {
+    EBUR128_FREE(bs->pages[i]);
+  }
+  EBUR128_FREE(bs->pages);
+  ebur128_tree_destroy(&bs->tree);
+  ebur128_block_store_init(bs, bs->max, bs->encoding, bs->use_tree);
+}
+
+static double ebur128_block_store_get(const struct ebur128_block_store* bs,
+                                      size_t pos) {
+  const char* p = EBUR128_BLOCK_AT(bs, pos);
+  switch (bs->encoding) {
+    case EBUR128_BLOCKS_FLOAT: return *(const float*) p;
+    case EBUR128_BLOCKS_LOG16:
+      return ebur128_log16_energy(*(const unsigned short*) p);
+    case EBUR128_BLOCKS_BIN: return *(const unsigned int*) p;
+    default: return *(const double*) p;
+  }
+}
+
+static void ebur128_block_store_put(struct ebur128_block_store* bs,
+                                    size_t pos, double z) {
+  char* p = EBUR128_BLOCK_AT(bs, pos);
+  switch (bs->encoding) {
+    case EBUR128_BLOCKS_FLOAT: *(float*) p = (float) z; break;
+    case EBUR128_BLOCKS_LOG16:
+      *(unsigned short*) p = ebur128_log16_code(z);
+      break;
+    case EBUR128_BLOCKS_BIN: *(unsigned int*) p = (unsigned int) z; break;
+    default: *(double*) p = z;
+  }
+}
+
+/* Takes the oldest block out of the tree or the histogram. */
+static void ebur128_block_store_forget(struct ebur128_block_store* bs) {
+  if (bs->use_tree) {
+    ebur128_tree_remove(&bs->tree, ebur128_block_store_get(bs, bs->head));
+  } else if (bs->histogram) {
+    --bs->histogram[(size_t) ebur128_block_store_get(bs, bs->head)];
+  }
+}
+
+static int ebur128_block_store_add(struct ebur128_block_store* bs, double z) {
+  size_t capacity = bs->page_count * EBUR128_BLOCK_PAGE_SIZE;
+  if (bs->size >= bs->max) {
+    if (bs->size == 0) return EBUR128_SUCCESS;
+    ebur128_block_store_forget(bs);
+    if (bs->use_tree) {
+      ebur128_tree_insert(&bs->tree, z);
+    }
+    /* overwrite the oldest block */
+    ebur128_block_store_put(bs, (bs->head + bs->size) % capacity, z);
+    bs->head = (bs->head + 1) % capacity;
+    return EBUR128_SUCCESS;
+  }
+  if (bs->use_tree && ebur128_tree_reserve(&bs->tree)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  if (bs->size == capacity) {
+    if (bs->page_count == bs->page_slots) {
+      size_t slots = bs->page_slots ? bs->page_slots * 2 : 16;
+      char** pages = (char**) EBUR128_REALLOC(bs->pages,
+                                              slots * sizeof(char*));
+      if (!pages) return EBUR128_ERROR_NOMEM;
+      bs->pages = pages;
+      bs->page_slots = slots;
+    }
+    bs->pages[bs->page_count] = (char*)
+        EBUR128_MALLOC(EBUR128_BLOCK_PAGE_SIZE * bs->block_size);
+    if (!bs->pages[bs->page_count]) return EBUR128_ERROR_NOMEM;
+    bs->page_count++;
+  }
+  if (bs->use_tree) {
+    ebur128_tree_insert(&bs->tree, z);
+  }
+  ebur128_block_store_put(bs, bs->size, z);
+  bs->size++;
+  return EBUR128_SUCCESS;
+}
+
+static void ebur128_block_store_reverse(struct ebur128_block_store* bs,
+                                        size_t first, size_t last) {
+  char tmp[sizeof(double)];
+  while (first + 1 < last) {
+    --last;
+    memcpy(tmp, EBUR128_BLOCK_AT(bs, first), bs->block_size);
+    memcpy(EBUR128_BLOCK_AT(bs, first), EBUR128_BLOCK_AT(bs, last),
+           bs->block_size);
+    memcpy(EBUR128_BLOCK_AT(bs, last), tmp, bs->block_size);
+    ++first;
+  }
+}
+
+/* Drops the oldest blocks until at most max are left, moves the oldest block
+ * back to position 0 and releases pages that are no longer needed. */
+static void ebur128_block_store_set_max(struct ebur128_block_store* bs,
+                                        unsigned long max) {
+  size_t capacity = bs->page_count * EBUR128_BLOCK_PAGE_SIZE;
+  size_t pages_needed;
+  bs->max = max;
+  while (bs->size > max) {
+    ebur128_block_store_forget(bs);
+    bs->head = (bs->head + 1) % capacity;
+    bs->size--;
+  }
+  if (bs->head) {
+    /* rotate left by head */
+    ebur128_block_store_reverse(bs, 0, bs->head);
+    ebur128_block_store_reverse(bs, bs->head, capacity);
+    ebur128_block_store_reverse(bs, 0, capacity);
+    bs->head = 0;
+  }
+  pages_needed = max / EBUR128_BLOCK_PAGE_SIZE +
+                 (max % EBUR128_BLOCK_PAGE_SIZE ? 1 : 0);
+  while (bs->page_count > pages_needed) {
+    EBUR128_FREE(bs->pages[--bs->page_count]);
+  }
+}
+
+/* Reads the energies of at most n blocks starting at the i-th oldest one
+ * into out, as many as are contiguous in memory, and returns how many. */
+static size_t ebur128_block_store_read(const struct ebur128_block_store* bs,
+                                       size_t i, size_t n, double* out) {
+  size_t capacity = bs->page_count * EBUR128_BLOCK_PAGE_SIZE;
+  size_t pos = (bs->head + i) % capacity;
+  size_t k, contiguous = EBUR128_BLOCK_PAGE_SIZE -
+                         pos % EBUR128_BLOCK_PAGE_SIZE;
+  const char* p = EBUR128_BLOCK_AT(bs, pos);
+  if (n > contiguous) n = contiguous;
+  if (n > bs->size - i) n = bs->size - i;
+  switch (bs->encoding) {
+    case EBUR128_BLOCKS_FLOAT:
+      for (k = 0; k < n; ++k) out[k] = ((const float*) p)[k];
+      break;
+    case EBUR128_BLOCKS_LOG16:
+      for (k = 0; k < n; ++k) {
+        out[k] = ebur128_log16_energy(((const unsigned short*) p)[k]);
+      }
+      break;
+    case EBUR128_BLOCKS_BIN:
+      for (k = 0; k < n; ++k) out[k] = ((const unsigned int*) p)[k];
+      break;
+    default:
+      memcpy(out, p, n * sizeof(double));
+  }
+  return n;
+}
+
+/* Same as ebur128_tree_sum_from, by reading every block. */
+static double ebur128_block_store_sum_from(
+    const struct ebur128_block_store* bs, double z, size_t* count) {
+  double blocks[256];
+  double sum = 0.0;
+  size_t i, k, n, above = 0;
+  for (i = 0; i < bs->size; i += n) {
+    n = ebur128_block_store_read(bs, i, 256, blocks);
+    /* without branches, which would be mispredicted around the gate */
+    for (k = 0; k < n; ++k) {
+      int is_above = blocks[k] >= z;
+      sum += is_above ? blocks[k] : 0.0;
+      above += is_above;
+    }
+  }
+  *count += above;
+  return sum;
+}
+
 #define ALMOST_ZERO 0.000001
 
+/* Phases of the interpolator are padded to this many SIMD lanes. */
+#define INTERP_LANES 4
+
 typedef struct {              // Data structure for polyphase FIR interpolator
   unsigned int factor;        // Interpolation factor of the interpolator
   unsigned int taps;          // Taps (prefer odd to increase zero coeffs)
   unsigned int channels;      // Number of channels
   unsigned int delay;         // Size of delay buffer
-  struct {
-    unsigned int count;       // Number of coefficients in this subfilter
-    unsigned int* index;      // Delay index of corresponding filter coeff
-    double* coeff;            // List of subfilter coefficients
-  }* filter;                  // List of subfilters (one for each factor)
-  float** z;                  // List of delay buffers (one for each channel)
+  float* coeff;               // Dense coefficients, coeff[d * INTERP_LANES + f]
+                              // is applied to the sample delayed by d in
+                              // phase f. Zero for unused taps and lanes.
+  float** z;                  // List of delay buffers (one for each channel),
+                              // mirrored: each sample is stored at zi and
+                              // zi + delay, so the last delay samples are
+                              // always contiguous.
+  float* zbuf;                // Memory of all delay buffers
   unsigned int zi;            // Current delay buffer index
 } interpolator;
 
+/* Filters channels [c_begin, c_end) of frames frames of src, starting at
+ * frame offset. src is interleaved or an array of channel pointers, depending
+ * on the function. */
+typedef void (*ebur128_filter_function)(ebur128_state* st, const void* src,
+                                        size_t offset, size_t frames,
+                                        size_t c_begin, size_t c_end);
+
+#define EBUR128_MAX_THREADS 64
+/* Calls with fewer samples than this are filtered on the calling thread. */
+#define EBUR128_POOL_MIN_SAMPLES 8192
+
+/* Worker pool for ebur128_set_threads. The channels are split into one group
+ * per thread, the calling thread filters the first group and the workers the
+ * others. Each channel is always filtered by exactly the same code, so the
+ * results do not depend on the number of threads. */
+struct ebur128_worker {
+  struct ebur128_pool* pool;
+  unsigned int group;
+#ifdef _WIN32
+  HANDLE thread;
+  HANDLE start;
+  HANDLE done;
+#else
+  pthread_t thread;
+#endif
+};
+
+struct ebur128_pool {
+  unsigned int threads;             /* including the calling thread */
+  struct ebur128_worker* workers;   /* threads - 1 workers */
+  int quit;
+  /* the current job */
+  ebur128_state* st;
+  ebur128_filter_function filter;
+  const void* src;
+  size_t offset;
+  size_t frames;
+  size_t group_size;
+#ifndef _WIN32
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned long generation;
+  unsigned int pending;
+#endif
+};
+
+static void ebur128_pool_run_group(struct ebur128_pool* pool,
+                                   unsigned int group) {
+  size_t c_begin = group * pool->group_size;
+  size_t c_end = c_begin + pool->group_size;
+  if (c_end > pool->st->channels) c_end = pool->st->channels;
+  if (c_begin < c_end) {
+    pool->filter(pool->st, pool->src, pool->offset, pool->frames,
+                 c_begin, c_end);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ebur128_worker_main(LPVOID arg) {
+  struct ebur128_worker* worker = (struct ebur128_worker*) arg;
+  for (;;) {
+    WaitForSingleObject(worker->start, INFINITE);
+    if (worker->pool->quit) break;
+    ebur128_pool_run_group(worker->pool, worker->group);
+    SetEvent(worker->done);
+  }
+  return 0;
+}
+#else
+static void* ebur128_worker_main(void* arg) {
+  struct ebur128_worker* worker = (struct ebur128_worker*) arg;
+  struct ebur128_pool* pool = worker->pool;
+  unsigned long generation = 0;
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (!pool->quit && pool->generation == generation) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if (pool->quit) break;
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+    ebur128_pool_run_group(pool, worker->group);
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+#endif
+
+/* Stops and joins the first count workers and frees the pool. */
+static void ebur128_pool_destroy(struct ebur128_pool* pool,
+                                 unsigned int count) {
+  unsigned int i;
+  if (!pool) return;
+#ifdef _WIN32
+  pool->quit = 1;
+  for (i = 0; i < count; ++i) {
+    SetEvent(pool->workers[i].start);
+    WaitForSingleObject(pool->workers[i].thread, INFINITE);
+    CloseHandle(pool->workers[i].thread);
+  }
+  for (i = 0; i < pool->threads - 1; ++i) {
+    if (pool->workers[i].start) CloseHandle(pool->workers[i].start);
+    if (pool->workers[i].done) CloseHandle(pool->workers[i].done);
+  }
+#else
+  pthread_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for (i = 0; i < count; ++i) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->mutex);
+#endif
+  EBUR128_FREE(pool->workers);
+  EBUR128_FREE(pool);
+}
+
+static struct ebur128_pool* ebur128_pool_create(unsigned int threads) {
+  struct ebur128_pool* pool;
+  unsigned int i;
+
+  pool = (struct ebur128_pool*) EBUR128_CALLOC(1, sizeof(struct ebur128_pool));
+  if (!pool) return NULL;
+  pool->threads = threads;
+  pool->workers = (struct ebur128_worker*)
+                  EBUR128_CALLOC(threads - 1, sizeof(struct ebur128_worker));
+  if (!pool->workers) {
+    EBUR128_FREE(pool);
+    return NULL;
+  }
+#ifdef _WIN32
+  for (i = 0; i < threads - 1; ++i) {
+    pool->workers[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+    pool->workers[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!pool->workers[i].start || !pool->workers[i].done) {
+      ebur128_pool_destroy(pool, 0);
+      return NULL;
+    }
+  }
+  for (i = 0; i < threads - 1; ++i) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].group = i + 1;
+    pool->workers[i].thread = CreateThread(NULL, 0, ebur128_worker_main,
+                                           &pool->workers[i], 0, NULL);
+    if (!pool->workers[i].thread) {
+      ebur128_pool_destroy(pool, i);
+      return NULL;
+    }
+  }
+#else
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (i = 0; i < threads - 1; ++i) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].group = i + 1;
+    if (pthread_create(&pool->workers[i].thread, NULL, ebur128_worker_main,
+                       &pool->workers[i])) {
+      ebur128_pool_destroy(pool, i);
+      return NULL;
+    }
+  }
+#endif
+  return pool;
+}
+
+static void ebur128_pool_run(struct ebur128_pool* pool, ebur128_state* st,
+                             ebur128_filter_function filter,
+                             const void* src, size_t offset,
+                             size_t frames) {
+#ifdef _WIN32
+  unsigned int i;
+#endif
+  pool->st = st;
+  pool->filter = filter;
+  pool->src = src;
+  pool->offset = offset;
+  pool->frames = frames;
+  /* keep pairs of channels together for the SIMD filters */
+  pool->group_size = (st->channels + pool->threads - 1) / pool->threads;
+  pool->group_size = (pool->group_size + 1) & ~(size_t) 1;
+#ifdef _WIN32
+  for (i = 0; i < pool->threads - 1; ++i) {
+    SetEvent(pool->workers[i].start);
+  }
+  ebur128_pool_run_group(pool, 0);
+  for (i = 0; i < pool->threads - 1; ++i) {
+    WaitForSingleObject(pool->workers[i].done, INFINITE);
+  }
+#else
+  pthread_mutex_lock(&pool->mutex);
+  pool->pending = pool->threads - 1;
+  ++pool->generation;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  ebur128_pool_run_group(pool, 0);
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+/* Frames per true peak tile, see EBUR128_PROCESS. */
+#define EBUR128_TILE_FRAMES 256
+
+/* Number of formats kept by ebur128_change_parameters besides the current
+ * one. */
+#define EBUR128_FORMATS 4
+
+/* The parts of the state that depend on the number of channels or the sample
+ * rate, kept when switching to another format so that switching back needs
+ * neither allocation nor filter design. */
+struct ebur128_format {
+  /** Zero if the slot is unused. */
+  unsigned int channels;
+  unsigned long samplerate;
+  /** Value of format_clock when the format was left. */
+  unsigned long used;
+  int* channel_map;
+  double b[5];
+  double a[5];
+  double* v;
+  double* channel_energy;
+  double* sample_peak;
+  double* prev_sample_peak;
+  double* true_peak;
+  double* prev_true_peak;
+  interpolator* interp;
+  float* resampler_buffer_input;
+  const void** planes;
+};
+
 struct ebur128_state_internal {
-  /** Filtered audio data (used as ring buffer). */
-  double* audio_data;
-  /** Size of audio_data array. */
-  size_t audio_data_frames;
-  /** Current index for audio_data. */
-  size_t audio_data_index;
-  /** How many frames are needed for a gating block. Will correspond to 400ms
-   *  of audio at initialization, and 100ms after the first block (75% overlap
-   *  as specified in the 2011 revision of BS1770). */
+  /** Energy of the current 100ms sub-block so far, one per channel. */
+  double* channel_energy;
+  /** Weighted energies of the last 100ms sub-blocks (used as ring buffer).
+   *  Gating blocks and the momentary, short-term and window loudness are
+   *  summed from these. */
+  double* subblock_energy;
+  /** Size of subblock_energy array. */
+  size_t subblocks;
+  /** Current index for subblock_energy. */
+  size_t subblock_index;
+  /** How many sub-blocks have been completed, at most subblocks. A gating
+   *  block is calculated after every sub-block once there are 4 of them
+   *  (75% overlap as specified in the 2011 revision of BS1770). */
+  size_t subblock_count;
+  /** How many frames are needed to complete the current sub-block. */
   unsigned long needed_frames;
   /** The channel map. Has as many elements as there are channels. */
   int* channel_map;
@@ -60,17 +800,24 @@ struct ebur128_state_internal {
   double b[5];
   /** BS.1770 filter coefficients (denominator). */
   double a[5];
-  /** BS.1770 filter state. */
-  double v[5][5];
-  /** Linked list of block energies. */
-  struct ebur128_double_queue block_list;
-  unsigned long block_list_max;
-  unsigned long block_list_size;
-  /** Linked list of 3s-block energies, used to calculate LRA. */
-  struct ebur128_double_queue short_term_block_list;
-  unsigned long st_block_list_max;
-  unsigned long st_block_list_size;
+  /** BS.1770 filter state, one set per channel. Stored as structure of
+   *  arrays (v[k * channels + c]) so that adjacent channels can be filtered
+   *  together with SIMD instructions. */
+  double* v;
+  /** Block energies. */
+  struct ebur128_block_store block_list;
+  /** 3s-block energies, used to calculate LRA. */
+  struct ebur128_block_store short_term_block_list;
   int use_histogram;
+  /** Number of histogram bins per LU. */
+  unsigned int histogram_resolution;
+  /** Number of histogram bins, covering -70 LUFS to +30 LUFS. */
+  size_t histogram_bins;
+  /** Energy at the center of each histogram bin. */
+  const double* histogram_energies;
+  /** Energy at the lower boundary of each histogram bin, followed by the
+   *  upper boundary of the last one. */
+  const double* histogram_energy_boundaries;
   unsigned long *block_energy_histogram;
   unsigned long *short_term_block_energy_histogram;
   /** Keeps track of when a new short term block is needed. */
@@ -82,47 +829,110 @@ struct ebur128_state_internal {
   double* true_peak;
   double* prev_true_peak;
   interpolator* interp;
+  /** One tile of input samples per channel, EBUR128_TILE_FRAMES each. */
   float* resampler_buffer_input;
-  size_t resampler_buffer_input_frames;
-  float* resampler_buffer_output;
-  size_t resampler_buffer_output_frames;
+  /** First sample of each channel in the current input. */
+  const void** planes;
+  /** Worker threads for ebur128_set_threads, NULL if single-threaded. */
+  struct ebur128_pool* pool;
   /** The maximum window duration in ms. */
   unsigned long window;
   unsigned long history;
+  /** Formats used before the current one. */
+  struct ebur128_format formats[EBUR128_FORMATS];
+  /** Number of format changes so far. */
+  unsigned long format_clock;
+  /** Memory passed to ebur128_init_arena, NULL if the state was allocated
+   *  by ebur128_init. Parts of the state in [arena, arena_end) are not
+   *  freed. */
+  char* arena;
+  /** First unused byte of the arena. */
+  char* arena_next;
+  char* arena_end;
 };
 
-static double relative_gate = -10.0;
+/* Alignment of the parts of a state in an arena. The arena itself starts at
+ * a cache line. */
+#define EBUR128_ARENA_ALIGN 16
+#define EBUR128_ARENA_LINE 64
+#define EBUR128_ARENA_ROUND(size)                                              \
+  (((size) + EBUR128_ARENA_ALIGN - 1) & ~(size_t) (EBUR128_ARENA_ALIGN - 1))
+
+/* Allocates size bytes for st, from its arena while there is room. */
+static void* ebur128_alloc(ebur128_state* st, size_t size) {
+  size_t rounded = EBUR128_ARENA_ROUND(size);
+  if (st->d->arena &&
+      (size_t) (st->d->arena_end - st->d->arena_next) >= rounded) {
+    void* p = st->d->arena_next;
+    st->d->arena_next += rounded;
+    return p;
+  }
+  return EBUR128_MALLOC(size);
+}
 
-/* Those will be calculated when initializing the library */
-static double relative_gate_factor;
-static double minus_twenty_decibels;
-static double histogram_energies[1000];
-static double histogram_energy_boundaries[1001];
+static void* ebur128_calloc(ebur128_state* st, size_t count, size_t size) {
+  void* p = ebur128_alloc(st, count * size);
+  if (p) memset(p, 0, count * size);
+  return p;
+}
+
+static int ebur128_in_arena(const ebur128_state* st, const void* p) {
+  return st->d->arena && (const char*) p >= st->d->arena &&
+         (const char*) p < st->d->arena_end;
+}
+
+/* Frees memory from ebur128_alloc, unless it is part of the arena. */
+static void ebur128_release(ebur128_state* st, const void* p) {
+  if (!ebur128_in_arena(st, p)) EBUR128_FREE((void*) p);
+}
+
+/* The relative gate (-10 LU), the LRA gate (-20 LU) and the absolute gate
+ * (-70 LUFS) as energies, i.e. pow(10.0, -10.0 / 10.0) etc. Constants, so
+ * that states can be created concurrently. */
+static const double relative_gate_factor = 0.1;
+static const double minus_twenty_decibels = 0.01;
+static const double absolute_gate_energy = 1.1724653045822981e-07;
+
+/* Default number of histogram bins per LU. */
+#define EBUR128_HISTOGRAM_RESOLUTION 10
 
-static interpolator* interp_create(unsigned int taps, unsigned int factor, unsigned int channels) {
-  interpolator* interp = calloc(1, sizeof(interpolator));
+/* Histogram tables of the default resolution, shared by all states that use
+ * it. Filled once, by the first state that needs them. */
+static double default_histogram_energies[100 * EBUR128_HISTOGRAM_RESOLUTION];
+static double
+    default_histogram_energy_boundaries[100 * EBUR128_HISTOGRAM_RESOLUTION + 1];
+
+static void interp_destroy(ebur128_state* st, interpolator* interp);
+
+static interpolator* interp_create(ebur128_state* st, unsigned int taps,
+                                   unsigned int factor, unsigned int channels) {
+  interpolator* interp = ebur128_calloc(st, 1, sizeof(interpolator));
   unsigned int j = 0;
 
+  if (!interp) return NULL;
   interp->taps = taps;
   interp->factor = factor;
   interp->channels = channels;
   interp->delay = (interp->taps + interp->factor - 1) / interp->factor;
 
   // Initialize the filter memory
-  // One subfilter per interpolation factor.
-  interp->filter = calloc(interp->factor, sizeof(*interp->filter));
-  for (j = 0; j < interp->factor; j++) {
-    interp->filter[j].index = calloc(interp->delay, sizeof(unsigned int));
-    interp->filter[j].coeff = calloc(interp->delay, sizeof(double));
-  }
-  // One delay buffer per channel.
-  interp->z = calloc(interp->channels, sizeof(float*));
+  // One dense row of INTERP_LANES phases per delay.
+  interp->coeff = ebur128_calloc(st, interp->delay * INTERP_LANES,
+                                 sizeof(float));
+  if (!interp->coeff) goto fail;
+  // One delay buffer per channel, twice the delay for the mirror.
+  interp->z = ebur128_alloc(st, interp->channels * sizeof(float*));
+  if (!interp->z) goto fail;
+  interp->zbuf = ebur128_calloc(st, interp->channels * 2 * interp->delay,
+                                sizeof(float));
+  if (!interp->zbuf) goto fail;
   for (j = 0; j < interp->channels; j++) {
-    interp->z[j] = calloc( interp->delay, sizeof(float) );
+    interp->z[j] = interp->zbuf + j * 2 * interp->delay;
   }
 
-  // Calculate the filter coefficients
-  for (j = 0; j < interp->taps; j++) {
+  // Calculate the filter coefficients. The windowed sinc is symmetric around
+  // the center tap, so only the first half is calculated and mirrored.
+  for (j = 0; j <= (interp->taps - 1) / 2; j++) {
     // Calculate sinc
     double m = (double)j - (double)(interp->taps - 1) / 2.0;
     double c = 1.0;
@@ -134,60 +944,177 @@ static interpolator* interp_create(unsigned int taps, unsigned int factor, unsig
 
     if (fabs(c) > ALMOST_ZERO) { // Ignore any zero coeffs.
       // Put the coefficient into the correct subfilter
-      unsigned int f = j % interp->factor;
-      unsigned int t = interp->filter[f].count++;
-      interp->filter[f].coeff[t] = c;
-      interp->filter[f].index[t] = j / interp->factor;
+      unsigned int k = interp->taps - 1 - j;
+      interp->coeff[(j / factor) * INTERP_LANES + j % factor] = (float) c;
+      interp->coeff[(k / factor) * INTERP_LANES + k % factor] = (float) c;
     }
   }
   return interp;
+
+fail:
+  interp_destroy(st, interp);
+  return NULL;
 }
 
-static void interp_destroy(interpolator* interp) {
-  unsigned int j = 0;
+/* Clears the delay buffers, as if the interpolator was just created. */
+static void interp_reset(interpolator* interp) {
+  unsigned int j;
+  for (j = 0; j < interp->channels; j++) {
+    memset(interp->z[j], 0, 2 * interp->delay * sizeof(float));
+  }
+  interp->zi = 0;
+}
+
+static void interp_destroy(ebur128_state* st, interpolator* interp) {
   if (!interp) return;
-  for (j = 0; j < interp->factor; j++) {
-    free(interp->filter[j].index);
-    free(interp->filter[j].coeff);
+  ebur128_release(st, interp->coeff);
+  ebur128_release(st, interp->zbuf);
+  ebur128_release(st, interp->z);
+  ebur128_release(st, interp);
+}
+
+/* Each output sample of phase f is the dot product of the delay line with
+ * column f of interp->coeff, so one pass over the delay line yields the
+ * output of all phases. The SIMD version keeps the phases in the lanes of a
+ * single register and runs four input samples at once, which gives four
+ * independent accumulator chains. It accumulates in single precision; the
+ * difference to double precision accumulation is below 1e-6 for input
+ * within [-1.0, 1.0]. */
+static void interp_dot(const interpolator* interp, const float* zp,
+                       float* acc) {
+  const float* coeff = interp->coeff;
+  unsigned int d;
+#ifdef __SSE2_MATH__
+  __m128 a = _mm_setzero_ps();
+  for (d = 0; d < interp->delay; d++) {
+    a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(zp[-(int) d]),
+                                 _mm_loadu_ps(coeff + d * INTERP_LANES)));
   }
-  free(interp->filter);
-  for (j = 0; j < interp->channels; j++) {
-    free(interp->z[j]);
+  _mm_storeu_ps(acc, a);
+#else
+  unsigned int f;
+  for (f = 0; f < interp->factor; f++) {
+    double a = 0.0;
+    for (d = 0; d < interp->delay; d++) {
+      a += zp[-(int) d] * coeff[d * INTERP_LANES + f];
+    }
+    acc[f] = (float) a;
+  }
+#endif
+}
+
+/* Same as interp_dot for the four samples zp - 3 ... zp. */
+static void interp_dot4(const interpolator* interp, const float* zp,
+                        float* acc) {
+#ifdef __SSE2_MATH__
+  const float* coeff = interp->coeff;
+  const float* z0 = zp - 3;
+  unsigned int d;
+  __m128 a0 = _mm_setzero_ps();
+  __m128 a1 = _mm_setzero_ps();
+  __m128 a2 = _mm_setzero_ps();
+  __m128 a3 = _mm_setzero_ps();
+  /* the sample delayed by d for input k is the one delayed by d - 1 for
+   * input k - 1, so only one new sample is broadcast per step */
+  __m128 x1 = _mm_set1_ps(z0[1]);
+  __m128 x2 = _mm_set1_ps(z0[2]);
+  __m128 x3 = _mm_set1_ps(z0[3]);
+  for (d = 0; d < interp->delay; d++) {
+    __m128 c = _mm_loadu_ps(coeff + d * INTERP_LANES);
+    __m128 x0 = _mm_set1_ps(z0[-(int) d]);
+    a0 = _mm_add_ps(a0, _mm_mul_ps(x0, c));
+    a1 = _mm_add_ps(a1, _mm_mul_ps(x1, c));
+    a2 = _mm_add_ps(a2, _mm_mul_ps(x2, c));
+    a3 = _mm_add_ps(a3, _mm_mul_ps(x3, c));
+    x3 = x2;
+    x2 = x1;
+    x1 = x0;
+  }
+  _mm_storeu_ps(acc, a0);
+  _mm_storeu_ps(acc + INTERP_LANES, a1);
+  _mm_storeu_ps(acc + 2 * INTERP_LANES, a2);
+  _mm_storeu_ps(acc + 3 * INTERP_LANES, a3);
+#else
+  unsigned int k;
+  for (k = 0; k < 4; k++) {
+    interp_dot(interp, zp - 3 + k, acc + k * INTERP_LANES);
   }
-  free(interp->z);
-  free(interp);
+#endif
 }
 
-static void interp_process(interpolator* interp, size_t frames, float* in, float* out) {
+// Interpolates frames samples of channel chan and returns the largest
+// absolute value of the factor output samples per input sample. The output
+// is reduced as it is produced and never stored. zi is the delay buffer index
+// of the first sample. Does not advance interp->zi, call interp_advance once
+// all channels are done.
+static float interp_process(interpolator* interp, size_t frames,
+                            const float* in,
+                            unsigned int chan, unsigned int zi) {
   size_t frame = 0;
-  unsigned int chan = 0;
+  unsigned int k = 0;
+  unsigned int n = 0;
+  float* z = interp->z[chan];
+  float acc[4 * INTERP_LANES];
+#ifdef __SSE2_MATH__
+  // Unused lanes of acc are zero and do not change the maximum
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 peak = _mm_setzero_ps();
+#else
   unsigned int f = 0;
-  unsigned int t = 0;
-  unsigned int out_stride = interp->channels * interp->factor;
-  float* outp;
-  double c;
-  for (frame = 0; frame < frames; frame++) {
-    for (chan = 0; chan < interp->channels; chan++) {
-      // Add sample to delay buffer
-      interp->z[chan][interp->zi] = *in++;
-      // Apply coefficients
-      outp = &out[chan];
+  float peak = 0.0f;
+#endif
+  for (frame = 0; frame < frames; frame += n) {
+    // Take up to four samples, but do not run past the end of the mirror
+    n = 4;
+    if (frames - frame < n) n = (unsigned int) (frames - frame);
+    if (interp->delay - zi < n) n = interp->delay - zi;
+    // Add samples to the upper half of the delay buffer. The lower half
+    // still holds the oldest samples needed by the first outputs.
+    for (k = 0; k < n; k++) {
+      z[zi + k + interp->delay] = in[frame + k];
+    }
+    // Apply coefficients, newest sample is at the highest address
+    if (n == 4) {
+      interp_dot4(interp, z + zi + interp->delay + 3, acc);
+    } else {
+      for (k = 0; k < n; k++) {
+        interp_dot(interp, z + zi + interp->delay + k,
+                   acc + k * INTERP_LANES);
+      }
+    }
+    // Mirror the new samples into the lower half
+    for (k = 0; k < n; k++) {
+      z[zi + k] = z[zi + k + interp->delay];
+    }
+    for (k = 0; k < n; k++) {
+#ifdef __SSE2_MATH__
+      peak = _mm_max_ps(_mm_andnot_ps(sign,
+                                      _mm_loadu_ps(acc + k * INTERP_LANES)),
+                        peak);
+#else
       for (f = 0; f < interp->factor; f++) {
-        double acc = 0.0;
-        for (t = 0; t < interp->filter[f].count; t++) {
-          int i = (int)interp->zi - (int)interp->filter[f].index[t];
-          if (i < 0) i += interp->delay;
-          c = interp->filter[f].coeff[t];
-          acc += interp->z[chan][i] * c;
+        if (acc[k * INTERP_LANES + f] > peak) {
+          peak = acc[k * INTERP_LANES + f];
+        } else if (-acc[k * INTERP_LANES + f] > peak) {
+          peak = -acc[k * INTERP_LANES + f];
         }
-        *outp = (float)acc;
-        outp += interp->channels;
       }
+#endif
     }
-    out += out_stride;
-    interp->zi++;
-    if (interp->zi == interp->delay) interp->zi = 0;
+    zi += n;
+    if (zi == interp->delay) zi = 0;
   }
+#ifdef __SSE2_MATH__
+  peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+  peak = _mm_max_ps(peak, _mm_shuffle_ps(peak, peak, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(peak);
+#else
+  return peak;
+#endif
+}
+
+static void interp_advance(interpolator* interp, size_t frames) {
+  interp->zi = (unsigned int) ((interp->zi + frames) % interp->delay);
 }
 
 static void ebur128_init_filter(ebur128_state* st) {
@@ -238,16 +1165,14 @@ static void ebur128_init_filter(ebur128_state* st) {
   st->d->a[4] = pa[2] * ra[2];
 
   for (i = 0; i < 5; ++i) {
-    for (j = 0; j < 5; ++j) {
-      st->d->v[i][j] = 0.0;
+    for (j = 0; j < (int) st->channels; ++j) {
+      st->d->v[i * st->channels + j] = 0.0;
     }
   }
 }
 
-static int ebur128_init_channel_map(ebur128_state* st) {
+static void ebur128_reset_channel_map(ebur128_state* st) {
   size_t i;
-  st->d->channel_map = (int*) malloc(st->channels * sizeof(int));
-  if (!st->d->channel_map) return EBUR128_ERROR_NOMEM;
   if (st->channels == 4) {
     st->d->channel_map[0] = EBUR128_LEFT;
     st->d->channel_map[1] = EBUR128_RIGHT;
@@ -272,6 +1197,151 @@ static int ebur128_init_channel_map(ebur128_state* st) {
       }
     }
   }
+}
+
+static int ebur128_init_channel_map(ebur128_state* st) {
+  st->d->channel_map = (int*) ebur128_alloc(st, st->channels * sizeof(int));
+  if (!st->d->channel_map) return EBUR128_ERROR_NOMEM;
+  ebur128_reset_channel_map(st);
+  return EBUR128_SUCCESS;
+}
+
+static void ebur128_fill_histogram_tables(double* energies,
+                                          double* boundaries,
+                                          unsigned int bins_per_lu) {
+  size_t i, bins = 100 * (size_t) bins_per_lu;
+  for (i = 0; i < bins; ++i) {
+    energies[i] =
+        pow(10.0, ((double) i / bins_per_lu - (70.0 - 0.5 / bins_per_lu)
+                   + 0.691) / 10.0);
+  }
+  for (i = 0; i <= bins; ++i) {
+    boundaries[i] =
+        pow(10.0, ((double) i / bins_per_lu - 70.0 + 0.691) / 10.0);
+  }
+}
+
+static void ebur128_fill_shared_tables(void) {
+  ebur128_fill_histogram_tables(default_histogram_energies,
+                                default_histogram_energy_boundaries,
+                                EBUR128_HISTOGRAM_RESOLUTION);
+  ebur128_fill_log16_tables();
+}
+
+/* Fills the default histogram tables and the EBUR128_MODE_HISTORY_LOG16
+ * tables if that has not been done yet. Safe to call from several threads
+ * at once; all of them return once the tables are filled. */
+#ifdef _WIN32
+static volatile LONG shared_tables_state; /* 2 when filled */
+
+static void ebur128_init_shared_tables(void) {
+  if (InterlockedCompareExchange(&shared_tables_state, 1, 0) == 0) {
+    ebur128_fill_shared_tables();
+    InterlockedExchange(&shared_tables_state, 2);
+  } else {
+    while (shared_tables_state != 2) Sleep(0);
+  }
+}
+#else
+static pthread_once_t shared_tables_once = PTHREAD_ONCE_INIT;
+
+static void ebur128_init_shared_tables(void) {
+  pthread_once(&shared_tables_once, ebur128_fill_shared_tables);
+}
+#endif
+
+static void ebur128_free_histogram_tables(ebur128_state* st) {
+  if (st->d->histogram_energies != default_histogram_energies) {
+    ebur128_release(st, st->d->histogram_energies);
+    ebur128_release(st, st->d->histogram_energy_boundaries);
+  }
+  st->d->histogram_energies = NULL;
+  st->d->histogram_energy_boundaries = NULL;
+}
+
+/* With EBUR128_MODE_HISTOGRAM and a limited history, the block stores keep
+ * the histogram bin of every block, so that the oldest blocks can be taken
+ * out of the histograms again. Blocks that were counted while the history
+ * was unlimited cannot, so the histograms start over when it gets limited.
+ * Called whenever the histograms or the history change. */
+static void ebur128_track_histogram_blocks(ebur128_state* st) {
+  struct ebur128_state_internal* d = st->d;
+  if (d->history == ULONG_MAX) {
+    ebur128_block_store_destroy(&d->block_list);
+    ebur128_block_store_destroy(&d->short_term_block_list);
+    return;
+  }
+  if (!d->block_list.histogram) {
+    memset(d->block_energy_histogram, 0,
+           d->histogram_bins * sizeof(unsigned long));
+    memset(d->short_term_block_energy_histogram, 0,
+           d->histogram_bins * sizeof(unsigned long));
+  }
+  d->block_list.histogram = d->block_energy_histogram;
+  d->short_term_block_list.histogram = d->short_term_block_energy_histogram;
+}
+
+static int ebur128_init_histogram(ebur128_state* st, unsigned int bins_per_lu) {
+  double* energies;
+  double* boundaries;
+  /* the bins of the stored blocks belong to the old histograms */
+  ebur128_block_store_destroy(&st->d->block_list);
+  ebur128_block_store_destroy(&st->d->short_term_block_list);
+  ebur128_release(st, st->d->block_energy_histogram);
+  ebur128_release(st, st->d->short_term_block_energy_histogram);
+  ebur128_free_histogram_tables(st);
+  st->d->histogram_resolution = bins_per_lu;
+  st->d->histogram_bins = 100 * (size_t) bins_per_lu;
+  st->d->block_energy_histogram = (unsigned long*)
+      ebur128_calloc(st, st->d->histogram_bins, sizeof(unsigned long));
+  st->d->short_term_block_energy_histogram = (unsigned long*)
+      ebur128_calloc(st, st->d->histogram_bins, sizeof(unsigned long));
+  if (!st->d->block_energy_histogram ||
+      !st->d->short_term_block_energy_histogram) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ebur128_track_histogram_blocks(st);
+  if (bins_per_lu == EBUR128_HISTOGRAM_RESOLUTION) {
+    ebur128_init_shared_tables();
+    st->d->histogram_energies = default_histogram_energies;
+    st->d->histogram_energy_boundaries = default_histogram_energy_boundaries;
+    return EBUR128_SUCCESS;
+  }
+  energies = (double*) ebur128_alloc(st, st->d->histogram_bins *
+                                           sizeof(double));
+  boundaries = (double*) ebur128_alloc(st, (st->d->histogram_bins + 1) *
+                                           sizeof(double));
+  st->d->histogram_energies = energies;
+  st->d->histogram_energy_boundaries = boundaries;
+  if (!energies || !boundaries) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ebur128_fill_histogram_tables(energies, boundaries, bins_per_lu);
+  return EBUR128_SUCCESS;
+}
+
+/* Drops the sub-blocks, including the current unfinished one. */
+static void ebur128_reset_subblocks(ebur128_state* st) {
+  size_t i;
+  for (i = 0; i < st->d->subblocks; ++i) {
+    st->d->subblock_energy[i] = 0.0;
+  }
+  for (i = 0; i < st->channels; ++i) {
+    st->d->channel_energy[i] = 0.0;
+  }
+  st->d->subblock_index = 0;
+  st->d->subblock_count = 0;
+  st->d->needed_frames = st->d->samples_in_100ms;
+}
+
+static int ebur128_init_subblocks(ebur128_state* st) {
+  ebur128_release(st, st->d->subblock_energy);
+  /* round window up to multiple of 100ms */
+  st->d->subblocks = st->d->window / 100 + (st->d->window % 100 ? 1 : 0);
+  st->d->subblock_energy = (double*) ebur128_alloc(st, st->d->subblocks *
+                                                       sizeof(double));
+  if (!st->d->subblock_energy) return EBUR128_ERROR_NOMEM;
+  ebur128_reset_subblocks(st);
   return EBUR128_SUCCESS;
 }
 
@@ -279,243 +1349,394 @@ static int ebur128_init_resampler(ebur128_state* st) {
   int errcode = EBUR128_SUCCESS;
 
   if (st->samplerate < 96000) {
-    st->d->interp = interp_create(49, 4, st->channels);
+    st->d->interp = interp_create(st, 49, 4, st->channels);
     CHECK_ERROR(!st->d->interp, EBUR128_ERROR_NOMEM, exit)
   } else if (st->samplerate < 192000) {
-    st->d->interp = interp_create(49, 2, st->channels);
+    st->d->interp = interp_create(st, 49, 2, st->channels);
     CHECK_ERROR(!st->d->interp, EBUR128_ERROR_NOMEM, exit)
   } else {
     st->d->resampler_buffer_input = NULL;
-    st->d->resampler_buffer_output = NULL;
     st->d->interp = NULL;
     goto exit;
   }
 
-  st->d->resampler_buffer_input_frames = st->d->samples_in_100ms * 4;
-  st->d->resampler_buffer_input = malloc(st->d->resampler_buffer_input_frames *
-                                      st->channels *
-                                      sizeof(float));
+  st->d->resampler_buffer_input = ebur128_alloc(st, EBUR128_TILE_FRAMES *
+                                                     st->channels *
+                                                     sizeof(float));
   CHECK_ERROR(!st->d->resampler_buffer_input, EBUR128_ERROR_NOMEM, free_interp)
 
-  st->d->resampler_buffer_output_frames =
-                                    st->d->resampler_buffer_input_frames *
-                                    st->d->interp->factor;
-  st->d->resampler_buffer_output = malloc
-                                      (st->d->resampler_buffer_output_frames *
-                                       st->channels *
-                                       sizeof(float));
-  CHECK_ERROR(!st->d->resampler_buffer_output, EBUR128_ERROR_NOMEM, free_input)
-
   return errcode;
 
 free_interp:
-  interp_destroy(st->d->interp);
+  interp_destroy(st, st->d->interp);
   st->d->interp = NULL;
-free_input:
-  free(st->d->resampler_buffer_input);
-  st->d->resampler_buffer_input = NULL;
 exit:
   return errcode;
 }
 
 static void ebur128_destroy_resampler(ebur128_state* st) {
-  free(st->d->resampler_buffer_input);
+  ebur128_release(st, st->d->resampler_buffer_input);
   st->d->resampler_buffer_input = NULL;
-  free(st->d->resampler_buffer_output);
-  st->d->resampler_buffer_output = NULL;
-  interp_destroy(st->d->interp);
+  interp_destroy(st, st->d->interp);
   st->d->interp = NULL;
 }
 
-void ebur128_get_version(int* major, int* minor, int* patch) {
-  *major = EBUR128_VERSION_MAJOR;
-  *minor = EBUR128_VERSION_MINOR;
-  *patch = EBUR128_VERSION_PATCH;
+/* Copies the format dependent parts of the state to f. */
+static void ebur128_save_format(const ebur128_state* st,
+                                struct ebur128_format* f) {
+  f->channels = st->channels;
+  f->samplerate = st->samplerate;
+  f->used = st->d->format_clock;
+  f->channel_map = st->d->channel_map;
+  memcpy(f->b, st->d->b, sizeof(f->b));
+  memcpy(f->a, st->d->a, sizeof(f->a));
+  f->v = st->d->v;
+  f->channel_energy = st->d->channel_energy;
+  f->sample_peak = st->d->sample_peak;
+  f->prev_sample_peak = st->d->prev_sample_peak;
+  f->true_peak = st->d->true_peak;
+  f->prev_true_peak = st->d->prev_true_peak;
+  f->interp = st->d->interp;
+  f->resampler_buffer_input = st->d->resampler_buffer_input;
+  f->planes = st->d->planes;
 }
 
-ebur128_state* ebur128_init(unsigned int channels,
-                            unsigned long samplerate,
-                            int mode) {
-  int result;
-  int errcode;
-  ebur128_state* st;
+/* Makes f the format of the state. */
+static void ebur128_load_format(ebur128_state* st,
+                                const struct ebur128_format* f) {
+  st->channels = f->channels;
+  st->samplerate = f->samplerate;
+  st->d->samples_in_100ms = (st->samplerate + 5) / 10;
+  st->d->channel_map = f->channel_map;
+  memcpy(st->d->b, f->b, sizeof(f->b));
+  memcpy(st->d->a, f->a, sizeof(f->a));
+  st->d->v = f->v;
+  st->d->channel_energy = f->channel_energy;
+  st->d->sample_peak = f->sample_peak;
+  st->d->prev_sample_peak = f->prev_sample_peak;
+  st->d->true_peak = f->true_peak;
+  st->d->prev_true_peak = f->prev_true_peak;
+  st->d->interp = f->interp;
+  st->d->resampler_buffer_input = f->resampler_buffer_input;
+  st->d->planes = f->planes;
+}
+
+static void ebur128_free_format(ebur128_state* st, struct ebur128_format* f) {
+  if (!f->channels) return;
+  ebur128_release(st, f->channel_map);
+  ebur128_release(st, f->v);
+  ebur128_release(st, f->channel_energy);
+  ebur128_release(st, f->sample_peak);
+  ebur128_release(st, f->prev_sample_peak);
+  ebur128_release(st, f->true_peak);
+  ebur128_release(st, f->prev_true_peak);
+  interp_destroy(st, f->interp);
+  ebur128_release(st, f->resampler_buffer_input);
+  ebur128_release(st, f->planes);
+  f->channels = 0;
+}
+
+/* Allocates and initializes the format dependent parts of the state for
+ * st->channels and st->samplerate. The parts used for every sample come
+ * first, so that they are next to each other in an arena. On error, the
+ * parts allocated so far are left for ebur128_destroy. */
+static int ebur128_init_format(ebur128_state* st) {
+  int errcode = EBUR128_SUCCESS;
+  unsigned int channels = st->channels;
   unsigned int i;
-  size_t j;
 
-  st = (ebur128_state*) malloc(sizeof(ebur128_state));
-  CHECK_ERROR(!st, 0, exit)
-  st->d = (struct ebur128_state_internal*)
-          malloc(sizeof(struct ebur128_state_internal));
-  CHECK_ERROR(!st->d, 0, free_state)
-  st->channels = channels;
+  st->d->samples_in_100ms = (st->samplerate + 5) / 10;
+  st->d->v = (double*) ebur128_alloc(st, 5 * channels * sizeof(double));
+  CHECK_ERROR(!st->d->v, EBUR128_ERROR_NOMEM, exit)
+  st->d->channel_energy = (double*) ebur128_alloc(st, channels *
+                                                      sizeof(double));
+  CHECK_ERROR(!st->d->channel_energy, EBUR128_ERROR_NOMEM, exit)
+  st->d->prev_sample_peak = (double*) ebur128_alloc(st, channels *
+                                                        sizeof(double));
+  CHECK_ERROR(!st->d->prev_sample_peak, EBUR128_ERROR_NOMEM, exit)
+  st->d->prev_true_peak = (double*) ebur128_alloc(st, channels *
+                                                      sizeof(double));
+  CHECK_ERROR(!st->d->prev_true_peak, EBUR128_ERROR_NOMEM, exit)
+  st->d->planes = (const void**) ebur128_alloc(st, channels * sizeof(void*));
+  CHECK_ERROR(!st->d->planes, EBUR128_ERROR_NOMEM, exit)
+  errcode = ebur128_init_resampler(st);
+  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+
   errcode = ebur128_init_channel_map(st);
-  CHECK_ERROR(errcode, 0, free_internal)
-
-  st->d->sample_peak = (double*) malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->sample_peak, 0, free_channel_map)
-  st->d->prev_sample_peak = (double*) malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->prev_sample_peak, 0, free_sample_peak)
-  st->d->true_peak = (double*) malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->true_peak, 0, free_prev_sample_peak)
-  st->d->prev_true_peak = (double*) malloc(channels * sizeof(double));
-  CHECK_ERROR(!st->d->prev_true_peak, 0, free_true_peak)
+  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  st->d->sample_peak = (double*) ebur128_alloc(st, channels * sizeof(double));
+  CHECK_ERROR(!st->d->sample_peak, EBUR128_ERROR_NOMEM, exit)
+  st->d->true_peak = (double*) ebur128_alloc(st, channels * sizeof(double));
+  CHECK_ERROR(!st->d->true_peak, EBUR128_ERROR_NOMEM, exit)
   for (i = 0; i < channels; ++i) {
     st->d->sample_peak[i] = 0.0;
     st->d->prev_sample_peak[i] = 0.0;
     st->d->true_peak[i] = 0.0;
     st->d->prev_true_peak[i] = 0.0;
   }
+  ebur128_init_filter(st);
 
+exit:
+  return errcode;
+}
+
+/* Bytes of a part of the state, rounded up as in an arena if layout is set.
+ * Otherwise parts in the arena do not count, the arena counts as a whole. */
+static size_t ebur128_part_size(const ebur128_state* st, const void* p,
+                                size_t size, int layout) {
+  if (!p) return 0;
+  if (layout) return EBUR128_ARENA_ROUND(size);
+  return ebur128_in_arena(st, p) ? 0 : size;
+}
+
+static size_t ebur128_format_size(const ebur128_state* st,
+                                  const struct ebur128_format* f,
+                                  int layout) {
+  size_t size = 0, ch = f->channels;
+  if (!ch) return 0;
+  size += ebur128_part_size(st, f->channel_map, ch * sizeof(int), layout);
+  size += ebur128_part_size(st, f->v, 5 * ch * sizeof(double), layout);
+  size += ebur128_part_size(st, f->channel_energy, ch * sizeof(double),
+                            layout);
+  size += ebur128_part_size(st, f->sample_peak, ch * sizeof(double), layout);
+  size += ebur128_part_size(st, f->prev_sample_peak, ch * sizeof(double),
+                            layout);
+  size += ebur128_part_size(st, f->true_peak, ch * sizeof(double), layout);
+  size += ebur128_part_size(st, f->prev_true_peak, ch * sizeof(double),
+                            layout);
+  size += ebur128_part_size(st, f->planes, ch * sizeof(void*), layout);
+  size += ebur128_part_size(st, f->resampler_buffer_input,
+                            EBUR128_TILE_FRAMES * ch * sizeof(float), layout);
+  if (f->interp) {
+    const interpolator* interp = f->interp;
+    size += ebur128_part_size(st, interp, sizeof(interpolator), layout);
+    size += ebur128_part_size(st, interp->coeff,
+                              interp->delay * INTERP_LANES * sizeof(float),
+                              layout);
+    size += ebur128_part_size(st, interp->z, ch * sizeof(float*), layout);
+    size += ebur128_part_size(st, interp->zbuf,
+                              ch * 2 * interp->delay * sizeof(float), layout);
+  }
+  return size;
+}
+
+static size_t ebur128_block_store_size(const ebur128_state* st,
+                                       const struct ebur128_block_store* bs,
+                                       int layout) {
+  return ebur128_part_size(st, bs->pages, bs->page_slots * sizeof(char*),
+                           layout) +
+         bs->page_count * EBUR128_BLOCK_PAGE_SIZE * bs->block_size +
+         ebur128_part_size(st, bs->tree.nodes, bs->tree.capacity *
+                           sizeof(struct ebur128_tree_node), layout);
+}
+
+/* Bytes held by the state. With layout set, the size of an arena that
+ * holds all of it. */
+static size_t ebur128_footprint(const ebur128_state* st, int layout) {
+  struct ebur128_format current;
+  size_t size, i;
+  if (layout) {
+    size = EBUR128_ARENA_LINE - 1 +
+           EBUR128_ARENA_ROUND(sizeof(ebur128_state)) +
+           EBUR128_ARENA_ROUND(sizeof(struct ebur128_state_internal));
+  } else if (st->d->arena) {
+    size = (size_t) (st->d->arena_end - st->d->arena);
+  } else {
+    size = sizeof(ebur128_state) + sizeof(struct ebur128_state_internal);
+  }
+  ebur128_save_format(st, &current);
+  size += ebur128_format_size(st, &current, layout);
+  for (i = 0; i < EBUR128_FORMATS; ++i) {
+    size += ebur128_format_size(st, &st->d->formats[i], layout);
+  }
+  size += ebur128_part_size(st, st->d->subblock_energy,
+                            st->d->subblocks * sizeof(double), layout);
+  size += ebur128_part_size(st, st->d->block_energy_histogram,
+                            st->d->histogram_bins * sizeof(unsigned long),
+                            layout);
+  size += ebur128_part_size(st, st->d->short_term_block_energy_histogram,
+                            st->d->histogram_bins * sizeof(unsigned long),
+                            layout);
+  if (st->d->histogram_energies != default_histogram_energies) {
+    size += ebur128_part_size(st, st->d->histogram_energies,
+                              st->d->histogram_bins * sizeof(double), layout);
+    size += ebur128_part_size(st, st->d->histogram_energy_boundaries,
+                              (st->d->histogram_bins + 1) * sizeof(double),
+                              layout);
+  }
+  size += ebur128_block_store_size(st, &st->d->block_list, layout);
+  size += ebur128_block_store_size(st, &st->d->short_term_block_list, layout);
+  if (st->d->pool) {
+    size += sizeof(struct ebur128_pool) +
+            (st->d->pool->threads - 1) * sizeof(struct ebur128_worker);
+  }
+  return size;
+}
+
+void ebur128_get_version(int* major, int* minor, int* patch) {
+  *major = EBUR128_VERSION_MAJOR;
+  *minor = EBUR128_VERSION_MINOR;
+  *patch = EBUR128_VERSION_PATCH;
+}
+
+/* Creates a state in arena, or on the heap if arena is NULL. */
+static ebur128_state* ebur128_init_in(void* arena, size_t size,
+                                      unsigned int channels,
+                                      unsigned long samplerate,
+                                      int mode) {
+  int errcode;
+  int encoding = EBUR128_BLOCKS_DOUBLE;
+  ebur128_state* st;
+  struct ebur128_state_internal* d;
+
+  if (mode & EBUR128_MODE_HISTORY_FLOAT) {
+    if (mode & EBUR128_MODE_HISTORY_LOG16) return NULL;
+    encoding = EBUR128_BLOCKS_FLOAT;
+  } else if (mode & EBUR128_MODE_HISTORY_LOG16) {
+    encoding = EBUR128_BLOCKS_LOG16;
+    ebur128_init_shared_tables();
+  }
+  if (mode & EBUR128_MODE_HISTOGRAM) {
+    encoding = EBUR128_BLOCKS_BIN;
+  }
+  if (arena) {
+    char* begin = (char*) arena +
+                  ((EBUR128_ARENA_LINE - (size_t) arena % EBUR128_ARENA_LINE) %
+                   EBUR128_ARENA_LINE);
+    char* next = begin + EBUR128_ARENA_ROUND(sizeof(ebur128_state)) +
+                 EBUR128_ARENA_ROUND(sizeof(struct ebur128_state_internal));
+    if (next > (char*) arena + size) return NULL;
+    st = (ebur128_state*) begin;
+    d = (struct ebur128_state_internal*)
+        (begin + EBUR128_ARENA_ROUND(sizeof(ebur128_state)));
+    memset(d, 0, sizeof(*d));
+    d->arena = (char*) arena;
+    d->arena_next = next;
+    d->arena_end = (char*) arena + size;
+  } else {
+    st = (ebur128_state*) EBUR128_MALLOC(sizeof(ebur128_state));
+    if (!st) return NULL;
+    d = (struct ebur128_state_internal*)
+        EBUR128_MALLOC(sizeof(struct ebur128_state_internal));
+    if (!d) {
+      EBUR128_FREE(st);
+      return NULL;
+    }
+    /* all parts NULL, so that ebur128_destroy can clean up after errors */
+    memset(d, 0, sizeof(*d));
+  }
+  st->d = d;
+  st->mode = mode;
+  st->channels = channels;
+  st->samplerate = samplerate;
   st->d->use_histogram = mode & EBUR128_MODE_HISTOGRAM ? 1 : 0;
   st->d->history = ULONG_MAX;
-  st->samplerate = samplerate;
-  st->d->samples_in_100ms = (st->samplerate + 5) / 10;
-  st->mode = mode;
+  /* keep block energies sorted for ebur128_loudness_global and
+   * short-term energies for ebur128_loudness_range, unless they are stored
+   * compactly */
+  ebur128_block_store_init(&st->d->block_list,
+                           st->d->history / 100, encoding,
+                           encoding == EBUR128_BLOCKS_DOUBLE &&
+                           !st->d->use_histogram &&
+                           (mode & EBUR128_MODE_I) == EBUR128_MODE_I);
+  ebur128_block_store_init(&st->d->short_term_block_list,
+                           st->d->history / 3000, encoding,
+                           encoding == EBUR128_BLOCKS_DOUBLE &&
+                           !st->d->use_histogram &&
+                           (mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA);
   if ((mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
     st->d->window = 3000;
   } else if ((mode & EBUR128_MODE_M) == EBUR128_MODE_M) {
     st->d->window = 400;
   } else {
-    goto free_prev_true_peak;
+    goto fail;
   }
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
-    /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames = st->d->audio_data_frames
-                             + st->d->samples_in_100ms
-                             - (st->d->audio_data_frames % st->d->samples_in_100ms);
-  }
-  st->d->audio_data = (double*) malloc(st->d->audio_data_frames *
-                                       st->channels *
-                                       sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, 0, free_true_peak)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[i] = 0.0;
-  }
-
-  ebur128_init_filter(st);
 
+  errcode = ebur128_init_format(st);
+  CHECK_ERROR(errcode, 0, fail)
+  errcode = ebur128_init_subblocks(st);
+  CHECK_ERROR(errcode, 0, fail)
   if (st->d->use_histogram) {
-    st->d->block_energy_histogram = malloc(1000 * sizeof(unsigned long));
-    CHECK_ERROR(!st->d->block_energy_histogram, 0, free_audio_data)
-    for (i = 0; i < 1000; ++i) {
-      st->d->block_energy_histogram[i] = 0;
-    }
-  } else {
-    st->d->block_energy_histogram = NULL;
+    errcode = ebur128_init_histogram(st, EBUR128_HISTOGRAM_RESOLUTION);
+    CHECK_ERROR(errcode, 0, fail)
   }
-  if (st->d->use_histogram) {
-    st->d->short_term_block_energy_histogram = malloc(1000 * sizeof(unsigned long));
-    CHECK_ERROR(!st->d->short_term_block_energy_histogram, 0, free_block_energy_histogram)
-    for (i = 0; i < 1000; ++i) {
-      st->d->short_term_block_energy_histogram[i] = 0;
-    }
-  } else {
-    st->d->short_term_block_energy_histogram = NULL;
-  }
-  STAILQ_INIT(&st->d->block_list);
-  st->d->block_list_size = 0;
-  st->d->block_list_max = st->d->history / 100;
-  STAILQ_INIT(&st->d->short_term_block_list);
-  st->d->st_block_list_size = 0;
-  st->d->st_block_list_max = st->d->history / 3000;
-  st->d->short_term_frame_counter = 0;
+  return st;
 
-  result = ebur128_init_resampler(st);
-  CHECK_ERROR(result, 0, free_short_term_block_energy_histogram)
+fail:
+  ebur128_destroy(&st);
+  return NULL;
+}
 
-  /* the first block needs 400ms of audio data */
-  st->d->needed_frames = st->d->samples_in_100ms * 4;
-  /* start at the beginning of the buffer */
-  st->d->audio_data_index = 0;
+ebur128_state* ebur128_init(unsigned int channels,
+                            unsigned long samplerate,
+                            int mode) {
+  return ebur128_init_in(NULL, 0, channels, samplerate, mode);
+}
 
-  /* initialize static constants */
-  relative_gate_factor = pow(10.0, relative_gate / 10.0);
-  minus_twenty_decibels = pow(10.0, -20.0 / 10.0);
-  histogram_energy_boundaries[0] = pow(10.0, (-70.0 + 0.691) / 10.0);
-  if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
-      histogram_energies[i] = pow(10.0, ((double) i / 10.0 - 69.95 + 0.691) / 10.0);
-    }
-    for (i = 1; i < 1001; ++i) {
-      histogram_energy_boundaries[i] = pow(10.0, ((double) i / 10.0 - 70.0 + 0.691) / 10.0);
-    }
-  }
+size_t ebur128_arena_size(unsigned int channels,
+                          unsigned long samplerate,
+                          int mode) {
+  ebur128_state* st = ebur128_init(channels, samplerate, mode);
+  size_t size;
+  if (!st) return 0;
+  size = ebur128_footprint(st, 1);
+  ebur128_destroy(&st);
+  return size;
+}
 
-  return st;
+ebur128_state* ebur128_init_arena(void* arena, size_t size,
+                                  unsigned int channels,
+                                  unsigned long samplerate,
+                                  int mode) {
+  if (!arena) return NULL;
+  return ebur128_init_in(arena, size, channels, samplerate, mode);
+}
 
-free_short_term_block_energy_histogram:
-  free(st->d->short_term_block_energy_histogram);
-free_block_energy_histogram:
-  free(st->d->block_energy_histogram);
-free_audio_data:
-  free(st->d->audio_data);
-free_prev_true_peak:
-  free(st->d->prev_true_peak);
-free_true_peak:
-  free(st->d->true_peak);
-free_prev_sample_peak:
-  free(st->d->prev_sample_peak);
-free_sample_peak:
-  free(st->d->sample_peak);
-free_channel_map:
-  free(st->d->channel_map);
-free_internal:
-  free(st->d);
-free_state:
-  free(st);
-exit:
-  return NULL;
+size_t ebur128_get_footprint(const ebur128_state* st) {
+  return ebur128_footprint(st, 0);
 }
 
 void ebur128_destroy(ebur128_state** st) {
-  struct ebur128_dq_entry* entry;
-  free((*st)->d->block_energy_histogram);
-  free((*st)->d->short_term_block_energy_histogram);
-  free((*st)->d->audio_data);
-  free((*st)->d->channel_map);
-  free((*st)->d->sample_peak);
-  free((*st)->d->prev_sample_peak);
-  free((*st)->d->true_peak);
-  free((*st)->d->prev_true_peak);
-  while (!STAILQ_EMPTY(&(*st)->d->block_list)) {
-    entry = STAILQ_FIRST(&(*st)->d->block_list);
-    STAILQ_REMOVE_HEAD(&(*st)->d->block_list, entries);
-    free(entry);
-  }
-  while (!STAILQ_EMPTY(&(*st)->d->short_term_block_list)) {
-    entry = STAILQ_FIRST(&(*st)->d->short_term_block_list);
-    STAILQ_REMOVE_HEAD(&(*st)->d->short_term_block_list, entries);
-    free(entry);
+  struct ebur128_state_internal* d = (*st)->d;
+  size_t i;
+  for (i = 0; i < EBUR128_FORMATS; ++i) {
+    ebur128_free_format(*st, &d->formats[i]);
   }
+  ebur128_release(*st, d->block_energy_histogram);
+  ebur128_release(*st, d->short_term_block_energy_histogram);
+  ebur128_free_histogram_tables(*st);
+  ebur128_release(*st, d->channel_energy);
+  ebur128_release(*st, d->subblock_energy);
+  ebur128_release(*st, d->channel_map);
+  ebur128_release(*st, d->sample_peak);
+  ebur128_release(*st, d->prev_sample_peak);
+  ebur128_release(*st, d->true_peak);
+  ebur128_release(*st, d->prev_true_peak);
+  ebur128_release(*st, d->v);
+  ebur128_block_store_destroy(&d->block_list);
+  ebur128_block_store_destroy(&d->short_term_block_list);
+  ebur128_release(*st, d->planes);
   ebur128_destroy_resampler(*st);
-  free((*st)->d);
-  free(*st);
+  if (d->pool) {
+    ebur128_pool_destroy(d->pool, d->pool->threads - 1);
+  }
+  if (!d->arena) {
+    EBUR128_FREE(d);
+    EBUR128_FREE(*st);
+  }
   *st = NULL;
 }
 
-static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
-  size_t c, i;
-  interp_process(st->d->interp, frames, 
-                 st->d->resampler_buffer_input,
-                 st->d->resampler_buffer_output);
-  for (c = 0; c < st->channels; ++c) {
-    for (i = 0; i < st->d->resampler_buffer_output_frames; ++i) {
-      if (st->d->resampler_buffer_output[i * st->channels + c] >
-                                                         st->d->prev_true_peak[c]) {
-        st->d->prev_true_peak[c] =
-            st->d->resampler_buffer_output[i * st->channels + c];
-      } else if (-st->d->resampler_buffer_output[i * st->channels + c] >
-                                                         st->d->prev_true_peak[c]) {
-        st->d->prev_true_peak[c] =
-           -st->d->resampler_buffer_output[i * st->channels + c];
-      }
-    }
-  }
+/* Interpolates frames samples of channel c from the resampler input buffer
+ * and updates its true peak. */
+static void ebur128_check_true_peak(ebur128_state* st, size_t frames,
+                                    unsigned int zi, size_t c) {
+  float* in = st->d->resampler_buffer_input + c * EBUR128_TILE_FRAMES;
+  float peak = interp_process(st->d->interp, frames, in, (unsigned int) c, zi);
+  if (peak > st->d->prev_true_peak[c]) st->d->prev_true_peak[c] = peak;
 }
 
 #ifdef __SSE2_MATH__
-#include <xmmintrin.h>
 #define TURN_ON_FTZ \
         unsigned int mxcsr = _mm_getcsr(); \
         _mm_setcsr(mxcsr | _MM_FLUSH_ZERO_ON);
@@ -526,124 +1747,470 @@ static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
 #define TURN_ON_FTZ
 #define TURN_OFF_FTZ
 #define FLUSH_MANUALLY \
-    st->d->v[ci][4] = fabs(st->d->v[ci][4]) < DBL_MIN ? 0.0 : st->d->v[ci][4]; \
-    st->d->v[ci][3] = fabs(st->d->v[ci][3]) < DBL_MIN ? 0.0 : st->d->v[ci][3]; \
-    st->d->v[ci][2] = fabs(st->d->v[ci][2]) < DBL_MIN ? 0.0 : st->d->v[ci][2]; \
-    st->d->v[ci][1] = fabs(st->d->v[ci][1]) < DBL_MIN ? 0.0 : st->d->v[ci][1];
+    v[4 * n] = fabs(v[4 * n]) < DBL_MIN ? 0.0 : v[4 * n]; \
+    v[3 * n] = fabs(v[3 * n]) < DBL_MIN ? 0.0 : v[3 * n]; \
+    v[2 * n] = fabs(v[2 * n]) < DBL_MIN ? 0.0 : v[2 * n]; \
+    v[1 * n] = fabs(v[1 * n]) < DBL_MIN ? 0.0 : v[1 * n];
 #endif
 
-#define EBUR128_FILTER(type, min_scale, max_scale)                             \
-static void ebur128_filter_##type(ebur128_state* st, const type* src,          \
-                                  size_t frames) {                             \
-  static double scaling_factor = -((double) min_scale) > (double) max_scale ?  \
-                                 -((double) min_scale) : (double) max_scale;   \
-  double* audio_data = st->d->audio_data + st->d->audio_data_index;            \
+/* Channel c of the input is read from chan[c][i * stride], with stride
+ * st->channels for interleaved and 1 for planar input. Every sample is read
+ * once: a single pass converts it, updates the sample peak, stages it for the
+ * true peak and runs it through the BS.1770 filter. The filter recurrence is
+ * bound by latency, so the other stages fit in its shadow. With true peak on,
+ * the pass runs a tile at a time and the interpolator picks up each tile from
+ * resampler_buffer_input while it is still in the L1 cache.
+ *
+ * Samples are scaled by the reciprocal of the full scale value. All of them
+ * are powers of two, so this is exact and the same as dividing. */
+
+/* SIMD versions of the fused pass. They run the same recurrence and energy
+ * sum as the scalar loop in EBUR128_PROCESS, but on 2 (SSE2) or 4 (AVX)
+ * adjacent channels at once, keeping the filter state of those channels in
+ * registers for the whole call. Every lane performs exactly the same
+ * operations in the same order as the scalar code, so the results are
+ * bit-identical to it. peak and in may be NULL if sample or true peak are
+ * not wanted. */
+#ifdef __SSE2_MATH__
+/* Returns 1 if none of the channels [c, c + count) contribute to loudness. */
+static int ebur128_channels_unused(ebur128_state* st, size_t c, size_t count) {
+  size_t i;
+  for (i = c; i < c + count; ++i) {
+    if (st->d->channel_map[i] != EBUR128_UNUSED) return 0;
+  }
+  return 1;
+}
+
+/* Raises peak[0..count) to the lanes of the vector stored in lanes. */
+static void ebur128_store_peaks(double* peak, const double* lanes,
+                                size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    if (lanes[i] > peak[i]) peak[i] = lanes[i];
+  }
+}
+
+#define EBUR128_LOAD2_short(p, q)  _mm_set_pd((double) *(q), (double) *(p))
+#define EBUR128_LOAD2_int(p, q)    _mm_cvtepi32_pd(_mm_unpacklo_epi32(         \
+                                       _mm_cvtsi32_si128(*(p)),                \
+                                       _mm_cvtsi32_si128(*(q))))
+#define EBUR128_LOAD2_float(p, q)  _mm_cvtps_pd(_mm_unpacklo_ps(               \
+                                       _mm_load_ss(p), _mm_load_ss(q)))
+#define EBUR128_LOAD2_double(p, q) _mm_loadh_pd(_mm_load_sd(p), q)
+
+#define EBUR128_FILTER_SSE2(type)                                              \
+static void ebur128_filter2_##type(ebur128_state* st,                          \
+                                   const type* p0, const type* p1,             \
+                                   size_t stride, size_t frames, size_t c,     \
+                                   double scale, double* peak, float* in) {    \
+  const size_t n = st->channels;                                               \
+  double* v = st->d->v + c;                                                    \
+  double* energy = st->d->channel_energy + c;                                  \
+  const __m128d rscale = _mm_set1_pd(scale);                                   \
+  const __m128d sign = _mm_set1_pd(-0.0);                                      \
+  const __m128d a1 = _mm_set1_pd(st->d->a[1]);                                 \
+  const __m128d a2 = _mm_set1_pd(st->d->a[2]);                                 \
+  const __m128d a3 = _mm_set1_pd(st->d->a[3]);                                 \
+  const __m128d a4 = _mm_set1_pd(st->d->a[4]);                                 \
+  const __m128d b0 = _mm_set1_pd(st->d->b[0]);                                 \
+  const __m128d b1 = _mm_set1_pd(st->d->b[1]);                                 \
+  const __m128d b2 = _mm_set1_pd(st->d->b[2]);                                 \
+  const __m128d b3 = _mm_set1_pd(st->d->b[3]);                                 \
+  const __m128d b4 = _mm_set1_pd(st->d->b[4]);                                 \
+  __m128d v1 = _mm_loadu_pd(v + 1 * n);                                        \
+  __m128d v2 = _mm_loadu_pd(v + 2 * n);                                        \
+  __m128d v3 = _mm_loadu_pd(v + 3 * n);                                        \
+  __m128d v4 = _mm_loadu_pd(v + 4 * n);                                        \
+  __m128d sum = _mm_setzero_pd();                                              \
+  __m128d max = _mm_setzero_pd();                                              \
+  __m128d x, v0, y;                                                            \
+  double lanes[2];                                                             \
+  size_t i;                                                                    \
+  for (i = 0; i < frames; ++i) {                                               \
+    x  = _mm_mul_pd(EBUR128_LOAD2_##type(p0 + i * stride, p1 + i * stride),    \
+                    rscale);                                                   \
+    max = _mm_max_pd(_mm_andnot_pd(sign, x), max);                             \
+    if (in) {                                                                  \
+      __m128 f = _mm_cvtpd_ps(x);                                              \
+      _mm_store_ss(in + i, f);                                                 \
+      _mm_store_ss(in + EBUR128_TILE_FRAMES + i,                               \
+                   _mm_shuffle_ps(f, f, _MM_SHUFFLE(1, 1, 1, 1)));             \
+    }                                                                          \
+    v0 = _mm_sub_pd(x,  _mm_mul_pd(a1, v1));                                   \
+    v0 = _mm_sub_pd(v0, _mm_mul_pd(a2, v2));                                   \
+    v0 = _mm_sub_pd(v0, _mm_mul_pd(a3, v3));                                   \
+    v0 = _mm_sub_pd(v0, _mm_mul_pd(a4, v4));                                   \
+    y  = _mm_mul_pd(b0, v0);                                                   \
+    y  = _mm_add_pd(y, _mm_mul_pd(b1, v1));                                    \
+    y  = _mm_add_pd(y, _mm_mul_pd(b2, v2));                                    \
+    y  = _mm_add_pd(y, _mm_mul_pd(b3, v3));                                    \
+    y  = _mm_add_pd(y, _mm_mul_pd(b4, v4));                                    \
+    sum = _mm_add_pd(sum, _mm_mul_pd(y, y));                                   \
+    v4 = v3;                                                                   \
+    v3 = v2;                                                                   \
+    v2 = v1;                                                                   \
+    v1 = v0;                                                                   \
+  }                                                                            \
+  _mm_storeu_pd(v + 1 * n, v1);                                                \
+  _mm_storeu_pd(v + 2 * n, v2);                                                \
+  _mm_storeu_pd(v + 3 * n, v3);                                                \
+  _mm_storeu_pd(v + 4 * n, v4);                                                \
+  _mm_storeu_pd(energy, _mm_add_pd(_mm_loadu_pd(energy), sum));                \
+  if (peak) {                                                                  \
+    _mm_storeu_pd(lanes, max);                                                 \
+    ebur128_store_peaks(peak, lanes, 2);                                       \
+  }                                                                            \
+}
+EBUR128_FILTER_SSE2(short)
+EBUR128_FILTER_SSE2(int)
+EBUR128_FILTER_SSE2(float)
+EBUR128_FILTER_SSE2(double)
+#endif
+
+#ifdef __AVX__
+#define EBUR128_LOAD4_short(p0, p1, p2, p3)                                    \
+    _mm256_set_pd((double) *(p3), (double) *(p2),                              \
+                  (double) *(p1), (double) *(p0))
+#define EBUR128_LOAD4_int(p0, p1, p2, p3)                                      \
+    _mm256_cvtepi32_pd(_mm_set_epi32(*(p3), *(p2), *(p1), *(p0)))
+#define EBUR128_LOAD4_float(p0, p1, p2, p3)                                    \
+    _mm256_cvtps_pd(_mm_set_ps(*(p3), *(p2), *(p1), *(p0)))
+#define EBUR128_LOAD4_double(p0, p1, p2, p3)                                   \
+    _mm256_set_pd(*(p3), *(p2), *(p1), *(p0))
+
+#define EBUR128_FILTER_AVX(type)                                               \
+static void ebur128_filter4_##type(ebur128_state* st,                          \
+                                   const type* p0, const type* p1,             \
+                                   const type* p2, const type* p3,             \
+                                   size_t stride, size_t frames, size_t c,     \
+                                   double scale, double* peak, float* in) {    \
+  const size_t n = st->channels;                                               \
+  double* v = st->d->v + c;                                                    \
+  double* energy = st->d->channel_energy + c;                                  \
+  const __m256d rscale = _mm256_set1_pd(scale);                                \
+  const __m256d sign = _mm256_set1_pd(-0.0);                                   \
+  const __m256d a1 = _mm256_set1_pd(st->d->a[1]);                              \
+  const __m256d a2 = _mm256_set1_pd(st->d->a[2]);                              \
+  const __m256d a3 = _mm256_set1_pd(st->d->a[3]);                              \
+  const __m256d a4 = _mm256_set1_pd(st->d->a[4]);                              \
+  const __m256d b0 = _mm256_set1_pd(st->d->b[0]);                              \
+  const __m256d b1 = _mm256_set1_pd(st->d->b[1]);                              \
+  const __m256d b2 = _mm256_set1_pd(st->d->b[2]);                              \
+  const __m256d b3 = _mm256_set1_pd(st->d->b[3]);                              \
+  const __m256d b4 = _mm256_set1_pd(st->d->b[4]);                              \
+  __m256d v1 = _mm256_loadu_pd(v + 1 * n);                                     \
+  __m256d v2 = _mm256_loadu_pd(v + 2 * n);                                     \
+  __m256d v3 = _mm256_loadu_pd(v + 3 * n);                                     \
+  __m256d v4 = _mm256_loadu_pd(v + 4 * n);                                     \
+  __m256d sum = _mm256_setzero_pd();                                           \
+  __m256d max = _mm256_setzero_pd();                                           \
+  __m256d x, v0, y;                                                            \
+  double lanes[4];                                                             \
+  size_t i;                                                                    \
+  for (i = 0; i < frames; ++i) {                                               \
+    const size_t j = i * stride;                                               \
+    x  = _mm256_mul_pd(EBUR128_LOAD4_##type(p0 + j, p1 + j, p2 + j, p3 + j),   \
+                       rscale);                                                \
+    max = _mm256_max_pd(_mm256_andnot_pd(sign, x), max);                       \
+    if (in) {                                                                  \
+      __m128 f = _mm256_cvtpd_ps(x);                                           \
+      _mm_store_ss(in + i, f);                                                 \
+      _mm_store_ss(in + 1 * EBUR128_TILE_FRAMES + i,                           \
+                   _mm_shuffle_ps(f, f, _MM_SHUFFLE(1, 1, 1, 1)));             \
+      _mm_store_ss(in + 2 * EBUR128_TILE_FRAMES + i,                           \
+                   _mm_shuffle_ps(f, f, _MM_SHUFFLE(2, 2, 2, 2)));             \
+      _mm_store_ss(in + 3 * EBUR128_TILE_FRAMES + i,                           \
+                   _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 3)));             \
+    }                                                                          \
+    v0 = _mm256_sub_pd(x,  _mm256_mul_pd(a1, v1));                             \
+    v0 = _mm256_sub_pd(v0, _mm256_mul_pd(a2, v2));                             \
+    v0 = _mm256_sub_pd(v0, _mm256_mul_pd(a3, v3));                             \
+    v0 = _mm256_sub_pd(v0, _mm256_mul_pd(a4, v4));                             \
+    y  = _mm256_mul_pd(b0, v0);                                                \
+    y  = _mm256_add_pd(y, _mm256_mul_pd(b1, v1));                              \
+    y  = _mm256_add_pd(y, _mm256_mul_pd(b2, v2));                              \
+    y  = _mm256_add_pd(y, _mm256_mul_pd(b3, v3));                              \
+    y  = _mm256_add_pd(y, _mm256_mul_pd(b4, v4));                              \
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(y, y));                             \
+    v4 = v3;                                                                   \
+    v3 = v2;                                                                   \
+    v2 = v1;                                                                   \
+    v1 = v0;                                                                   \
+  }                                                                            \
+  _mm256_storeu_pd(v + 1 * n, v1);                                             \
+  _mm256_storeu_pd(v + 2 * n, v2);                                             \
+  _mm256_storeu_pd(v + 3 * n, v3);                                             \
+  _mm256_storeu_pd(v + 4 * n, v4);                                             \
+  _mm256_storeu_pd(energy, _mm256_add_pd(_mm256_loadu_pd(energy), sum));       \
+  if (peak) {                                                                  \
+    _mm256_storeu_pd(lanes, max);                                              \
+    ebur128_store_peaks(peak, lanes, 4);                                       \
+  }                                                                            \
+}
+EBUR128_FILTER_AVX(short)
+EBUR128_FILTER_AVX(int)
+EBUR128_FILTER_AVX(float)
+EBUR128_FILTER_AVX(double)
+#endif
+
+/* Channels are filtered in quads (AVX) or pairs (SSE2) where available.
+ * Define as 0, or as a variable, to use the scalar filter for all channels,
+ * e.g. to compare both. */
+#ifndef EBUR128_USE_SIMD
+#define EBUR128_USE_SIMD 1
+#endif
+
+#define EBUR128_PEAK(c) (peak ? peak + (c) : NULL)
+#define EBUR128_INPUT(c) (in ? in + (c) * EBUR128_TILE_FRAMES : NULL)
+#ifdef __AVX__
+#define EBUR128_FILTER_QUADS(type)                                             \
+  for (; EBUR128_USE_SIMD && c + 4 <= c_end; c += 4) {                         \
+    if (ebur128_channels_unused(st, c, 4)) {                                   \
+      ebur128_peaks_##type(chan, j, stride, tile_frames, c, c + 4, scale,     \
+                           peak, in);                                          \
+      continue;                                                                \
+    }                                                                          \
+    ebur128_filter4_##type(st, (const type*) chan[c] + j,                      \
+                           (const type*) chan[c + 1] + j,                      \
+                           (const type*) chan[c + 2] + j,                      \
+                           (const type*) chan[c + 3] + j,                      \
+                           stride, tile_frames, c, scale,                      \
+                           EBUR128_PEAK(c), EBUR128_INPUT(c));                 \
+  }
+#else
+#define EBUR128_FILTER_QUADS(type)
+#endif
+#ifdef __SSE2_MATH__
+#define EBUR128_FILTER_PAIRS(type)                                             \
+  for (; EBUR128_USE_SIMD && c + 2 <= c_end; c += 2) {                         \
+    if (ebur128_channels_unused(st, c, 2)) {                                   \
+      ebur128_peaks_##type(chan, j, stride, tile_frames, c, c + 2, scale,     \
+                           peak, in);                                          \
+      continue;                                                                \
+    }                                                                          \
+    ebur128_filter2_##type(st, (const type*) chan[c] + j,                      \
+                           (const type*) chan[c + 1] + j,                      \
+                           stride, tile_frames, c, scale,                      \
+                           EBUR128_PEAK(c), EBUR128_INPUT(c));                 \
+  }
+#else
+#define EBUR128_FILTER_PAIRS(type)
+#endif
+
+/* Only updates the sample peak and stages the true peak input of channels
+ * [c_begin, c_end), for those that do not contribute to loudness. */
+#define EBUR128_PEAKS(type)                                                    \
+static void ebur128_peaks_##type(const void* const* chan, size_t j,            \
+                                 size_t stride, size_t frames,                 \
+                                 size_t c_begin, size_t c_end, double scale,   \
+                                 double* peak, float* in) {                    \
+  size_t i, c;                                                                 \
+  if (!peak && !in) return;                                                    \
+  for (c = c_begin; c < c_end; ++c) {                                          \
+    const type* src = (const type*) chan[c] + j;                               \
+    float* tp = EBUR128_INPUT(c);                                              \
+    double x, max = 0.0;                                                       \
+    for (i = 0; i < frames; ++i) {                                             \
+      x = (double) src[i * stride] * scale;                                    \
+      if (x > max) {                                                           \
+        max = x;                                                               \
+      } else if (-x > max) {                                                   \
+        max = -x;                                                              \
+      }                                                                        \
+      if (tp) tp[i] = (float) x;                                               \
+    }                                                                          \
+    if (peak && max > peak[c]) peak[c] = max;                                  \
+  }                                                                            \
+}
+
+/* Runs sample peak, true peak and the BS.1770 filter over channels
+ * [c_begin, c_end). Different channel ranges may be processed concurrently,
+ * see ebur128_filter. */
+#define EBUR128_PROCESS(type, min_scale, max_scale)                            \
+EBUR128_PEAKS(type)                                                            \
+static void ebur128_process_##type(ebur128_state* st,                          \
+                                   const void* const* chan, size_t stride,     \
+                                   size_t frames,                              \
+                                   size_t c_begin, size_t c_end) {             \
+  static const double scale =                                                  \
+      1.0 / (-((double) min_scale) > (double) max_scale ?                      \
+             -((double) min_scale) : (double) max_scale);                      \
+  const size_t n = st->channels;                                               \
+  double* peak = NULL;                                                         \
+  float* in = NULL;                                                            \
+  unsigned int zi = 0;                                                         \
+  size_t pos, tile_frames = frames;                                            \
   size_t i, c;                                                                 \
                                                                                \
   TURN_ON_FTZ                                                                  \
                                                                                \
   if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {     \
-    for (c = 0; c < st->channels; ++c) {                                       \
-      double max = 0.0;                                                        \
-      for (i = 0; i < frames; ++i) {                                           \
-        if (src[i * st->channels + c] > max) {                                 \
-          max =        src[i * st->channels + c];                              \
-        } else if (-src[i * st->channels + c] > max) {                         \
-          max = -1.0 * src[i * st->channels + c];                              \
+    peak = st->d->prev_sample_peak;                                            \
+  }                                                                            \
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&         \
+      st->d->interp) {                                                         \
+    in = st->d->resampler_buffer_input;                                        \
+    zi = st->d->interp->zi;                                                    \
+    tile_frames = EBUR128_TILE_FRAMES;                                         \
+  }                                                                            \
+  for (pos = 0; pos < frames; pos += tile_frames) {                            \
+    const size_t j = pos * stride;                                             \
+    if (tile_frames > frames - pos) tile_frames = frames - pos;                \
+    c = c_begin;                                                               \
+    EBUR128_FILTER_QUADS(type)                                                 \
+    EBUR128_FILTER_PAIRS(type)                                                 \
+    for (; c < c_end; ++c) {                                                   \
+      const type* src = (const type*) chan[c] + j;                             \
+      float* tp = EBUR128_INPUT(c);                                            \
+      double* v = st->d->v + c;                                                \
+      double x, y, max = 0.0, sum = 0.0;                                       \
+      if (st->d->channel_map[c] == EBUR128_UNUSED) {                           \
+        ebur128_peaks_##type(chan, j, stride, tile_frames, c, c + 1, scale,    \
+                             peak, in);                                        \
+        continue;                                                              \
+      }                                                                        \
+      for (i = 0; i < tile_frames; ++i) {                                      \
+        x = (double) src[i * stride] * scale;                                  \
+        if (x > max) {                                                         \
+          max = x;                                                             \
+        } else if (-x > max) {                                                 \
+          max = -x;                                                            \
         }                                                                      \
+        if (tp) tp[i] = (float) x;                                             \
+        v[0]     = x                                                           \
+                 - st->d->a[1] * v[1 * n]                                      \
+                 - st->d->a[2] * v[2 * n]                                      \
+                 - st->d->a[3] * v[3 * n]                                      \
+                 - st->d->a[4] * v[4 * n];                                     \
+        y        = st->d->b[0] * v[0]                                          \
+                 + st->d->b[1] * v[1 * n]                                      \
+                 + st->d->b[2] * v[2 * n]                                      \
+                 + st->d->b[3] * v[3 * n]                                      \
+                 + st->d->b[4] * v[4 * n];                                     \
+        sum += y * y;                                                          \
+        v[4 * n] = v[3 * n];                                                   \
+        v[3 * n] = v[2 * n];                                                   \
+        v[2 * n] = v[1 * n];                                                   \
+        v[1 * n] = v[0];                                                       \
       }                                                                        \
-      max /= scaling_factor;                                                   \
-      if (max > st->d->prev_sample_peak[c]) st->d->prev_sample_peak[c] = max;  \
+      FLUSH_MANUALLY                                                           \
+      st->d->channel_energy[c] += sum;                                         \
+      if (peak && max > peak[c]) peak[c] = max;                                \
     }                                                                          \
-  }                                                                            \
-  if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {         \
-    for (c = 0; c < st->channels; ++c) {                                       \
-      for (i = 0; i < frames; ++i) {                                           \
-        st->d->resampler_buffer_input[i * st->channels + c] =                  \
-                      (float) (src[i * st->channels + c] / scaling_factor);    \
+    if (in) {                                                                  \
+      for (c = c_begin; c < c_end; ++c) {                                      \
+        ebur128_check_true_peak(st, tile_frames, zi, c);                       \
       }                                                                        \
+      zi = (unsigned int) ((zi + tile_frames) % st->d->interp->delay);         \
     }                                                                          \
-    ebur128_check_true_peak(st, frames);                                       \
-  }                                                                            \
-  for (c = 0; c < st->channels; ++c) {                                         \
-    int ci = st->d->channel_map[c] - 1;                                        \
-    if (ci < 0) continue;                                                      \
-    else if (ci == EBUR128_DUAL_MONO - 1) ci = 0; /*dual mono */               \
-    for (i = 0; i < frames; ++i) {                                             \
-      st->d->v[ci][0] = (double) (src[i * st->channels + c] / scaling_factor)  \
-                   - st->d->a[1] * st->d->v[ci][1]                             \
-                   - st->d->a[2] * st->d->v[ci][2]                             \
-                   - st->d->a[3] * st->d->v[ci][3]                             \
-                   - st->d->a[4] * st->d->v[ci][4];                            \
-      audio_data[i * st->channels + c] =                                       \
-                     st->d->b[0] * st->d->v[ci][0]                             \
-                   + st->d->b[1] * st->d->v[ci][1]                             \
-                   + st->d->b[2] * st->d->v[ci][2]                             \
-                   + st->d->b[3] * st->d->v[ci][3]                             \
-                   + st->d->b[4] * st->d->v[ci][4];                            \
-      st->d->v[ci][4] = st->d->v[ci][3];                                       \
-      st->d->v[ci][3] = st->d->v[ci][2];                                       \
-      st->d->v[ci][2] = st->d->v[ci][1];                                       \
-      st->d->v[ci][1] = st->d->v[ci][0];                                       \
-    }                                                                          \
-    FLUSH_MANUALLY                                                             \
   }                                                                            \
   TURN_OFF_FTZ                                                                 \
 }
-EBUR128_FILTER(short, SHRT_MIN, SHRT_MAX)
-EBUR128_FILTER(int, INT_MIN, INT_MAX)
-EBUR128_FILTER(float, -1.0f, 1.0f)
-EBUR128_FILTER(double, -1.0, 1.0)
+EBUR128_PROCESS(short, SHRT_MIN, SHRT_MAX)
+EBUR128_PROCESS(int, INT_MIN, INT_MAX)
+EBUR128_PROCESS(float, -1.0f, 1.0f)
+EBUR128_PROCESS(double, -1.0, 1.0)
+
+/* Filter functions for interleaved input. */
+#define EBUR128_FILTER(type)                                                   \
+static void ebur128_filter_##type(ebur128_state* st, const void* source,       \
+                                  size_t offset, size_t frames,                \
+                                  size_t c_begin, size_t c_end) {              \
+  const type* src = (const type*) source + offset * st->channels;              \
+  size_t c;                                                                    \
+  for (c = c_begin; c < c_end; ++c) {                                          \
+    st->d->planes[c] = src + c;                                                \
+  }                                                                            \
+  ebur128_process_##type(st, st->d->planes, st->channels, frames,              \
+                         c_begin, c_end);                                      \
+}
+EBUR128_FILTER(short)
+EBUR128_FILTER(int)
+EBUR128_FILTER(float)
+EBUR128_FILTER(double)
+
+/* Filter functions for planar input, src is an array of one pointer per
+ * channel. */
+#define EBUR128_FILTER_PLANAR(type)                                            \
+static void ebur128_filter_planar_##type(ebur128_state* st,                    \
+                                         const void* source,                   \
+                                         size_t offset, size_t frames,         \
+                                         size_t c_begin, size_t c_end) {       \
+  const type* const* src = (const type* const*) source;                        \
+  size_t c;                                                                    \
+  for (c = c_begin; c < c_end; ++c) {                                          \
+    st->d->planes[c] = src[c] + offset;                                        \
+  }                                                                            \
+  ebur128_process_##type(st, st->d->planes, 1, frames, c_begin, c_end);        \
+}
+EBUR128_FILTER_PLANAR(float)
+EBUR128_FILTER_PLANAR(double)
+
+/* Runs filter over all channels, on the worker pool if there is one. */
+static void ebur128_filter(ebur128_state* st, ebur128_filter_function filter,
+                           const void* src, size_t offset, size_t frames) {
+  if (st->d->pool && frames * st->channels >= EBUR128_POOL_MIN_SAMPLES) {
+    ebur128_pool_run(st->d->pool, st, filter, src, offset, frames);
+  } else {
+    filter(st, src, offset, frames, 0, st->channels);
+  }
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&
+      st->d->interp) {
+    interp_advance(st->d->interp, frames);
+  }
+}
 
 static double ebur128_energy_to_loudness(double energy) {
   return 10 * (log(energy) / log(10.0)) - 0.691;
 }
 
-static size_t find_histogram_index(double energy) {
-  size_t index_min = 0;
-  size_t index_max = 1000;
-  size_t index_mid;
-
-  do {
-    index_mid = (index_min + index_max) / 2;
-    if (energy >= histogram_energy_boundaries[index_mid]) {
-      index_min = index_mid;
-    } else {
-      index_max = index_mid;
-    }
-  } while (index_max - index_min != 1);
-
-  return index_min;
+/* Returns the histogram bin of an energy at or above the absolute gate. The
+ * bin is estimated from the exponent and mantissa of the energy and then
+ * corrected against the bin boundaries, so the result is the same as that of
+ * a binary search over the boundaries. */
+static size_t find_histogram_index(ebur128_state* st, double energy) {
+  const double* boundaries = st->d->histogram_energy_boundaries;
+  size_t bins = st->d->histogram_bins;
+  size_t index;
+  double m, t, t2, bin;
+  int exponent;
+
+  /* energy = m * 2^exponent with m in [0.5, 1) */
+  m = frexp(energy, &exponent);
+  /* ln(m) = 2 atanh(t), the series is good to 2e-5 for |t| <= 1/3, a small
+   * fraction of the narrowest bin */
+  t = (m - 1.0) / (m + 1.0);
+  t2 = t * t;
+  t = 2.0 * t * (1.0 + t2 * (1.0 / 3.0 + t2 * (1.0 / 5.0 + t2 / 7.0)));
+  /* 10 log10(energy) = 10 log10(2) exponent + 10 log10(e) ln(m) */
+  bin = (exponent * 3.01029995663981195214 + t * 4.34294481903251827651
+         + 70.0 - 0.691) * st->d->histogram_resolution;
+  if (bin >= (double) (bins - 1)) {
+    index = bins - 1;
+  } else if (bin > 0.0) {
+    index = (size_t) bin;
+  } else {
+    index = 0;
+  }
+  while (index > 0 && energy < boundaries[index]) {
+    --index;
+  }
+  while (index + 1 < bins && energy >= boundaries[index + 1]) {
+    ++index;
+  }
+  return index;
 }
 
-static int ebur128_calc_gating_block(ebur128_state* st, size_t frames_per_block,
-                                     double* optional_output) {
-  size_t i, c;
+/* Ends the current 100ms sub-block: stores its weighted energy in the ring
+ * and starts a new one. */
+static void ebur128_end_subblock(ebur128_state* st) {
+  size_t c;
   double sum = 0.0;
   double channel_sum;
   for (c = 0; c < st->channels; ++c) {
-    if (st->d->channel_map[c] == EBUR128_UNUSED) continue;
-    channel_sum = 0.0;
-    if (st->d->audio_data_index < frames_per_block * st->channels) {
-      for (i = 0; i < st->d->audio_data_index / st->channels; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
-      }
-      for (i = st->d->audio_data_frames -
-              (frames_per_block -
-               st->d->audio_data_index / st->channels);
-           i < st->d->audio_data_frames; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
-      }
-    } else {
-      for (i = st->d->audio_data_index / st->channels - frames_per_block;
-           i < st->d->audio_data_index / st->channels;
-           ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
-      }
-    }
+    channel_sum = st->d->channel_energy[c];
+    st->d->channel_energy[c] = 0.0;
+    if (st->d->channel_map[c] == EBUR128_UNUSED) continue;
     if (st->d->channel_map[c] == EBUR128_Mp110 ||
         st->d->channel_map[c] == EBUR128_Mm110 ||
         st->d->channel_map[c] == EBUR128_Mp060 ||
@@ -656,30 +2223,44 @@ static int ebur128_calc_gating_block(ebur128_state* st, size_t frames_per_block,
     }
     sum += channel_sum;
   }
-  sum /= (double) frames_per_block;
-  if (optional_output) {
-    *optional_output = sum;
-    return EBUR128_SUCCESS;
-  } else if (sum >= histogram_energy_boundaries[0]) {
+  st->d->subblock_energy[st->d->subblock_index] = sum;
+  if (++st->d->subblock_index == st->d->subblocks) {
+    st->d->subblock_index = 0;
+  }
+  if (st->d->subblock_count < st->d->subblocks) {
+    ++st->d->subblock_count;
+  }
+}
+
+/* Mean square of the last count sub-blocks, count must not be larger than
+ * the ring. */
+static double ebur128_energy_in_subblocks(ebur128_state* st, size_t count) {
+  size_t i = (st->d->subblock_index + st->d->subblocks - count) %
+             st->d->subblocks;
+  size_t k;
+  double sum = 0.0;
+  for (k = 0; k < count; ++k) {
+    sum += st->d->subblock_energy[i];
+    if (++i == st->d->subblocks) i = 0;
+  }
+  return sum / (double) (count * st->d->samples_in_100ms);
+}
+
+static int ebur128_calc_gating_block(ebur128_state* st) {
+  double sum = ebur128_energy_in_subblocks(st, 4);
+  if (sum >= absolute_gate_energy) {
     if (st->d->use_histogram) {
-      ++st->d->block_energy_histogram[find_histogram_index(sum)];
-    } else {
-      struct ebur128_dq_entry* block;
-      if (st->d->block_list_size == st->d->block_list_max) {
-        block = STAILQ_FIRST(&st->d->block_list);
-        STAILQ_REMOVE_HEAD(&st->d->block_list, entries);
-      } else {
-        block = (struct ebur128_dq_entry*) malloc(sizeof(struct ebur128_dq_entry));
-        if (!block) return EBUR128_ERROR_NOMEM;
-        st->d->block_list_size++;
+      size_t index = find_histogram_index(st, sum);
+      if (st->d->block_list.histogram &&
+          ebur128_block_store_add(&st->d->block_list, (double) index)) {
+        return EBUR128_ERROR_NOMEM;
       }
-      block->z = sum;
-      STAILQ_INSERT_TAIL(&st->d->block_list, block, entries);
+      ++st->d->block_energy_histogram[index];
+    } else {
+      return ebur128_block_store_add(&st->d->block_list, sum);
     }
-    return EBUR128_SUCCESS;
-  } else {
-    return EBUR128_SUCCESS;
   }
+  return EBUR128_SUCCESS;
 }
 
 int ebur128_set_channel(ebur128_state* st,
@@ -701,36 +2282,67 @@ int ebur128_change_parameters(ebur128_state* st,
                               unsigned int channels,
                               unsigned long samplerate) {
   int errcode = EBUR128_SUCCESS;
-  size_t j;
+  struct ebur128_format old, cached;
+  struct ebur128_format* slot;
+  unsigned int i;
 
   if (channels == st->channels &&
       samplerate == st->samplerate) {
     return EBUR128_ERROR_NO_CHANGE;
   }
-  free(st->d->audio_data);
-  st->d->audio_data = NULL;
 
-  if (channels != st->channels) {
-    unsigned int i;
-
-    free(st->d->channel_map); st->d->channel_map = NULL;
-    free(st->d->sample_peak); st->d->sample_peak = NULL;
-    free(st->d->prev_sample_peak); st->d->prev_sample_peak = NULL;
-    free(st->d->true_peak);   st->d->true_peak = NULL;
-    free(st->d->prev_true_peak); st->d->prev_true_peak = NULL;
-    st->channels = channels;
+  /* take the new format out of the kept ones, if it is there */
+  cached.channels = 0;
+  for (i = 0; i < EBUR128_FORMATS; ++i) {
+    slot = &st->d->formats[i];
+    if (slot->channels == channels && slot->samplerate == samplerate) {
+      cached = *slot;
+      slot->channels = 0;
+      break;
+    }
+  }
+  /* keep the current format in an unused slot, or in place of the one that
+   * was left the longest time ago */
+  ++st->d->format_clock;
+  ebur128_save_format(st, &old);
+  slot = &st->d->formats[0];
+  for (i = 1; i < EBUR128_FORMATS && slot->channels; ++i) {
+    if (!st->d->formats[i].channels ||
+        st->d->formats[i].used < slot->used) {
+      slot = &st->d->formats[i];
+    }
+  }
+  ebur128_free_format(st, slot);
+  *slot = old;
 
-    errcode = ebur128_init_channel_map(st);
+  if (cached.channels) {
+    ebur128_load_format(st, &cached);
+    for (i = 0; i < 5 * channels; ++i) {
+      st->d->v[i] = 0.0;
+    }
+    if (st->d->interp) interp_reset(st->d->interp);
+  } else {
+    /* on allocation errors, ebur128_destroy frees what was allocated */
+    memset(&cached, 0, sizeof(cached));
+    cached.channels = channels;
+    cached.samplerate = samplerate;
+    ebur128_load_format(st, &cached);
+    errcode = ebur128_init_format(st);
     CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  }
 
-    st->d->sample_peak = (double*) malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->sample_peak, EBUR128_ERROR_NOMEM, exit)
-    st->d->prev_sample_peak = (double*) malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->prev_sample_peak, EBUR128_ERROR_NOMEM, exit)
-    st->d->true_peak = (double*) malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->true_peak, EBUR128_ERROR_NOMEM, exit)
-    st->d->prev_true_peak = (double*) malloc(channels * sizeof(double));
-    CHECK_ERROR(!st->d->prev_true_peak, EBUR128_ERROR_NOMEM, exit)
+  /* the channel map and the peaks carry over if only the sample rate
+   * changed */
+  if (channels == old.channels) {
+    memcpy(st->d->channel_map, old.channel_map, channels * sizeof(int));
+    memcpy(st->d->sample_peak, old.sample_peak, channels * sizeof(double));
+    memcpy(st->d->prev_sample_peak, old.prev_sample_peak,
+           channels * sizeof(double));
+    memcpy(st->d->true_peak, old.true_peak, channels * sizeof(double));
+    memcpy(st->d->prev_true_peak, old.prev_true_peak,
+           channels * sizeof(double));
+  } else {
+    ebur128_reset_channel_map(st);
     for (i = 0; i < channels; ++i) {
       st->d->sample_peak[i] = 0.0;
       st->d->prev_sample_peak[i] = 0.0;
@@ -738,34 +2350,8 @@ int ebur128_change_parameters(ebur128_state* st,
       st->d->prev_true_peak[i] = 0.0;
     }
   }
-  if (samplerate != st->samplerate) {
-    st->samplerate = samplerate;
-    st->d->samples_in_100ms = (st->samplerate + 5) / 10;
-    ebur128_init_filter(st);
-  }
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
-    /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames = st->d->audio_data_frames
-                             + st->d->samples_in_100ms
-                             - (st->d->audio_data_frames % st->d->samples_in_100ms);
-  }
-  st->d->audio_data = (double*) malloc(st->d->audio_data_frames *
-                                       st->channels *
-                                       sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, EBUR128_ERROR_NOMEM, exit)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
-  }
-
-  ebur128_destroy_resampler(st);
-  errcode = ebur128_init_resampler(st);
-  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  ebur128_reset_subblocks(st);
 
-  /* the first block needs 400ms of audio data */
-  st->d->needed_frames = st->d->samples_in_100ms * 4;
-  /* start at the beginning of the buffer */
-  st->d->audio_data_index = 0;
   /* reset short term frame counter */
   st->d->short_term_frame_counter = 0;
 
@@ -776,7 +2362,6 @@ exit:
 int ebur128_set_max_window(ebur128_state* st, unsigned long window)
 {
   int errcode = EBUR128_SUCCESS;
-  size_t j;
 
   if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S && window < 3000) {
     window = 3000;
@@ -788,27 +2373,9 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window)
   }
 
   st->d->window = window;
-  free(st->d->audio_data);
-  st->d->audio_data = NULL;
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
-    /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames = st->d->audio_data_frames
-                             + st->d->samples_in_100ms
-                             - (st->d->audio_data_frames % st->d->samples_in_100ms);
-  }
-  st->d->audio_data = (double*) malloc(st->d->audio_data_frames *
-                                       st->channels *
-                                       sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, EBUR128_ERROR_NOMEM, exit)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
-  }
-
-  /* the first block needs 400ms of audio data */
-  st->d->needed_frames = st->d->samples_in_100ms * 4;
-  /* start at the beginning of the buffer */
-  st->d->audio_data_index = 0;
+  errcode = ebur128_init_subblocks(st);
+  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+
   /* reset short term frame counter */
   st->d->short_term_frame_counter = 0;
 
@@ -827,128 +2394,160 @@ int ebur128_set_max_history(ebur128_state* st, unsigned long history)
     return EBUR128_ERROR_NO_CHANGE;
   }
   st->d->history = history;
-  st->d->block_list_max = st->d->history / 100;
-  st->d->st_block_list_max = st->d->history / 3000;
-  while (st->d->block_list_size > st->d->block_list_max) {
-    struct ebur128_dq_entry* block = STAILQ_FIRST(&st->d->block_list);
-    STAILQ_REMOVE_HEAD(&st->d->block_list, entries);
-    free(block);
-    st->d->block_list_size--;
-  }
-  while (st->d->st_block_list_size > st->d->st_block_list_max) {
-    struct ebur128_dq_entry* block = STAILQ_FIRST(&st->d->short_term_block_list);
-    STAILQ_REMOVE_HEAD(&st->d->short_term_block_list, entries);
-    free(block);
-    st->d->st_block_list_size--;
+  if (st->d->use_histogram) {
+    ebur128_track_histogram_blocks(st);
+  }
+  ebur128_block_store_set_max(&st->d->block_list, st->d->history / 100);
+  ebur128_block_store_set_max(&st->d->short_term_block_list,
+                              st->d->history / 3000);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_set_histogram_resolution(ebur128_state* st,
+                                     unsigned int bins_per_lu)
+{
+  if (!st->d->use_histogram || bins_per_lu == 0 || bins_per_lu > 1000) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (bins_per_lu == st->d->histogram_resolution) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  return ebur128_init_histogram(st, bins_per_lu);
+}
+
+int ebur128_set_threads(ebur128_state* st, unsigned int threads)
+{
+  struct ebur128_pool* pool = NULL;
+  if (threads == 0 || threads > EBUR128_MAX_THREADS) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (threads == (st->d->pool ? st->d->pool->threads : 1)) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  if (threads > 1) {
+    pool = ebur128_pool_create(threads);
+  }
+  if (st->d->pool) {
+    ebur128_pool_destroy(st->d->pool, st->d->pool->threads - 1);
+  }
+  st->d->pool = pool;
+  if (threads > 1 && !pool) {
+    return EBUR128_ERROR_NOMEM;
   }
   return EBUR128_SUCCESS;
 }
 
 static int ebur128_energy_shortterm(ebur128_state* st, double* out);
+/* Feeds frames to the gating blocks; filter reads them from src, see
+ * ebur128_filter_function. */
+static int ebur128_add_frames(ebur128_state* st,
+                              ebur128_filter_function filter,
+                              const void* src, size_t frames) {
+  size_t offset = 0;
+  unsigned int c = 0;
+  for (c = 0; c < st->channels; c++) {
+    st->d->prev_sample_peak[c] = 0.0;
+    st->d->prev_true_peak[c] = 0.0;
+  }
+  while (frames > 0) {
+    if (frames >= st->d->needed_frames) {
+      ebur128_filter(st, filter, src, offset, st->d->needed_frames);
+      offset += st->d->needed_frames;
+      frames -= st->d->needed_frames;
+      ebur128_end_subblock(st);
+      /* calculate the new gating block */
+      if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I &&
+          st->d->subblock_count >= 4) {
+        if (ebur128_calc_gating_block(st)) {
+          return EBUR128_ERROR_NOMEM;
+        }
+      }
+      if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+        st->d->short_term_frame_counter += st->d->needed_frames;
+        if (st->d->short_term_frame_counter == st->d->samples_in_100ms * 30) {
+          double st_energy;
+          if (!ebur128_energy_shortterm(st, &st_energy) &&
+              st_energy >= absolute_gate_energy) {
+            if (st->d->use_histogram) {
+              size_t index = find_histogram_index(st, st_energy);
+              if (st->d->short_term_block_list.histogram &&
+                  ebur128_block_store_add(&st->d->short_term_block_list,
+                                          (double) index)) {
+                return EBUR128_ERROR_NOMEM;
+              }
+              ++st->d->short_term_block_energy_histogram[index];
+            } else if (ebur128_block_store_add(&st->d->short_term_block_list,
+                                               st_energy)) {
+              return EBUR128_ERROR_NOMEM;
+            }
+          }
+          st->d->short_term_frame_counter = st->d->samples_in_100ms * 20;
+        }
+      }
+      st->d->needed_frames = st->d->samples_in_100ms;
+    } else {
+      ebur128_filter(st, filter, src, offset, frames);
+      if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+        st->d->short_term_frame_counter += frames;
+      }
+      st->d->needed_frames -= frames;
+      frames = 0;
+    }
+  }
+  for (c = 0; c < st->channels; c++) {
+    if (st->d->prev_sample_peak[c] > st->d->sample_peak[c]) {
+      st->d->sample_peak[c] = st->d->prev_sample_peak[c];
+    }
+    if (st->d->prev_true_peak[c] > st->d->true_peak[c]) {
+      st->d->true_peak[c] = st->d->prev_true_peak[c];
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
 #define EBUR128_ADD_FRAMES(type)                                               \
 int ebur128_add_frames_##type(ebur128_state* st,                               \
                               const type* src, size_t frames) {                \
-  size_t src_index = 0;                                                        \
-  unsigned int c = 0;                                                          \
-  for (c = 0; c < st->channels; c++) {                                         \
-    st->d->prev_sample_peak[c] = 0.0;                                          \
-    st->d->prev_true_peak[c] = 0.0;                                            \
-  }                                                                            \
-  while (frames > 0) {                                                         \
-    if (frames >= st->d->needed_frames) {                                      \
-      ebur128_filter_##type(st, src + src_index, st->d->needed_frames);        \
-      src_index += st->d->needed_frames * st->channels;                        \
-      frames -= st->d->needed_frames;                                          \
-      st->d->audio_data_index += st->d->needed_frames * st->channels;          \
-      /* calculate the new gating block */                                     \
-      if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I) {                     \
-        if (ebur128_calc_gating_block(st, st->d->samples_in_100ms * 4, NULL)) {\
-          return EBUR128_ERROR_NOMEM;                                          \
-        }                                                                      \
-      }                                                                        \
-      if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {                 \
-        st->d->short_term_frame_counter += st->d->needed_frames;               \
-        if (st->d->short_term_frame_counter == st->d->samples_in_100ms * 30) { \
-          struct ebur128_dq_entry* block;                                      \
-          double st_energy;                                                    \
-          ebur128_energy_shortterm(st, &st_energy);                            \
-          if (st_energy >= histogram_energy_boundaries[0]) {                   \
-            if (st->d->use_histogram) {                                        \
-              ++st->d->short_term_block_energy_histogram[                      \
-                                              find_histogram_index(st_energy)];\
-            } else {                                                           \
-              if (st->d->st_block_list_size == st->d->st_block_list_max) {     \
-                block = STAILQ_FIRST(&st->d->short_term_block_list);           \
-                STAILQ_REMOVE_HEAD(&st->d->short_term_block_list, entries);    \
-              } else {                                                         \
-                block = (struct ebur128_dq_entry*)                             \
-                        malloc(sizeof(struct ebur128_dq_entry));               \
-                if (!block) return EBUR128_ERROR_NOMEM;                        \
-                st->d->st_block_list_size++;                                   \
-              }                                                                \
-              block->z = st_energy;                                            \
-              STAILQ_INSERT_TAIL(&st->d->short_term_block_list,                \
-                                 block, entries);                              \
-            }                                                                  \
-          }                                                                    \
-          st->d->short_term_frame_counter = st->d->samples_in_100ms * 20;      \
-        }                                                                      \
-      }                                                                        \
-      /* 100ms are needed for all blocks besides the first one */              \
-      st->d->needed_frames = st->d->samples_in_100ms;                          \
-      /* reset audio_data_index when buffer full */                            \
-      if (st->d->audio_data_index == st->d->audio_data_frames * st->channels) {\
-        st->d->audio_data_index = 0;                                           \
-      }                                                                        \
-    } else {                                                                   \
-      ebur128_filter_##type(st, src + src_index, frames);                      \
-      st->d->audio_data_index += frames * st->channels;                        \
-      if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {                 \
-        st->d->short_term_frame_counter += frames;                             \
-      }                                                                        \
-      st->d->needed_frames -= frames;                                          \
-      frames = 0;                                                              \
-    }                                                                          \
-  }                                                                            \
-  for (c = 0; c < st->channels; c++) {                                         \
-    if (st->d->prev_sample_peak[c] > st->d->sample_peak[c]) {                  \
-      st->d->sample_peak[c] = st->d->prev_sample_peak[c];                      \
-    }                                                                          \
-    if (st->d->prev_true_peak[c] > st->d->true_peak[c]) {                      \
-      st->d->true_peak[c] = st->d->prev_true_peak[c];                          \
-    }                                                                          \
-  }                                                                            \
-  return EBUR128_SUCCESS;                                                      \
+  return ebur128_add_frames(st, ebur128_filter_##type, src, frames);           \
 }
 EBUR128_ADD_FRAMES(short)
 EBUR128_ADD_FRAMES(int)
 EBUR128_ADD_FRAMES(float)
 EBUR128_ADD_FRAMES(double)
 
+int ebur128_add_frames_planar_float(ebur128_state* st,
+                                    const float* const* src, size_t frames) {
+  return ebur128_add_frames(st, ebur128_filter_planar_float, src, frames);
+}
+
+int ebur128_add_frames_planar_double(ebur128_state* st,
+                                     const double* const* src, size_t frames) {
+  return ebur128_add_frames(st, ebur128_filter_planar_double, src, frames);
+}
+
+/* Adds the energies and the number of all blocks of st. Dividing the sum by
+ * the number and applying relative_gate_factor gives the relative threshold,
+ * also over several states. */
 static int ebur128_calc_relative_threshold(ebur128_state* st,
                                            size_t* above_thresh_counter,
                                            double* relative_threshold) {
-  struct ebur128_dq_entry* it;
-  size_t i;
-  *relative_threshold = 0.0;
-  *above_thresh_counter = 0;
+  size_t i, count = 0;
 
   if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
+    for (i = 0; i < st->d->histogram_bins; ++i) {
       *relative_threshold += st->d->block_energy_histogram[i] *
-                            histogram_energies[i];
+                            st->d->histogram_energies[i];
       *above_thresh_counter += st->d->block_energy_histogram[i];
     }
-  } else {
-    STAILQ_FOREACH(it, &st->d->block_list, entries) {
-      ++*above_thresh_counter;
-      *relative_threshold += it->z;
-    }
-  }
-
-  if (*above_thresh_counter != 0) {
-    *relative_threshold /= (double) *above_thresh_counter;
-    *relative_threshold *= relative_gate_factor;
+  } else if (st->d->block_list.tree.root) {
+    /* the root of the tree knows the sum of all block energies */
+    *relative_threshold += st->d->block_list.tree.nodes[
+                                          st->d->block_list.tree.root].sum;
+    *above_thresh_counter += st->d->block_list.size;
+  } else if (!st->d->block_list.use_tree) {
+    *relative_threshold += ebur128_block_store_sum_from(&st->d->block_list,
+                                                        0.0, &count);
+    *above_thresh_counter += count;
   }
 
   return EBUR128_SUCCESS;
@@ -956,7 +2555,6 @@ static int ebur128_calc_relative_threshold(ebur128_state* st,
 
 static int ebur128_gated_loudness(ebur128_state** sts, size_t size,
                                   double* out) {
-  struct ebur128_dq_entry* it;
   double gated_loudness = 0.0;
   double relative_threshold = 0.0;
   size_t above_thresh_counter = 0;
@@ -976,31 +2574,34 @@ static int ebur128_gated_loudness(ebur128_state** sts, size_t size,
     *out = -HUGE_VAL;
     return EBUR128_SUCCESS;
   }
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
 
   above_thresh_counter = 0;
-  if (relative_threshold < histogram_energy_boundaries[0]) {
-    start_index = 0;
-  } else {
-    start_index = find_histogram_index(relative_threshold);
-    if (relative_threshold > histogram_energies[start_index]) {
-      ++start_index;
-    }
-  }
   for (i = 0; i < size; i++) {
     if (!sts[i]) continue;
     if (sts[i]->d->use_histogram) {
-      for (j = start_index; j < 1000; ++j) {
+      if (relative_threshold < absolute_gate_energy) {
+        start_index = 0;
+      } else {
+        start_index = find_histogram_index(sts[i], relative_threshold);
+        if (relative_threshold > sts[i]->d->histogram_energies[start_index]) {
+          ++start_index;
+        }
+      }
+      for (j = start_index; j < sts[i]->d->histogram_bins; ++j) {
         gated_loudness += sts[i]->d->block_energy_histogram[j] *
-                          histogram_energies[j];
+                          sts[i]->d->histogram_energies[j];
         above_thresh_counter += sts[i]->d->block_energy_histogram[j];
       }
+    } else if (sts[i]->d->block_list.use_tree) {
+      gated_loudness += ebur128_tree_sum_from(&sts[i]->d->block_list.tree,
+                                              relative_threshold,
+                                              &above_thresh_counter);
     } else {
-      STAILQ_FOREACH(it, &sts[i]->d->block_list, entries) {
-        if (it->z >= relative_threshold) {
-          ++above_thresh_counter;
-          gated_loudness += it->z;
-        }
-      }
+      gated_loudness += ebur128_block_store_sum_from(&sts[i]->d->block_list,
+                                                     relative_threshold,
+                                                     &above_thresh_counter);
     }
   }
   if (!above_thresh_counter) {
@@ -1013,8 +2614,8 @@ static int ebur128_gated_loudness(ebur128_state** sts, size_t size,
 }
 
 int ebur128_relative_threshold(ebur128_state* st, double* out) {
-  double relative_threshold;
-  size_t above_thresh_counter;
+  double relative_threshold = 0.0;
+  size_t above_thresh_counter = 0;
 
   if (st && (st->mode & EBUR128_MODE_I) != EBUR128_MODE_I)
     return EBUR128_ERROR_INVALID_MODE;
@@ -1026,6 +2627,8 @@ int ebur128_relative_threshold(ebur128_state* st, double* out) {
       return EBUR128_SUCCESS;
   }
 
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
   *out = ebur128_energy_to_loudness(relative_threshold);
   return EBUR128_SUCCESS;
 }
@@ -1040,23 +2643,22 @@ int ebur128_loudness_global_multiple(ebur128_state** sts, size_t size,
 }
 
 static int ebur128_energy_in_interval(ebur128_state* st,
-                                      size_t interval_frames,
+                                      size_t interval_subblocks,
                                       double* out) {
-  if (interval_frames > st->d->audio_data_frames) {
+  if (interval_subblocks > st->d->subblocks) {
     return EBUR128_ERROR_INVALID_MODE;
   }
-  ebur128_calc_gating_block(st, interval_frames, out);
+  *out = ebur128_energy_in_subblocks(st, interval_subblocks);
   return EBUR128_SUCCESS;
 }
 
 static int ebur128_energy_shortterm(ebur128_state* st, double* out) {
-  return ebur128_energy_in_interval(st, st->d->samples_in_100ms * 30, out);
+  return ebur128_energy_in_interval(st, 30, out);
 }
 
 int ebur128_loudness_momentary(ebur128_state* st, double* out) {
   double energy;
-  int error = ebur128_energy_in_interval(st, st->d->samples_in_100ms * 4,
-                                         &energy);
+  int error = ebur128_energy_in_interval(st, 4, &energy);
   if (error) {
     return error;
   } else if (energy <= 0.0) {
@@ -1084,8 +2686,8 @@ int ebur128_loudness_window(ebur128_state* st,
                             unsigned long window,
                             double* out) {
   double energy;
-  size_t interval_frames = st->samplerate * window / 1000;
-  int error = ebur128_energy_in_interval(st, interval_frames, &energy);
+  size_t interval_subblocks = window / 100 + (window % 100 ? 1 : 0);
+  int error = ebur128_energy_in_interval(st, interval_subblocks, &energy);
   if (error) {
     return error;
   } else if (energy <= 0.0) {
@@ -1102,11 +2704,53 @@ static int ebur128_double_cmp(const void *p1, const void *p2) {
   return (*d1 > *d2) - (*d1 < *d2);
 }
 
+/* Same as the sorting path of ebur128_loudness_range_multiple, using the
+ * sorted short-term energies of a single state. */
+static int ebur128_loudness_range_tree(const struct ebur128_tree* tree,
+                                       double* out) {
+  unsigned int stl_size = tree->root ? tree->nodes[tree->root].count : 0;
+  unsigned int stl_gated, stl_relgated_size;
+  double stl_power, stl_integrated;
+  /* High and low percentile energy */
+  double h_en, l_en;
+
+  if (!stl_size) {
+    *out = 0.0;
+    return EBUR128_SUCCESS;
+  }
+  stl_power = tree->nodes[tree->root].sum / (double) stl_size;
+  stl_integrated = minus_twenty_decibels * stl_power;
+
+  stl_gated = ebur128_tree_count_below(tree, stl_integrated);
+  stl_relgated_size = stl_size - stl_gated;
+  if (stl_relgated_size) {
+    h_en = ebur128_tree_select(tree, stl_gated +
+                    (unsigned int) ((stl_relgated_size - 1) * 0.95 + 0.5));
+    l_en = ebur128_tree_select(tree, stl_gated +
+                    (unsigned int) ((stl_relgated_size - 1) * 0.1 + 0.5));
+    *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
+  } else {
+    *out = 0.0;
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Number of short-term blocks in histogram bin j, summed over all states. */
+static unsigned long ebur128_short_term_histogram_count(ebur128_state** sts,
+                                                        size_t size,
+                                                        size_t j) {
+  unsigned long count = 0;
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    if (sts[i]) count += sts[i]->d->short_term_block_energy_histogram[j];
+  }
+  return count;
+}
+
 /* EBU - TECH 3342 */
 int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
                                     double* out) {
-  size_t i, j;
-  struct ebur128_dq_entry* it;
+  size_t i, j, k, n;
   double* stl_vector;
   size_t stl_size;
   double* stl_relgated;
@@ -1130,20 +2774,28 @@ int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
   }
 
   if (use_histogram) {
-    unsigned long hist[1000] = { 0 };
+    const double* histogram_energies;
+    size_t bins;
+    unsigned long count;
     size_t percentile_low, percentile_high;
     size_t index;
 
+    /* the first state is not NULL, all states must have its resolution */
+    for (i = 1; i < size; ++i) {
+      if (sts[i] && sts[i]->d->histogram_resolution !=
+                    sts[0]->d->histogram_resolution) {
+        return EBUR128_ERROR_INVALID_MODE;
+      }
+    }
+    histogram_energies = sts[0]->d->histogram_energies;
+    bins = sts[0]->d->histogram_bins;
+
     stl_size = 0;
     stl_power = 0.0;
-    for (i = 0; i < size; ++i) {
-      if (!sts[i]) continue;
-      for (j = 0; j < 1000; ++j) {
-        hist[j]   += sts[i]->d->short_term_block_energy_histogram[j];
-        stl_size  += sts[i]->d->short_term_block_energy_histogram[j];
-        stl_power += sts[i]->d->short_term_block_energy_histogram[j]
-                     * histogram_energies[j];
-      }
+    for (j = 0; j < bins; ++j) {
+      count = ebur128_short_term_histogram_count(sts, size, j);
+      stl_size  += count;
+      stl_power += count * histogram_energies[j];
     }
     if (!stl_size) {
       *out = 0.0;
@@ -1153,17 +2805,17 @@ int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
     stl_power /= stl_size;
     stl_integrated = minus_twenty_decibels * stl_power;
 
-    if (stl_integrated < histogram_energy_boundaries[0]) {
+    if (stl_integrated < absolute_gate_energy) {
       index = 0;
     } else {
-      index = find_histogram_index(stl_integrated);
+      index = find_histogram_index(sts[0], stl_integrated);
       if (stl_integrated > histogram_energies[index]) {
         ++index;
       }
     }
     stl_size = 0;
-    for (j = index; j < 1000; ++j) {
-      stl_size += hist[j];
+    for (j = index; j < bins; ++j) {
+      stl_size += ebur128_short_term_histogram_count(sts, size, j);
     }
     if (!stl_size) {
       *out = 0.0;
@@ -1176,37 +2828,44 @@ int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
     stl_size = 0;
     j = index;
     while (stl_size <= percentile_low) {
-      stl_size += hist[j++];
+      stl_size += ebur128_short_term_histogram_count(sts, size, j++);
     }
     l_en = histogram_energies[j - 1];
     while (stl_size <= percentile_high) {
-      stl_size += hist[j++];
+      stl_size += ebur128_short_term_histogram_count(sts, size, j++);
     }
     h_en = histogram_energies[j - 1];
     *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
     return EBUR128_SUCCESS;
 
   } else {
+    const struct ebur128_block_store* bs = NULL;
+    size_t states = 0;
     stl_size = 0;
     for (i = 0; i < size; ++i) {
       if (!sts[i]) continue;
-      STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
-        ++stl_size;
-      }
+      stl_size += sts[i]->d->short_term_block_list.size;
+      bs = &sts[i]->d->short_term_block_list;
+      ++states;
+    }
+    if (states == 1 && bs->use_tree) {
+      /* a single state keeps its short-term energies sorted */
+      return ebur128_loudness_range_tree(&bs->tree, out);
     }
     if (!stl_size) {
       *out = 0.0;
       return EBUR128_SUCCESS;
     }
-    stl_vector = (double*) malloc(stl_size * sizeof(double));
+    stl_vector = (double*) EBUR128_MALLOC(stl_size * sizeof(double));
     if (!stl_vector)
       return EBUR128_ERROR_NOMEM;
 
     for (j = 0, i = 0; i < size; ++i) {
       if (!sts[i]) continue;
-      STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
-        stl_vector[j] = it->z;
-        ++j;
+      bs = &sts[i]->d->short_term_block_list;
+      for (k = 0; k < bs->size; k += n) {
+        n = ebur128_block_store_read(bs, k, bs->size - k, stl_vector + j);
+        j += n;
       }
     }
     qsort(stl_vector, stl_size, sizeof(double), ebur128_double_cmp);
@@ -1227,11 +2886,11 @@ int ebur128_loudness_range_multiple(ebur128_state** sts, size_t size,
     if (stl_relgated_size) {
       h_en = stl_relgated[(size_t) ((stl_relgated_size - 1) * 0.95 + 0.5)];
       l_en = stl_relgated[(size_t) ((stl_relgated_size - 1) * 0.1 + 0.5)];
-      free(stl_vector);
+      EBUR128_FREE(stl_vector);
       *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
       return EBUR128_SUCCESS;
     } else {
-      free(stl_vector);
+      EBUR128_FREE(stl_vector);
       *out = 0.0;
       return EBUR128_SUCCESS;
     }
@@ -1293,4 +2952,488 @@ int ebur128_prev_true_peak(ebur128_state* st,
        ? st->d->prev_true_peak[channel_number]
        : st->d->prev_sample_peak[channel_number];
   return EBUR128_SUCCESS;
-}
\ No newline at end of file
+}
+
+/* Serialized states start with this magic and version. All numbers are
+ * little-endian, energies and peaks are IEEE 754 doubles. */
+#define EBUR128_SERIAL_MAGIC "R128"
+#define EBUR128_SERIAL_VERSION 1
+/* Longer windows are rejected, so that a corrupt state cannot make
+ * ebur128_deserialize allocate arbitrary amounts of memory for sub-blocks
+ * (8 bytes per 100 ms of window). */
+#define EBUR128_SERIAL_MAX_WINDOW (24UL * 60 * 60 * 1000)
+/* Mode bits that only select how the history is stored. */
+#define EBUR128_HISTORY_ENCODING_MODES                                         \
+  (EBUR128_MODE_HISTORY_FLOAT | EBUR128_MODE_HISTORY_LOG16)
+
+/* Writes to p, or only counts the bytes if p is NULL. */
+struct ebur128_writer {
+  unsigned char* p;
+  size_t size;
+};
+
+/* Reads from [p, end). error is set once anything was read past end. */
+struct ebur128_reader {
+  const unsigned char* p;
+  const unsigned char* end;
+  int error;
+};
+
+static int ebur128_host_is_little_endian(void) {
+  const unsigned int one = 1;
+  return *(const unsigned char*) &one == 1;
+}
+
+static void ebur128_put_bytes(struct ebur128_writer* w, const void* v,
+                              size_t n) {
+  if (w->p) {
+    memcpy(w->p, v, n);
+    w->p += n;
+  }
+  w->size += n;
+}
+
+/* Writes n bytes of v, reversed on big-endian hosts. */
+static void ebur128_put_host(struct ebur128_writer* w, const void* v,
+                             size_t n) {
+  size_t i;
+  if (w->p) {
+    for (i = 0; i < n; ++i) {
+      w->p[i] = ((const unsigned char*) v)[
+          ebur128_host_is_little_endian() ? i : n - 1 - i];
+    }
+    w->p += n;
+  }
+  w->size += n;
+}
+
+static void ebur128_get_host(struct ebur128_reader* r, void* v, size_t n) {
+  size_t i;
+  if (r->error || (size_t) (r->end - r->p) < n) {
+    r->error = 1;
+    memset(v, 0, n);
+    return;
+  }
+  for (i = 0; i < n; ++i) {
+    ((unsigned char*) v)[ebur128_host_is_little_endian() ? i : n - 1 - i] =
+        r->p[i];
+  }
+  r->p += n;
+}
+
+static void ebur128_put_u32(struct ebur128_writer* w, unsigned long v) {
+  unsigned char b[4];
+  b[0] = (unsigned char) (v & 0xFF);
+  b[1] = (unsigned char) ((v >> 8) & 0xFF);
+  b[2] = (unsigned char) ((v >> 16) & 0xFF);
+  b[3] = (unsigned char) ((v >> 24) & 0xFF);
+  ebur128_put_bytes(w, b, 4);
+}
+
+static unsigned long ebur128_get_u32(struct ebur128_reader* r) {
+  unsigned long v;
+  if (r->error || r->end - r->p < 4) {
+    r->error = 1;
+    return 0;
+  }
+  v = (unsigned long) r->p[0] | (unsigned long) r->p[1] << 8 |
+      (unsigned long) r->p[2] << 16 | (unsigned long) r->p[3] << 24;
+  r->p += 4;
+  return v;
+}
+
+/* Durations are 64 bits, ULONG_MAX (unlimited) is stored as all ones. */
+static void ebur128_put_duration(struct ebur128_writer* w, unsigned long v) {
+  ebur128_put_u32(w, v & 0xFFFFFFFFUL);
+  ebur128_put_u32(w, v == ULONG_MAX ? 0xFFFFFFFFUL : (v >> 16) >> 16);
+}
+
+/* Durations that do not fit in an unsigned long are read as unlimited. */
+static unsigned long ebur128_get_duration(struct ebur128_reader* r) {
+  unsigned long low = ebur128_get_u32(r);
+  unsigned long high = ebur128_get_u32(r);
+  if (high == 0) return low;
+  if (high == 0xFFFFFFFFUL && low == 0xFFFFFFFFUL) return ULONG_MAX;
+  if (sizeof(unsigned long) <= 4) return ULONG_MAX;
+  return (high << 16) << 16 | low;
+}
+
+static void ebur128_put_doubles(struct ebur128_writer* w, const double* v,
+                                size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) ebur128_put_host(w, &v[i], sizeof(double));
+}
+
+static void ebur128_get_doubles(struct ebur128_reader* r, double* v,
+                                size_t n) {
+  size_t i;
+  for (i = 0; i < n; ++i) ebur128_get_host(r, &v[i], sizeof(double));
+}
+
+/* Writes the size and encoding of a block store and its blocks, oldest
+ * first, in the encoding of the store. */
+static void ebur128_put_block_store(struct ebur128_writer* w,
+                                    const struct ebur128_block_store* bs) {
+  size_t capacity = bs->page_count * EBUR128_BLOCK_PAGE_SIZE;
+  size_t i;
+  ebur128_put_u32(w, (unsigned long) bs->encoding);
+  ebur128_put_u32(w, (unsigned long) bs->size);
+  for (i = 0; i < bs->size; ++i) {
+    ebur128_put_host(w, EBUR128_BLOCK_AT(bs, (bs->head + i) % capacity),
+                     bs->block_size);
+  }
+}
+
+/* Reads blocks written by ebur128_put_block_store into the empty store bs.
+ * Every block is decoded and added again, which encodes it the same way. */
+static int ebur128_get_block_store(struct ebur128_reader* r,
+                                   struct ebur128_block_store* bs,
+                                   size_t bins) {
+  unsigned long i, size;
+  float f;
+  unsigned short code;
+  unsigned int bin;
+  double z;
+
+  if (ebur128_get_u32(r) != (unsigned long) bs->encoding) r->error = 1;
+  size = ebur128_get_u32(r);
+  if (r->error || size > bs->max ||
+      size > (size_t) (r->end - r->p) / bs->block_size) {
+    r->error = 1;
+    return EBUR128_SUCCESS;
+  }
+  for (i = 0; i < size; ++i) {
+    switch (bs->encoding) {
+      case EBUR128_BLOCKS_FLOAT:
+        ebur128_get_host(r, &f, sizeof(float));
+        z = f;
+        break;
+      case EBUR128_BLOCKS_LOG16:
+        ebur128_get_host(r, &code, sizeof(unsigned short));
+        z = ebur128_log16_energy(code);
+        break;
+      case EBUR128_BLOCKS_BIN:
+        ebur128_get_host(r, &bin, sizeof(unsigned int));
+        if (bin >= bins) r->error = 1;
+        z = bin;
+        break;
+      default:
+        ebur128_get_host(r, &z, sizeof(double));
+    }
+    if (r->error) return EBUR128_SUCCESS;
+    if (ebur128_block_store_add(bs, z)) return EBUR128_ERROR_NOMEM;
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Histograms are sparse: the number of used bins, then bin and count of
+ * each. */
+static void ebur128_put_histogram(struct ebur128_writer* w,
+                                  const unsigned long* histogram,
+                                  size_t bins) {
+  size_t i;
+  unsigned long used = 0;
+  for (i = 0; i < bins; ++i) used += histogram[i] != 0;
+  ebur128_put_u32(w, used);
+  for (i = 0; i < bins; ++i) {
+    if (histogram[i]) {
+      ebur128_put_u32(w, (unsigned long) i);
+      ebur128_put_u32(w, histogram[i]);
+    }
+  }
+}
+
+static void ebur128_get_histogram(struct ebur128_reader* r,
+                                  unsigned long* histogram, size_t bins) {
+  unsigned long i, used, bin;
+  memset(histogram, 0, bins * sizeof(unsigned long));
+  used = ebur128_get_u32(r);
+  if (used > bins) r->error = 1;
+  for (i = 0; i < used && !r->error; ++i) {
+    bin = ebur128_get_u32(r);
+    if (bin >= bins) {
+      r->error = 1;
+    } else {
+      histogram[bin] = ebur128_get_u32(r);
+    }
+  }
+}
+
+/* With a limited history in histogram mode, each histogram counts exactly
+ * the blocks in its store. Otherwise, evicting a block could decrement a
+ * bin that is already zero. Returns 0 if so, 1 if not, in which case the
+ * histogram is left changed. */
+static int ebur128_check_histogram(const struct ebur128_block_store* bs,
+                                   size_t bins) {
+  double blocks[256];
+  size_t i, k, n;
+  int mismatch = 0;
+
+  if (!bs->histogram) return 0;
+  /* take the blocks out of the histogram, then put them back */
+  for (i = 0; i < bs->size; i += n) {
+    n = ebur128_block_store_read(bs, i, 256, blocks);
+    for (k = 0; k < n; ++k) {
+      if (bs->histogram[(size_t) blocks[k]] == 0) return 1;
+      --bs->histogram[(size_t) blocks[k]];
+    }
+  }
+  for (k = 0; k < bins; ++k) {
+    if (bs->histogram[k]) mismatch = 1;
+  }
+  for (i = 0; i < bs->size; i += n) {
+    n = ebur128_block_store_read(bs, i, 256, blocks);
+    for (k = 0; k < n; ++k) ++bs->histogram[(size_t) blocks[k]];
+  }
+  return mismatch;
+}
+
+static void ebur128_put_state(struct ebur128_writer* w,
+                              const ebur128_state* st) {
+  const struct ebur128_state_internal* d = st->d;
+  size_t c, i;
+
+  ebur128_put_bytes(w, EBUR128_SERIAL_MAGIC, 4);
+  ebur128_put_u32(w, EBUR128_SERIAL_VERSION);
+  ebur128_put_u32(w, (unsigned long) st->mode);
+  ebur128_put_u32(w, st->channels);
+  ebur128_put_u32(w, st->samplerate);
+  ebur128_put_duration(w, d->window);
+  ebur128_put_duration(w, d->history);
+  ebur128_put_u32(w, d->use_histogram ? d->histogram_resolution : 0);
+  for (c = 0; c < st->channels; ++c) {
+    ebur128_put_u32(w, (unsigned long) d->channel_map[c]);
+  }
+
+  ebur128_put_doubles(w, d->v, 5 * st->channels);
+  ebur128_put_doubles(w, d->channel_energy, st->channels);
+  ebur128_put_u32(w, d->needed_frames);
+  ebur128_put_u32(w, (unsigned long) d->short_term_frame_counter);
+  ebur128_put_u32(w, (unsigned long) d->subblock_count);
+  for (i = 0; i < d->subblock_count; ++i) {
+    ebur128_put_doubles(w, &d->subblock_energy[
+        (d->subblock_index + d->subblocks - d->subblock_count + i) %
+        d->subblocks], 1);
+  }
+
+  ebur128_put_doubles(w, d->sample_peak, st->channels);
+  ebur128_put_doubles(w, d->true_peak, st->channels);
+  if (d->interp) {
+    ebur128_put_u32(w, d->interp->zi);
+    ebur128_put_u32(w, d->interp->channels * 2 * d->interp->delay);
+    for (i = 0; i < d->interp->channels * 2 * d->interp->delay; ++i) {
+      ebur128_put_host(w, &d->interp->zbuf[i], sizeof(float));
+    }
+  } else {
+    ebur128_put_u32(w, 0);
+    ebur128_put_u32(w, 0);
+  }
+
+  ebur128_put_block_store(w, &d->block_list);
+  ebur128_put_block_store(w, &d->short_term_block_list);
+  if (d->use_histogram) {
+    ebur128_put_histogram(w, d->block_energy_histogram, d->histogram_bins);
+    ebur128_put_histogram(w, d->short_term_block_energy_histogram,
+                          d->histogram_bins);
+  }
+}
+
+size_t ebur128_serialize(const ebur128_state* st, void* buffer, size_t size) {
+  struct ebur128_writer w;
+  w.p = NULL;
+  w.size = 0;
+  ebur128_put_state(&w, st);
+  if (buffer && size >= w.size) {
+    w.p = (unsigned char*) buffer;
+    w.size = 0;
+    ebur128_put_state(&w, st);
+  }
+  return w.size;
+}
+
+ebur128_state* ebur128_deserialize(const void* buffer, size_t size) {
+  struct ebur128_reader r;
+  struct ebur128_state_internal* d;
+  ebur128_state* st = NULL;
+  unsigned long mode, channels, samplerate, window, history, resolution;
+  unsigned long zi, zsize, value;
+  size_t c, i;
+  float f;
+
+  r.p = (const unsigned char*) buffer;
+  r.end = r.p + size;
+  r.error = 0;
+  if (size < 8 || memcmp(r.p, EBUR128_SERIAL_MAGIC, 4) != 0) return NULL;
+  r.p += 4;
+  if (ebur128_get_u32(&r) != EBUR128_SERIAL_VERSION) return NULL;
+  mode = ebur128_get_u32(&r);
+  channels = ebur128_get_u32(&r);
+  samplerate = ebur128_get_u32(&r);
+  window = ebur128_get_duration(&r);
+  history = ebur128_get_duration(&r);
+  resolution = ebur128_get_u32(&r);
+  /* the filter state alone has 5 doubles per channel */
+  if (r.error || mode > INT_MAX || channels == 0 || samplerate == 0 ||
+      window > EBUR128_SERIAL_MAX_WINDOW ||
+      channels > (size_t) (r.end - r.p) / (5 * sizeof(double))) {
+    return NULL;
+  }
+
+  st = ebur128_init((unsigned int) channels, samplerate, (int) mode);
+  if (!st) return NULL;
+  d = st->d;
+  if ((ebur128_set_max_window(st, window) == EBUR128_ERROR_NOMEM) ||
+      (d->use_histogram && resolution != d->histogram_resolution &&
+       ebur128_set_histogram_resolution(st, (unsigned int) resolution)) ||
+      (!d->use_histogram && resolution != 0) ||
+      d->window != window) {
+    goto fail;
+  }
+  ebur128_set_max_history(st, history);
+  if (d->history != history) goto fail;
+  for (c = 0; c < channels; ++c) {
+    value = ebur128_get_u32(&r);
+    if (value > EBUR128_Bm045) r.error = 1;
+    d->channel_map[c] = (int) value;
+  }
+
+  ebur128_get_doubles(&r, d->v, 5 * channels);
+  ebur128_get_doubles(&r, d->channel_energy, channels);
+  d->needed_frames = ebur128_get_u32(&r);
+  d->short_term_frame_counter = ebur128_get_u32(&r);
+  d->subblock_count = ebur128_get_u32(&r);
+  if (d->needed_frames == 0 || d->needed_frames > d->samples_in_100ms ||
+      d->short_term_frame_counter > 30 * d->samples_in_100ms ||
+      d->subblock_count > d->subblocks) {
+    goto fail;
+  }
+  ebur128_get_doubles(&r, d->subblock_energy, d->subblock_count);
+  d->subblock_index = d->subblock_count % d->subblocks;
+
+  ebur128_get_doubles(&r, d->sample_peak, channels);
+  ebur128_get_doubles(&r, d->true_peak, channels);
+  zi = ebur128_get_u32(&r);
+  zsize = ebur128_get_u32(&r);
+  if (d->interp) {
+    if (zi >= d->interp->delay ||
+        zsize != d->interp->channels * 2 * d->interp->delay) {
+      goto fail;
+    }
+    d->interp->zi = (unsigned int) zi;
+    for (i = 0; i < zsize; ++i) {
+      ebur128_get_host(&r, &f, sizeof(float));
+      d->interp->zbuf[i] = f;
+    }
+  } else if (zi != 0 || zsize != 0) {
+    goto fail;
+  }
+
+  if (ebur128_get_block_store(&r, &d->block_list, d->histogram_bins) ||
+      ebur128_get_block_store(&r, &d->short_term_block_list,
+                              d->histogram_bins)) {
+    goto fail;
+  }
+  if (d->use_histogram) {
+    ebur128_get_histogram(&r, d->block_energy_histogram, d->histogram_bins);
+    ebur128_get_histogram(&r, d->short_term_block_energy_histogram,
+                          d->histogram_bins);
+  }
+  if (r.error || r.p != r.end ||
+      ebur128_check_histogram(&d->block_list, d->histogram_bins) ||
+      ebur128_check_histogram(&d->short_term_block_list,
+                              d->histogram_bins)) {
+    goto fail;
+  }
+  return st;
+
+fail:
+  ebur128_destroy(&st);
+  return NULL;
+}
+
+/* Appends the blocks of from to the blocks of to, or adds the counts of
+ * from_histogram to to_histogram if the blocks are only counted. */
+static int ebur128_merge_blocks(struct ebur128_block_store* to,
+                                unsigned long* to_histogram,
+                                const struct ebur128_block_store* from,
+                                const unsigned long* from_histogram,
+                                size_t bins) {
+  double blocks[256];
+  size_t i, k, n;
+
+  if (to_histogram && !to->histogram) {
+    for (k = 0; k < bins; ++k) to_histogram[k] += from_histogram[k];
+    return EBUR128_SUCCESS;
+  }
+  for (i = 0; i < from->size; i += n) {
+    n = ebur128_block_store_read(from, i, 256, blocks);
+    for (k = 0; k < n; ++k) {
+      if (ebur128_block_store_add(to, blocks[k])) return EBUR128_ERROR_NOMEM;
+      if (to->histogram) ++to->histogram[(size_t) blocks[k]];
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_merge(ebur128_state* st, const ebur128_state* other) {
+  struct ebur128_state_internal* d = st->d;
+  const struct ebur128_state_internal* od = other->d;
+  int measured = other->mode & ~EBUR128_HISTORY_ENCODING_MODES;
+  int errcode = EBUR128_SUCCESS;
+  unsigned int c;
+
+  if (st == other || (st->mode & measured) != measured ||
+      d->use_histogram != od->use_histogram ||
+      (d->use_histogram &&
+       (d->histogram_resolution != od->histogram_resolution ||
+        (d->block_list.histogram && !od->block_list.histogram)))) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if ((other->mode & EBUR128_MODE_I) == EBUR128_MODE_I) {
+    errcode = ebur128_merge_blocks(&d->block_list, d->block_energy_histogram,
+                                   &od->block_list, od->block_energy_histogram,
+                                   d->histogram_bins);
+    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  }
+  if ((other->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+    errcode = ebur128_merge_blocks(&d->short_term_block_list,
+                                   d->short_term_block_energy_histogram,
+                                   &od->short_term_block_list,
+                                   od->short_term_block_energy_histogram,
+                                   d->histogram_bins);
+    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  }
+  for (c = 0; c < st->channels && c < other->channels; ++c) {
+    if (od->sample_peak[c] > d->sample_peak[c]) {
+      d->sample_peak[c] = od->sample_peak[c];
+    }
+    if (od->true_peak[c] > d->true_peak[c]) {
+      d->true_peak[c] = od->true_peak[c];
+    }
+  }
+
+exit:
+  return errcode;
+}
+
+void ebur128_reset_measurement(ebur128_state* st) {
+  struct ebur128_state_internal* d = st->d;
+  unsigned int c;
+
+  ebur128_block_store_destroy(&d->block_list);
+  ebur128_block_store_destroy(&d->short_term_block_list);
+  if (d->use_histogram) {
+    memset(d->block_energy_histogram, 0,
+           d->histogram_bins * sizeof(unsigned long));
+    memset(d->short_term_block_energy_histogram, 0,
+           d->histogram_bins * sizeof(unsigned long));
+    ebur128_track_histogram_blocks(st);
+  }
+  for (c = 0; c < st->channels; ++c) {
+    d->sample_peak[c] = 0.0;
+    d->prev_sample_peak[c] = 0.0;
+    d->true_peak[c] = 0.0;
+    d->prev_true_peak[c] = 0.0;
+  }
+}
@@ -76,6 +76,34 @@ enum error {
 /** \enum mode
  *  Use these values in ebur128_init (or'ed). Try to use the lowest possible
  *  modes that suit your needs, as performance will be better.
+ *
+ *  Unless EBUR128_MODE_HISTOGRAM is set, the energy of every gating block
+ *  (10 per second) and of every short-term block for the loudness range (1
+ *  per second) is kept as a double, together with a tree that keeps them
+ *  sorted so that ebur128_loudness_global and ebur128_loudness_range take
+ *  logarithmic time. That is 40 bytes per block plus spare room, about
+ *  2 MB per hour with EBUR128_MODE_I and EBUR128_MODE_LRA. For long
+ *  measurements, one of the following can be set to store the blocks in
+ *  arrays without the tree instead. No sorted or running bookkeeping is kept
+ *  then, so every call of those functions reads every block in the history
+ *  (see ebur128_set_max_history) and takes time linear in its length: about
+ *  0.15 ms and 0.3 ms per hour of history. Callers that query often, e.g. a
+ *  meter polling the integrated loudness, pay that cost on every query.
+ *  - EBUR128_MODE_HISTORY_FLOAT: 4 bytes per block, about 160 KB per hour.
+ *    Every block is off by less than 3e-7 LU.
+ *  - EBUR128_MODE_HISTORY_LOG16: 2 bytes per block, about 80 KB per hour.
+ *    Stores the loudness in steps of 0.005 LU from -70 LUFS (the absolute
+ *    gate) up to +257 LUFS, so every block is off by at most 0.0025 LU, the
+ *    integrated loudness by at most 0.0025 LU and the loudness range by at
+ *    most 0.005 LU. A block close to the relative gate may end up on the
+ *    other side of it, though, which moves the integrated loudness by up to
+ *    4.4 / n LU for n blocks above the gate and the percentiles of the
+ *    loudness range to the next short-term block. Tested with noise of
+ *    randomly changing level, programmes of 20 s to 10 min were off by at
+ *    most 0.023 LU integrated and 0.09 LU range, programmes of an hour by
+ *    0.0004 LU and 0.06 LU. EBU Tech 3341 allows 0.1 LU for the integrated
+ *    loudness and Tech 3342 1 LU for the loudness range.
+ *  Setting both makes ebur128_init fail.
  */
 enum mode {
   /** can call ebur128_loudness_momentary */
@@ -92,7 +120,11 @@ enum mode {
   EBUR128_MODE_TRUE_PEAK   = (1 << 5) | EBUR128_MODE_M
                                       | EBUR128_MODE_SAMPLE_PEAK,
   /** uses histogram algorithm to calculate loudness */
-  EBUR128_MODE_HISTOGRAM   = (1 << 6)
+  EBUR128_MODE_HISTOGRAM   = (1 << 6),
+  /** stores the history as float energies, see below */
+  EBUR128_MODE_HISTORY_FLOAT = (1 << 7),
+  /** stores the history as 16 bit loudness values, see below */
+  EBUR128_MODE_HISTORY_LOG16 = (1 << 8)
 };
 
 /** forward declaration of ebur128_state_internal */
@@ -128,6 +160,53 @@ ebur128_state* ebur128_init(unsigned int channels,
                             unsigned long samplerate,
                             int mode);
 
+/** \brief Get the memory needed by ebur128_init_arena.
+ *
+ *  @param channels the number of channels.
+ *  @param samplerate the sample rate.
+ *  @param mode see the mode enum for possible values.
+ *  @return size in bytes, 0 if ebur128_init would fail with these
+ *          parameters.
+ */
+size_t ebur128_arena_size(unsigned int channels,
+                          unsigned long samplerate,
+                          int mode);
+
+/** \brief Initialize library state in memory provided by the caller.
+ *
+ *  Lays out the whole state in arena instead of allocating its parts one by
+ *  one, with the parts used for every sample next to each other. What the
+ *  state allocates later, like the gating blocks of a long measurement or
+ *  the parts for another format after ebur128_change_parameters, still
+ *  comes from the heap. ebur128_destroy frees those, but not the arena.
+ *
+ *  @param arena memory, which has to stay valid until the state is
+ *               destroyed. Needs no particular alignment.
+ *  @param size size of arena in bytes, normally ebur128_arena_size. Parts
+ *              that do not fit into a smaller arena are allocated on the
+ *              heap.
+ *  @param channels the number of channels.
+ *  @param samplerate the sample rate.
+ *  @param mode see the mode enum for possible values.
+ *  @return an initialized library state, NULL on error or if arena is too
+ *          small to hold even the state itself.
+ */
+ebur128_state* ebur128_init_arena(void* arena, size_t size,
+                                  unsigned int channels,
+                                  unsigned long samplerate,
+                                  int mode);
+
+/** \brief Get the memory held by a library state.
+ *
+ *  Counts the bytes of every part of the state, including the whole arena
+ *  of a state from ebur128_init_arena, but not the overhead of the heap or
+ *  the stacks of the threads set with ebur128_set_threads.
+ *
+ *  @param st library state.
+ *  @return size in bytes.
+ */
+size_t ebur128_get_footprint(const ebur128_state* st);
+
 /** \brief Destroy library state.
  *
  *  @param st pointer to a library state.
@@ -160,6 +239,9 @@ int ebur128_set_channel(ebur128_state* st,
  *  Note that the channel map will be reset when setting a different number of
  *  channels. The current unfinished block will be lost.
  *
+ *  The last few formats are kept, so changing back to one of them does not
+ *  allocate memory or recompute filter coefficients.
+ *
  *  @param st library state.
  *  @param channels new number of channels.
  *  @param samplerate new sample rate.
@@ -176,7 +258,7 @@ int ebur128_change_parameters(ebur128_state* st,
 /** \brief Set the maximum window duration.
  *
  *  Set the maximum duration that will be used for ebur128_window_loudness().
- *  Note that this destroys the current content of the audio buffer.
+ *  Note that this destroys the current content of the sub-block buffer.
  *
  *  @param st library state.
  *  @param window duration of the window in ms.
@@ -193,8 +275,19 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window);
  *  Set the maximum history that will be stored for loudness integration.
  *  More history provides more accurate results, but requires more resources.
  *
- *  Applies to ebur128_loudness_range() and ebur128_loudness_global() when
- *  EBUR128_MODE_HISTOGRAM is not set.
+ *  Applies to ebur128_loudness_range() and ebur128_loudness_global(), which
+ *  then measure a sliding window: once the history is full, every new block
+ *  replaces the oldest one. Only blocks above the absolute gate count. Each
+ *  replacement takes logarithmic time, or constant time with
+ *  EBUR128_MODE_HISTOGRAM or EBUR128_MODE_HISTORY_*, and does not allocate.
+ *  ebur128_loudness_global() takes logarithmic time, time proportional to
+ *  the number of bins with EBUR128_MODE_HISTOGRAM and to the history with
+ *  EBUR128_MODE_HISTORY_*.
+ *
+ *  With EBUR128_MODE_HISTOGRAM, a limited history keeps the histogram bin of
+ *  every block in it, 4 bytes each. Blocks counted while the history was
+ *  unlimited cannot be taken out of the histograms again, so these are
+ *  cleared when a limit is set; set it right after ebur128_init().
  *
  *  Default is ULONG_MAX (at least ~50 days).
  *  Minimum is 3000ms for EBUR128_MODE_LRA and 400ms for EBUR128_MODE_M.
@@ -207,6 +300,47 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window);
  */
 int ebur128_set_max_history(ebur128_state* st, unsigned long history);
 
+/** \brief Set the resolution of the histogram.
+ *
+ *  Only for states created with EBUR128_MODE_HISTOGRAM, which uses 10 bins
+ *  per LU (0.1 LU) by default. The histogram covers -70 LUFS to +30 LUFS, so
+ *  its memory depends on the resolution, but not on the duration of the
+ *  programme. Note that this destroys the current content of the histogram,
+ *  so it should be called right after ebur128_init().
+ *
+ *  @param st library state.
+ *  @param bins_per_lu number of histogram bins per LU, at most 1000. Use 100
+ *                     for a resolution of 0.01 LU.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. The state will be
+ *      invalid and must be destroyed.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_HISTOGRAM" has not
+ *      been set or bins_per_lu is out of range.
+ *    - EBUR128_ERROR_NO_CHANGE if the resolution was not changed.
+ */
+int ebur128_set_histogram_resolution(ebur128_state* st,
+                                     unsigned int bins_per_lu);
+
+/** \brief Filter the channels on several threads.
+ *
+ *  Useful for layouts with many channels, e.g. 22.2. The channels are split
+ *  into groups that are filtered concurrently; the results are identical to
+ *  single-threaded processing. Short calls to the ebur128_add_frames_*
+ *  functions are still processed on the calling thread only.
+ *
+ *  @param st library state.
+ *  @param threads number of threads including the calling thread, at most 64.
+ *                 1 disables multi-threading, which is the default.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM if the worker threads could not be created. The
+ *      state stays valid and continues single-threaded.
+ *    - EBUR128_ERROR_INVALID_MODE if threads is 0 or too large.
+ *    - EBUR128_ERROR_NO_CHANGE if the number of threads was not changed.
+ */
+int ebur128_set_threads(ebur128_state* st, unsigned int threads);
+
 /** \brief Add frames to be processed.
  *
  *  @param st library state.
@@ -232,6 +366,27 @@ int ebur128_add_frames_double(ebur128_state* st,
                              const double* src,
                              size_t frames);
 
+/** \brief Add frames in planar (non-interleaved) format.
+ *
+ *  Avoids interleaving the output of decoders that produce one buffer per
+ *  channel. Samples are read in place, without an intermediate copy.
+ *
+ *  @param st library state.
+ *  @param src array of st->channels pointers, one buffer of frames samples
+ *             per channel.
+ *  @param frames number of frames.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ */
+int ebur128_add_frames_planar_float(ebur128_state* st,
+                                    const float* const* src,
+                                    size_t frames);
+/** \brief See \ref ebur128_add_frames_planar_float */
+int ebur128_add_frames_planar_double(ebur128_state* st,
+                                     const double* const* src,
+                                     size_t frames);
+
 /** \brief Get global integrated loudness in LUFS.
  *
  *  @param st library state.
@@ -257,6 +412,9 @@ int ebur128_loudness_global_multiple(ebur128_state** sts,
                                      double* out);
 
 /** \brief Get momentary loudness (last 400ms) in LUFS.
+ *
+ *  Loudness is measured over complete 100ms sub-blocks, so the result only
+ *  changes every 100ms of audio.
  *
  *  @param st library state.
  *  @param out momentary loudness in LUFS. -HUGE_VAL if result is negative
@@ -266,6 +424,9 @@ int ebur128_loudness_global_multiple(ebur128_state** sts,
  */
 int ebur128_loudness_momentary(ebur128_state* st, double* out);
 /** \brief Get short-term loudness (last 3s) in LUFS.
+ *
+ *  Loudness is measured over complete 100ms sub-blocks, so the result only
+ *  changes every 100ms of audio.
  *
  *  @param st library state.
  *  @param out short-term loudness in LUFS. -HUGE_VAL if result is negative
@@ -278,6 +439,8 @@ int ebur128_loudness_shortterm(ebur128_state* st, double* out);
 
 /** \brief Get loudness of the specified window in LUFS.
  *
+ *  Loudness is measured over complete 100ms sub-blocks, window is rounded up
+ *  to a multiple of 100ms.
  *  window must not be larger than the current window set in st.
  *  The current window can be changed by calling ebur128_set_max_window().
  *
@@ -419,6 +582,81 @@ int ebur128_prev_true_peak(ebur128_state* st,
  */
 int ebur128_relative_threshold(ebur128_state* st, double* out);
 
+/** \brief Serialize the measurement of a state.
+ *
+ *  Writes everything needed to continue the measurement later: the filter
+ *  and interpolator state, the current sub-blocks, the stored block energies
+ *  or histograms and the peaks. The format is versioned, little-endian and
+ *  independent of the host. The stored blocks keep their encoding, so the
+ *  size is dominated by them (see EBUR128_MODE_HISTORY_*); in histogram mode
+ *  only the used bins are written. Worker threads, the channel count and
+ *  sample rate of formats used before and the "prev" peaks are not saved.
+ *
+ *  @param st library state.
+ *  @param buffer receives the serialized state, may be NULL.
+ *  @param size size of buffer in bytes.
+ *  @return number of bytes needed. Nothing is written if buffer is NULL or
+ *          smaller than that.
+ */
+size_t ebur128_serialize(const ebur128_state* st, void* buffer, size_t size);
+
+/** \brief Create a state from the output of ebur128_serialize.
+ *
+ *  Adding the rest of the audio to the restored state gives the same results
+ *  as adding it to the original one. The block energies of states without
+ *  EBUR128_MODE_HISTOGRAM are reinserted one by one, so sums over them may
+ *  differ in the last digits.
+ *
+ *  @param buffer serialized state.
+ *  @param size size of buffer in bytes.
+ *  @return the restored state, or NULL if buffer is not a complete state
+ *          written by this version of the library, if its maximum window
+ *          is longer than 24 hours or on memory allocation error. Destroy
+ *          with ebur128_destroy.
+ */
+ebur128_state* ebur128_deserialize(const void* buffer, size_t size);
+
+/** \brief Fold the measurement of other into st.
+ *
+ *  Afterwards, the global loudness and loudness range of st are those of the
+ *  audio added to both states, as if other's audio had been added after
+ *  st's, and the peaks are the larger of both, per channel. The momentary
+ *  and short-term loudness and the filter state remain those of st. Blocks
+ *  of other are stored in the encoding of st, and a limited history of st
+ *  drops the oldest ones. other is not changed, so the sum of any number of
+ *  states can be built by merging them into one in turn, e.g. to combine
+ *  the results of parallel analyses of consecutive parts of a file.
+ *
+ *  @param st library state that receives other's measurement.
+ *  @param other library state.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error. st may hold some of
+ *      other's blocks.
+ *    - EBUR128_ERROR_INVALID_MODE if other is st, if other measures
+ *      something st does not, if only one of them uses
+ *      EBUR128_MODE_HISTOGRAM or the histogram resolutions differ, or if st
+ *      limits the history in histogram mode and other does not.
+ */
+int ebur128_merge(ebur128_state* st, const ebur128_state* other);
+
+/** \brief Forget the blocks and peaks measured so far.
+ *
+ *  The filter and interpolator state and the last sub-blocks are kept, so
+ *  momentary and short-term loudness continue, and the next gating blocks
+ *  still cover the audio before. This allows one long input to be analysed
+ *  in segments, e.g. on several threads. A state that is fed at least 3
+ *  seconds of the audio before its segment as pre-roll and is reset then
+ *  measures the same blocks of the segment as an uninterrupted state, if
+ *  the segment and the pre-roll start on multiples of 10 sub-blocks of
+ *  (samplerate + 5) / 10 frames from the start of the input, as the
+ *  short-term blocks for the loudness range are that far apart. The states
+ *  of consecutive segments can then be combined with ebur128_merge.
+ *
+ *  @param st library state.
+ */
+void ebur128_reset_measurement(ebur128_state* st);
+
 #ifdef __cplusplus
 }
 #endif
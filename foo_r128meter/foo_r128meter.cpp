@@ -13,124 +13,274 @@ DECLARE_COMPONENT_VERSION(
     "- https://github.com/jiixyj/libebur128\n"
 )
 
-class r128meter {
+// Receives a call on the main thread whenever the shared worker has
+// published new snapshots.
+class NOVTABLE r128meter_subscriber {
+public:
+    virtual void on_snapshot() = 0;
+};
+
+// One analysis pipeline shared by all meter instances, so that the audio is
+// only analysed once however many meters are shown. The first subscriber
+// creates the visualisation stream, the worker and the feed timer, the last
+// one to leave destroys them. Subscribers live on the main thread and are
+// told about new snapshots instead of polling for them.
+class r128meter_service {
 private:
-    unsigned m_samplerate;
-    unsigned m_channel_count;
-    unsigned m_channel_config;
-    double m_segment_duration;
-    ebur128_state * m_state;
+    pfc::ptr_list_t<r128meter_subscriber> m_subscribers;
+    int m_mode;
+    visualisation_stream_v2::ptr m_stream;
+    double m_backlog;
+    r128worker * m_worker;
+    UINT_PTR m_timer;
+    volatile LONG m_notify_pending;
+
+    // Position in the stream up to which audio has been handed to the worker,
+    // counted in frames at m_rate from m_base seconds, so that consecutive
+    // chunks join without rounding. m_base moves when the sample rate changes
+    // and when the cursor jumps.
+    bool m_started;
+    double m_base;
+    t_uint64 m_frames;
+    unsigned m_rate;
+    unsigned m_channels;
+
+    struct {
+        t_uint64 feeds;             // ticks that queued audio
+        t_uint64 idle_ticks;        // ticks without new audio
+        t_uint64 frames;            // frames queued
+        t_uint64 gaps;              // jumps forward past audio no longer in the backlog
+        double gap_seconds;
+        t_uint64 overlaps;          // jumps backward when playback restarted
+        double overlap_seconds;
+        t_uint64 deferred_frames;   // did not fit into the ring, queued on a later tick
+        double max_lag;             // largest distance between cursor and playback
+    } m_stats;
+
+    // Capacity of the ring between the main thread and the analysis worker,
+    // a bit more than 1 s of 8 channels at 96 kHz. Longer catch-ups are
+    // spread over several ticks.
+    enum {
+        worker_ring_bytes = 4 << 20
+    };
 
-public:
-    r128meter() : m_samplerate(0), m_channel_count(0), m_channel_config(0), m_segment_duration(0.0), m_state(nullptr) {
-    }
+    // The visualisation stream has no notification, so new audio is picked
+    // up at this interval.
+    enum {
+        feed_interval_ms = 100
+    };
 
-    ~r128meter() {
-        if (m_state) {
-            ebur128_destroy(&m_state);
+    // The backlog of the stream starts at min_backlog seconds and grows to
+    // twice the largest lag seen, up to max_backlog seconds, so that audio is
+    // still there after the main thread stalled.
+    static const double min_backlog;
+    static const double max_backlog;
+    // Backward moves of the playback time up to this many seconds are
+    // rounding, not a restart.
+    static const double jump_tolerance;
+
+    class notify_callback : public main_thread_callback {
+    public:
+        void callback_run() {
+            r128meter_service::get().dispatch();
         }
-    }
+    };
 
-    void add_chunk(audio_chunk *p_chunk) {
-        update_parameters(p_chunk);
+    r128meter_service() : m_mode(0), m_backlog(min_backlog), m_worker(nullptr), m_timer(0), m_notify_pending(0),
+        m_started(false), m_base(0.0), m_frames(0), m_rate(0), m_channels(0) {
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
 
-        int rval = ebur128_add_frames_float(m_state, p_chunk->get_data(), p_chunk->get_sample_count());
-        if (rval == EBUR128_SUCCESS) {
-            double duration = p_chunk->get_duration();
-            m_segment_duration += duration;
-        }
+    ~r128meter_service() {
+        r128worker_destroy(&m_worker);
     }
 
-    bool get_momentary_loudness(double *p_loudness, double *p_stable_in = nullptr) {
-        if (!m_state) return false;
-        int rval = ebur128_loudness_momentary(m_state, p_loudness);
-        if (p_stable_in) *p_stable_in = pfc::max_t(0.0, 0.4 - m_segment_duration);
-        return (rval == EBUR128_SUCCESS);
-    }
-
-    bool get_shortterm_loudness(double *p_loudness, double *p_stable_in = nullptr) {
-        if (!m_state) return false;
-        int rval = ebur128_loudness_shortterm(m_state, p_loudness);
-        if (p_stable_in) *p_stable_in = pfc::max_t(0.0, 3.0 - m_segment_duration);
-        if (rval != EBUR128_SUCCESS) {
-            switch (rval) {
-            case EBUR128_SUCCESS:
-                console::formatter() << "EBUR128_SUCCESS";
-                break;
-            case EBUR128_ERROR_NOMEM:
-                console::formatter() << "EBUR128_ERROR_NOMEM";
-                break;
-            case EBUR128_ERROR_INVALID_MODE:
-                console::formatter() << "EBUR128_ERROR_INVALID_MODE";
-                break;
-            case EBUR128_ERROR_INVALID_CHANNEL_INDEX:
-                console::formatter() << "EBUR128_ERROR_INVALID_CHANNEL_INDEX";
-                break;
-            case EBUR128_ERROR_NO_CHANGE:
-                console::formatter() << "EBUR128_ERROR_NO_CHANGE";
-                break;
-            default:
-                console::formatter() << rval;
-                break;
-            }
+    // Called on the worker thread. Queues one call of dispatch on the main
+    // thread; further snapshots until then are picked up by the same call.
+    static void on_worker_notify(void * p_user) {
+        r128meter_service * service = static_cast<r128meter_service *>(p_user);
+        if (InterlockedExchange(&service->m_notify_pending, 1) == 0) {
+            static_api_ptr_t<main_thread_callback_manager>()->add_callback(new service_impl_t<notify_callback>());
         }
-        return (rval == EBUR128_SUCCESS);
     }
 
-    bool get_loudness_range(double *p_loudness_range) {
-        if (!m_state) return false;
-        int rval = ebur128_loudness_range(m_state, p_loudness_range);
-        return (rval == EBUR128_SUCCESS);
+    static VOID CALLBACK on_feed_timer(HWND p_wnd, UINT p_msg, UINT_PTR p_id, DWORD p_time) {
+        r128meter_service::get().feed();
     }
 
-private:
-    bool update_parameters(audio_chunk *p_chunk) {
-        unsigned int sample_rate = p_chunk->get_sample_rate();
-        unsigned int channel_count = p_chunk->get_channel_count();
-        unsigned int channel_config = p_chunk->get_channel_config();
-
-        if ( !m_state ) {
-            m_state = ebur128_init(channel_count, sample_rate, EBUR128_MODE_M | EBUR128_MODE_S);
-            if ( !m_state ) return false;
+    void dispatch() {
+        InterlockedExchange(&m_notify_pending, 0);
+        for (t_size i = 0; i < m_subscribers.get_count(); ++i) {
+            m_subscribers[i]->on_snapshot();
         }
+    }
 
-        return change_parameters(sample_rate, channel_count, channel_config);
+    double cursor() const {
+        return m_rate ? m_base + (double)m_frames / m_rate : m_base;
     }
 
-    bool change_parameters(unsigned int p_sample_rate, unsigned int p_channel_count, unsigned int p_channel_config) {
+    void move_cursor(double p_time) {
+        m_base = p_time;
+        m_frames = 0;
+    }
 
-	    int rval = ebur128_change_parameters( m_state, p_channel_count, p_sample_rate );
+    void grow_backlog(double p_lag) {
+        if (p_lag > m_stats.max_lag) {
+            m_stats.max_lag = p_lag;
+        }
+        if (2.0 * p_lag > m_backlog && m_backlog < max_backlog) {
+            m_backlog = pfc::min_t(max_backlog, ceil(2.0 * p_lag));
+            m_stream->request_backlog(m_backlog);
+            console::formatter() << "R128 Meter: lagged " << pfc::format_float(p_lag, 0, 3) << " s behind playback, backlog raised to " << pfc::format_float(m_backlog, 0, 0) << " s";
+        }
+    }
 
-        if ( rval != EBUR128_SUCCESS && rval != EBUR128_ERROR_NO_CHANGE ) return false;
+    // Hands the audio between the cursor and the playback time to the
+    // worker. Every frame is queued exactly once unless it left the backlog
+    // before it could be fetched (a gap) or the playback time moved backwards
+    // (an overlap); both are counted. After a stall, the audio is caught up
+    // in as few pushes as the ring allows.
+    void feed() {
+        double time;
+        if (!m_stream->get_absolute_time(time)) {
+            ++m_stats.idle_ticks;
+            return;
+        }
+        if (!m_started) {
+            m_started = true;
+            move_cursor(time);
+        }
+        double position = cursor();
+        if (time + jump_tolerance < position) {
+            // Playback restarted, its time starts from zero again.
+            ++m_stats.overlaps;
+            m_stats.overlap_seconds += position - time;
+            move_cursor(0.0);
+            position = 0.0;
+        }
+        if (time <= position) {
+            ++m_stats.idle_ticks;
+            return;
+        }
+        // A raised backlog only fills up from now on.
+        double backlog = m_backlog;
+        grow_backlog(time - position);
+
+        // Do not fetch more than the ring takes, the rest stays in the backlog.
+        double length = time - position;
+        if (m_rate && m_channels) {
+            double max_length = (double)(worker_ring_bytes / 2) / (m_channels * sizeof(audio_sample)) / m_rate;
+            length = pfc::min_t(length, max_length);
+        }
 
-	    for ( unsigned int channel_index = 0; channel_index < p_channel_count; channel_index++ )
-	    {
-		    int channel = EBUR128_UNUSED;
+        audio_chunk_impl chunk;
+        if (!m_stream->get_chunk_absolute(chunk, position, length)) {
+            // The start has left the backlog, continue with the oldest audio
+            // that is probably still there.
+            double start = pfc::max_t(position, time - backlog + feed_interval_ms / 1000.0);
+            length = pfc::min_t(length, time - start);
+            if (start == position || !m_stream->get_chunk_absolute(chunk, start, length)) {
+                start = time;
+            }
+            ++m_stats.gaps;
+            m_stats.gap_seconds += start - position;
+            move_cursor(start);
+            if (start == time) return;
+        }
 
-		    switch ( audio_chunk::g_extract_channel_flag( p_channel_config, channel_index ) )
-		    {
-		    case audio_chunk::channel_front_left:   channel = EBUR128_LEFT;           break;
-		    case audio_chunk::channel_front_right:  channel = EBUR128_RIGHT;          break;
-		    case audio_chunk::channel_front_center: channel = EBUR128_CENTER;         break;
-		    case audio_chunk::channel_back_left:    channel = EBUR128_LEFT_SURROUND;  break;
-		    case audio_chunk::channel_back_right:   channel = EBUR128_RIGHT_SURROUND; break;
-		    }
+        if (chunk.get_sample_rate() != m_rate) {
+            move_cursor(cursor());
+            m_rate = chunk.get_sample_rate();
+        }
+        m_channels = chunk.get_channel_count();
+        t_size frames = chunk.get_sample_count();
+        t_size queued = r128worker_push(m_worker, chunk.get_data(), frames, m_rate, m_channels, chunk.get_channel_config());
+        m_frames += queued;
+        m_stats.frames += queued;
+        m_stats.deferred_frames += frames - queued;
+        ++m_stats.feeds;
+    }
 
-            rval = ebur128_set_channel( m_state, channel_index, channel );
+public:
+    static r128meter_service & get() {
+        static r128meter_service g_instance;
+        return g_instance;
+    }
+
+    // Adds a subscriber that needs p_mode. The worker runs the union of the
+    // modes of all subscribers. It is restarted when a subscriber needs a
+    // mode it does not run yet, but modes are not dropped when subscribers
+    // leave, so that the measurement of the others is not lost.
+    bool subscribe(r128meter_subscriber * p_subscriber, int p_mode) {
+        if ((m_mode | p_mode) != m_mode || !m_worker) {
+            r128worker * worker = r128worker_create(m_mode | p_mode, worker_ring_bytes);
+            if (!worker) return false;
+            r128worker_set_notify(worker, &on_worker_notify, this);
+            r128worker_destroy(&m_worker);
+            m_worker = worker;
+            m_mode |= p_mode;
+        }
+        if (m_stream.is_empty()) {
+            visualisation_manager::ptr manager = standard_api_create_t<visualisation_manager>();
+            manager->create_stream(m_stream, 0);
+            m_backlog = min_backlog;
+            m_stream->request_backlog(m_backlog);
+            m_stream->set_channel_mode(visualisation_stream_v2::channel_mode_default);
+            m_started = false;
+            m_rate = 0;
+            m_channels = 0;
+            m_timer = SetTimer(NULL, 0, feed_interval_ms, &on_feed_timer);
+        }
+        m_subscribers.add_item(p_subscriber);
+        return true;
+    }
 
-            if ( rval != 0 ) return false;
-	    }
+    void unsubscribe(r128meter_subscriber * p_subscriber) {
+        m_subscribers.remove_item(p_subscriber);
+        if (m_subscribers.get_count() == 0) {
+            KillTimer(NULL, m_timer);
+            m_timer = 0;
+            m_stream.release();
+            r128worker_destroy(&m_worker);
+            m_mode = 0;
+            console::formatter() << "R128 Meter: " << m_stats.frames << " frames in " << m_stats.feeds << " feed ticks, "
+                << m_stats.idle_ticks << " ticks without audio, "
+                << m_stats.gaps << " gaps (" << pfc::format_float(m_stats.gap_seconds, 0, 3) << " s), "
+                << m_stats.overlaps << " overlaps (" << pfc::format_float(m_stats.overlap_seconds, 0, 3) << " s), "
+                << m_stats.deferred_frames << " frames deferred, largest lag " << pfc::format_float(m_stats.max_lag, 0, 3) << " s";
+            memset(&m_stats, 0, sizeof(m_stats));
+        }
+    }
 
-	    return true;
+    void get_snapshot(r128worker_snapshot & p_snapshot) {
+        r128worker_get_snapshot(m_worker, &p_snapshot);
     }
 };
 
-class r128meter_ui_element : public ui_element_instance, public CWindowImpl<r128meter_ui_element> {
+const double r128meter_service::min_backlog = 1.0;
+const double r128meter_service::max_backlog = 10.0;
+const double r128meter_service::jump_tolerance = 0.01;
+
+class r128meter_ui_element : public ui_element_instance, public CWindowImpl<r128meter_ui_element>, private r128meter_subscriber {
 protected:
     ui_element_instance_callback::ptr m_callback;
-    visualisation_stream_v2::ptr m_stream;
-    double m_last_time;
-    r128meter m_meter;
+    int m_mode;
+    bool m_subscribed;
+
+    // Redraws are limited to one per refresh interval of the display.
+    DWORD m_refresh_ms;
+    DWORD m_last_redraw;
+    bool m_redraw_pending;
+    // A snapshot arrived while the window was hidden.
+    bool m_stale;
+    pfc::string8 m_shown_text;
+
+    struct {
+        t_uint64 shown;         // text changed and was set
+        t_uint64 unchanged;     // same text as shown
+        t_uint64 hidden;        // window not visible
+        t_uint64 coalesced;     // within the refresh interval of a redraw
+    } m_counters;
 
     CStatic m_label;
     CBrush m_brushBackground;
@@ -140,6 +290,8 @@ public:
         MSG_WM_CREATE(OnCreate)
         MSG_WM_DESTROY(OnDestroy)
         MSG_WM_TIMER(OnTimer)
+        MSG_WM_SHOWWINDOW(OnShowWindow)
+        MSG_WM_PAINT(OnPaint)
         MSG_WM_SIZE(OnSize)
         MSG_WM_CTLCOLORSTATIC(OnCtlColorStatic)
     END_MSG_MAP()
@@ -169,7 +321,9 @@ public:
         return builder.finish(g_get_guid());
     }
 
-    r128meter_ui_element(ui_element_config::ptr p_config, ui_element_instance_callback::ptr p_callback) : m_callback(p_callback), m_last_time(0.0) {
+    r128meter_ui_element(ui_element_config::ptr p_config, ui_element_instance_callback::ptr p_callback) : m_callback(p_callback), m_mode(EBUR128_MODE_M | EBUR128_MODE_S), m_subscribed(false),
+        m_refresh_ms(16), m_last_redraw(0), m_redraw_pending(false), m_stale(false) {
+        memset(&m_counters, 0, sizeof(m_counters));
         set_configuration(p_config);
     }
 
@@ -207,15 +361,18 @@ public:
     }
 
     enum {
-        ID_TIMER_UPDATE = 1
+        ID_TIMER_REDRAW = 1
     };
 
     int OnCreate(LPCREATESTRUCT lpCreateStruct) {
-        visualisation_manager::ptr manager = standard_api_create_t<visualisation_manager>();
-        manager->create_stream(m_stream, 0);
-        m_stream->request_backlog(1.0);
-        m_stream->set_channel_mode(visualisation_stream_v2::channel_mode_default);
-        SetTimer(ID_TIMER_UPDATE, 100);
+        m_subscribed = r128meter_service::get().subscribe(this, m_mode);
+        if (!m_subscribed) return -1;
+        {
+            CClientDC dc(*this);
+            int refresh_rate = dc.GetDeviceCaps(VREFRESH);
+            if (refresh_rate <= 1) refresh_rate = 60;
+            m_refresh_ms = 1000 / refresh_rate;
+        }
         m_label.Create(*this, 0, TEXT("R128 Meter"), WS_CHILD | WS_VISIBLE | SS_LEFTNOWORDWRAP | SS_NOPREFIX);
         notify(ui_element_notify_colors_changed, 0, nullptr, 0);
         notify(ui_element_notify_font_changed, 0, nullptr, 0);
@@ -223,48 +380,22 @@ public:
     }
 
     void OnDestroy() {
-        KillTimer(ID_TIMER_UPDATE);
-        m_stream.release();
+        KillTimer(ID_TIMER_REDRAW);
+        if (m_subscribed) {
+            r128meter_service::get().unsubscribe(this);
+            m_subscribed = false;
+            console::formatter() << "R128 Meter: " << m_counters.shown << " updates shown, "
+                << m_counters.unchanged << " unchanged, " << m_counters.hidden << " hidden, "
+                << m_counters.coalesced << " coalesced";
+        }
     }
 
     void OnTimer(UINT_PTR nIDEvent) {
         switch (nIDEvent) {
-        case ID_TIMER_UPDATE:
-            {
-                double time;
-                if (m_stream->get_absolute_time(time)) {
-                    if (time < m_last_time) {
-                        m_last_time = 0.0;
-                    }
-                    if (time > m_last_time) {
-                        audio_chunk_impl chunk;
-                        if (m_stream->get_chunk_absolute(chunk, m_last_time, time - m_last_time)) {
-                            m_meter.add_chunk(&chunk);
-                            pfc::string_formatter formatter;
-                            double loudness;
-                            double stable_in;
-                            if (m_meter.get_momentary_loudness(&loudness, &stable_in)) {
-                                formatter << "momentary loudness: " << pfc::format_float(loudness, 0, 1) << " LUFS";
-                                if (stable_in > 0.0) {
-                                    formatter << " (stable in " << pfc::format_float(ceil(stable_in), 0, 0) << " s)";
-                                }
-                                formatter << "\r\n";
-                            }
-                            if (m_meter.get_shortterm_loudness(&loudness, &stable_in)) {
-                                formatter << "short-term loudness: " << pfc::format_float(loudness, 0, 1) << " LUFS";
-                                if (stable_in > 0.0) {
-                                    formatter << " (stable in " << pfc::format_float(ceil(stable_in), 0, 0) << " s)";
-                                }
-                                formatter << "\r\n";
-                            }
-                            m_label.SetWindowText(pfc::stringcvt::string_os_from_utf8(formatter));
-                        } else {
-                            console::formatter() << "R128 Meter: no chunk available, time = " << time << ", last time = " << m_last_time;
-                        }
-                    }
-                    m_last_time = time;
-                }
-            }
+        case ID_TIMER_REDRAW:
+            KillTimer(ID_TIMER_REDRAW);
+            m_redraw_pending = false;
+            redraw();
             break;
         default:
             SetMsgHandled(FALSE);
@@ -272,6 +403,77 @@ public:
         }
     }
 
+    void OnShowWindow(BOOL bShow, UINT nStatus) {
+        SetMsgHandled(FALSE);
+        if (bShow && m_stale) {
+            redraw();
+        }
+    }
+
+    // WM_SHOWWINDOW is not sent when the window becomes visible because a
+    // parent is shown, so a stale text is also caught up on the next paint.
+    void OnPaint(CDCHandle dc) {
+        SetMsgHandled(FALSE);
+        if (m_stale) {
+            redraw();
+        }
+    }
+
+    // New snapshots are available. Redraws now, or once the refresh interval
+    // since the last redraw has passed, unless the window is hidden.
+    virtual void on_snapshot() {
+        if (!IsWindowVisible()) {
+            ++m_counters.hidden;
+            m_stale = true;
+            return;
+        }
+        if (m_redraw_pending) {
+            ++m_counters.coalesced;
+            return;
+        }
+        DWORD elapsed = GetTickCount() - m_last_redraw;
+        if (elapsed < m_refresh_ms) {
+            ++m_counters.coalesced;
+            m_redraw_pending = true;
+            SetTimer(ID_TIMER_REDRAW, m_refresh_ms - elapsed);
+            return;
+        }
+        redraw();
+    }
+
+    // Shows the latest snapshot. The control is only touched if the text
+    // differs from what it already shows.
+    void redraw() {
+        m_last_redraw = GetTickCount();
+        m_stale = false;
+        r128worker_snapshot snapshot;
+        r128meter_service::get().get_snapshot(snapshot);
+        pfc::string_formatter formatter;
+        if (snapshot.valid & R128WORKER_HAS_MOMENTARY) {
+            double stable_in = pfc::max_t(0.0, 0.4 - snapshot.duration);
+            formatter << "momentary loudness: " << pfc::format_float(snapshot.momentary, 0, 1) << " LUFS";
+            if (stable_in > 0.0) {
+                formatter << " (stable in " << pfc::format_float(ceil(stable_in), 0, 0) << " s)";
+            }
+            formatter << "\r\n";
+        }
+        if (snapshot.valid & R128WORKER_HAS_SHORTTERM) {
+            double stable_in = pfc::max_t(0.0, 3.0 - snapshot.duration);
+            formatter << "short-term loudness: " << pfc::format_float(snapshot.shortterm, 0, 1) << " LUFS";
+            if (stable_in > 0.0) {
+                formatter << " (stable in " << pfc::format_float(ceil(stable_in), 0, 0) << " s)";
+            }
+            formatter << "\r\n";
+        }
+        if (formatter.is_empty() || strcmp(formatter, m_shown_text) == 0) {
+            ++m_counters.unchanged;
+            return;
+        }
+        m_shown_text = formatter;
+        m_label.SetWindowText(pfc::stringcvt::string_os_from_utf8(formatter));
+        ++m_counters.shown;
+    }
+
     void OnSize(UINT nType, CSize size) {
         m_label.SetWindowPos(nullptr, 0, 0, size.cx, size.cy, SWP_NOZORDER);
     }
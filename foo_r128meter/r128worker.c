@@ -0,0 +1,459 @@
+/* See COPYING file for copyright and license details. */
+
+#include "r128worker.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "ebur128.h"
+
+/* The producer only writes head and the consumer only writes tail. Each
+ * publishes its index with release semantics after it is done with the
+ * ring memory, and reads the other one with acquire semantics. The snapshot
+ * is published with a sequence lock, its words are accessed atomically so
+ * that a reader racing with the worker only ever sees a torn copy that it
+ * then discards. With MSVC, volatile accesses have acquire and release
+ * semantics (/volatile:ms, the default on x86 and x64), the fences only have
+ * to keep the compiler from moving accesses. */
+#ifdef _MSC_VER
+#define R128WORKER_LOAD(p)              (*(volatile size_t*) (p))
+#define R128WORKER_STORE(p, v)          (*(volatile size_t*) (p) = (v))
+#define R128WORKER_LOAD_RELAXED(p)      (*(volatile size_t*) (p))
+#define R128WORKER_STORE_RELAXED(p, v)  (*(volatile size_t*) (p) = (v))
+#define R128WORKER_FENCE_ACQUIRE()      _ReadWriteBarrier()
+#define R128WORKER_FENCE_RELEASE()      _ReadWriteBarrier()
+#else
+#define R128WORKER_LOAD(p)              __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define R128WORKER_STORE(p, v)          __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define R128WORKER_LOAD_RELAXED(p)      __atomic_load_n(p, __ATOMIC_RELAXED)
+#define R128WORKER_STORE_RELAXED(p, v)  __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define R128WORKER_FENCE_ACQUIRE()      __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define R128WORKER_FENCE_RELEASE()      __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+#define R128WORKER_MIN_RING     65536
+#define R128WORKER_CACHE_LINE   64
+/* Marks the unused end of the ring, the next record starts at offset 0. */
+#define R128WORKER_WRAP         0xFFFFFFFFu
+
+/* Each chunk of audio is stored as a record header followed by the samples,
+ * padded to a multiple of the header size. Records are never split at the
+ * end of the ring, so the worker can feed the samples to ebur128 in place. */
+struct r128worker_record {
+  unsigned int frames;
+  unsigned int samplerate;
+  unsigned int channels;
+  unsigned int channel_mask;
+};
+
+#define R128WORKER_SNAPSHOT_WORDS                                              \
+    ((sizeof(r128worker_snapshot) + sizeof(size_t) - 1) / sizeof(size_t))
+
+union r128worker_published {
+  r128worker_snapshot snapshot;
+  size_t words[R128WORKER_SNAPSHOT_WORDS];
+};
+
+/* Aligned to R128WORKER_CACHE_LINE. The producer's fields, the consumer's
+ * index and the snapshot each start on a cache line of their own, so that
+ * fields written by different threads never share one. The sequence shares
+ * its line with the start of the snapshot, which readers load together with
+ * it anyway. */
+struct r128worker {
+  /* written by the producer */
+  size_t head;
+  unsigned long dropped;
+  char pad0[R128WORKER_CACHE_LINE - sizeof(size_t) - sizeof(unsigned long)];
+  /* written by the consumer */
+  size_t tail;
+  char pad1[R128WORKER_CACHE_LINE - sizeof(size_t)];
+  /* published by the consumer, odd while it is being written */
+  size_t sequence;
+  union r128worker_published published;
+  char pad2[R128WORKER_CACHE_LINE -
+            (sizeof(size_t) + sizeof(union r128worker_published)) %
+            R128WORKER_CACHE_LINE];
+
+  void* memory;                     /* as returned by calloc */
+  unsigned char* ring;
+  size_t size;                      /* power of two */
+  int quit;
+
+  /* owned by the worker thread */
+  ebur128_state* st;
+  int mode;
+  unsigned int samplerate;
+  unsigned int channels;
+  unsigned int channel_mask;
+  double duration;
+  size_t block_left;                /* frames until the next snapshot */
+  r128worker_snapshot current;      /* the next snapshot */
+  r128worker_notify_function notify;
+  void* notify_user;
+
+#ifdef _WIN32
+  HANDLE thread;
+  HANDLE wake;
+#else
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int signalled;
+#endif
+};
+
+static size_t r128worker_record_size(size_t frames, unsigned int channels) {
+  size_t header = sizeof(struct r128worker_record);
+  size_t bytes = header + frames * channels * sizeof(float);
+  return (bytes + header - 1) / header * header;
+}
+
+/* Maps channel i of a channel mask to the ebur128 channel, as the n-th set
+ * bit of the mask. */
+static int r128worker_map_channel(unsigned int channel_mask, unsigned int i) {
+  unsigned int bit;
+  for (bit = 0; bit < 32; ++bit) {
+    if (channel_mask & (1u << bit)) {
+      if (i == 0) break;
+      --i;
+    }
+  }
+  switch (bit) {
+    case 0: return EBUR128_LEFT;
+    case 1: return EBUR128_RIGHT;
+    case 2: return EBUR128_CENTER;
+    case 4: return EBUR128_LEFT_SURROUND;
+    case 5: return EBUR128_RIGHT_SURROUND;
+    default: return EBUR128_UNUSED;
+  }
+}
+
+/* Brings the state to the format of a record. Returns 0 on error, in which
+ * case the record is skipped. */
+static int r128worker_set_format(r128worker* worker,
+                                 const struct r128worker_record* rec) {
+  unsigned int i;
+  int rval = EBUR128_SUCCESS;
+
+  if (worker->st && rec->samplerate == worker->samplerate &&
+      rec->channels == worker->channels &&
+      rec->channel_mask == worker->channel_mask) {
+    return 1;
+  }
+  if (!worker->st) {
+    worker->st = ebur128_init(rec->channels, rec->samplerate, worker->mode);
+    if (!worker->st) return 0;
+  } else {
+    rval = ebur128_change_parameters(worker->st, rec->channels,
+                                     rec->samplerate);
+    if (rval != EBUR128_SUCCESS && rval != EBUR128_ERROR_NO_CHANGE) {
+      worker->channels = 0;
+      return 0;
+    }
+  }
+  for (i = 0; i < rec->channels; ++i) {
+    ebur128_set_channel(worker->st, i,
+                        r128worker_map_channel(rec->channel_mask, i));
+  }
+  worker->samplerate = rec->samplerate;
+  worker->channels = rec->channels;
+  worker->channel_mask = rec->channel_mask;
+  /* the state only starts a new sub-block if the format really changed,
+   * not for a new channel mask */
+  if (rval == EBUR128_SUCCESS) {
+    worker->block_left = (rec->samplerate + 5) / 10;
+  }
+  return 1;
+}
+
+/* Updates the next snapshot from the state and publishes it. */
+static void r128worker_publish(r128worker* worker) {
+  r128worker_snapshot* next = &worker->current;
+  ebur128_state* st = worker->st;
+  union r128worker_published words;
+  size_t sequence = worker->sequence;
+  unsigned int c;
+  size_t i;
+
+  ++next->block;
+  next->duration = worker->duration;
+  next->valid = 0;
+  if (ebur128_loudness_momentary(st, &next->momentary) == EBUR128_SUCCESS) {
+    next->valid |= R128WORKER_HAS_MOMENTARY;
+    if (next->momentary > next->max_momentary) {
+      next->max_momentary = next->momentary;
+    }
+  }
+  if (ebur128_loudness_shortterm(st, &next->shortterm) == EBUR128_SUCCESS) {
+    next->valid |= R128WORKER_HAS_SHORTTERM;
+    if (next->shortterm > next->max_shortterm) {
+      next->max_shortterm = next->shortterm;
+    }
+  }
+  if (ebur128_loudness_global(st, &next->integrated) == EBUR128_SUCCESS) {
+    next->valid |= R128WORKER_HAS_INTEGRATED;
+  }
+  if (ebur128_loudness_range(st, &next->range) == EBUR128_SUCCESS) {
+    next->valid |= R128WORKER_HAS_RANGE;
+  }
+  next->channels = worker->channels < R128WORKER_MAX_CHANNELS ?
+                   worker->channels : R128WORKER_MAX_CHANNELS;
+  next->valid |= R128WORKER_HAS_SAMPLE_PEAK | R128WORKER_HAS_TRUE_PEAK;
+  for (c = 0; c < next->channels; ++c) {
+    if (ebur128_sample_peak(st, c, &next->sample_peak[c])) {
+      next->valid &= ~(unsigned int) R128WORKER_HAS_SAMPLE_PEAK;
+    }
+    if (ebur128_true_peak(st, c, &next->true_peak[c])) {
+      next->valid &= ~(unsigned int) R128WORKER_HAS_TRUE_PEAK;
+    }
+  }
+
+  words.snapshot = *next;
+  R128WORKER_STORE_RELAXED(&worker->sequence, sequence + 1);
+  R128WORKER_FENCE_RELEASE();
+  for (i = 0; i < R128WORKER_SNAPSHOT_WORDS; ++i) {
+    R128WORKER_STORE_RELAXED(&worker->published.words[i], words.words[i]);
+  }
+  R128WORKER_STORE(&worker->sequence, sequence + 2);
+}
+
+/* Analyses the samples of a record, publishing a snapshot after every
+ * 100 ms. */
+static void r128worker_analyse(r128worker* worker,
+                               const struct r128worker_record* rec) {
+  const float* src = (const float*) (rec + 1);
+  size_t done = 0;
+  while (done < rec->frames) {
+    size_t n = rec->frames - done;
+    if (n > worker->block_left) n = worker->block_left;
+    if (ebur128_add_frames_float(worker->st, src + done * rec->channels, n) !=
+        EBUR128_SUCCESS) {
+      return;
+    }
+    done += n;
+    worker->duration += (double) n / rec->samplerate;
+    worker->block_left -= n;
+    if (worker->block_left == 0) {
+      worker->block_left = (rec->samplerate + 5) / 10;
+      r128worker_publish(worker);
+    }
+  }
+}
+
+/* Analyses all records in the ring, then notifies once if any snapshots
+ * were published. */
+static void r128worker_drain(r128worker* worker) {
+  size_t tail = worker->tail;
+  size_t head = R128WORKER_LOAD(&worker->head);
+  unsigned long block = worker->current.block;
+  while (tail != head) {
+    size_t pos = tail & (worker->size - 1);
+    const struct r128worker_record* rec =
+        (const struct r128worker_record*) (worker->ring + pos);
+    if (rec->frames == R128WORKER_WRAP) {
+      tail += worker->size - pos;
+    } else {
+      if (r128worker_set_format(worker, rec)) r128worker_analyse(worker, rec);
+      tail += r128worker_record_size(rec->frames, rec->channels);
+    }
+    R128WORKER_STORE(&worker->tail, tail);
+    if (tail == head) head = R128WORKER_LOAD(&worker->head);
+  }
+  if (worker->notify && worker->current.block != block) {
+    worker->notify(worker->notify_user);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI r128worker_main(LPVOID arg) {
+  r128worker* worker = (r128worker*) arg;
+  for (;;) {
+    WaitForSingleObject(worker->wake, INFINITE);
+    if (worker->quit) break;
+    r128worker_drain(worker);
+  }
+  return 0;
+}
+#else
+static void* r128worker_main(void* arg) {
+  r128worker* worker = (r128worker*) arg;
+  int quit;
+  for (;;) {
+    pthread_mutex_lock(&worker->mutex);
+    while (!worker->signalled && !worker->quit) {
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+    }
+    worker->signalled = 0;
+    /* quit is written under the mutex, so read it there too */
+    quit = worker->quit;
+    pthread_mutex_unlock(&worker->mutex);
+    if (quit) break;
+    r128worker_drain(worker);
+  }
+  return NULL;
+}
+#endif
+
+static void r128worker_wake(r128worker* worker) {
+#ifdef _WIN32
+  SetEvent(worker->wake);
+#else
+  pthread_mutex_lock(&worker->mutex);
+  worker->signalled = 1;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&worker->mutex);
+#endif
+}
+
+r128worker* r128worker_create(int mode, size_t ring_bytes) {
+  r128worker* worker;
+  void* memory;
+  size_t size = R128WORKER_MIN_RING;
+
+  while (size < ring_bytes) size *= 2;
+  memory = calloc(1, sizeof(r128worker) + R128WORKER_CACHE_LINE);
+  if (!memory) return NULL;
+  worker = (r128worker*) (((size_t) memory + R128WORKER_CACHE_LINE) &
+                          ~(size_t) (R128WORKER_CACHE_LINE - 1));
+  worker->memory = memory;
+  worker->ring = (unsigned char*) malloc(size);
+  if (!worker->ring) {
+    free(memory);
+    return NULL;
+  }
+  worker->size = size;
+  worker->mode = mode;
+  worker->current.max_momentary = -HUGE_VAL;
+  worker->current.max_shortterm = -HUGE_VAL;
+#ifdef _WIN32
+  worker->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (worker->wake) {
+    worker->thread = CreateThread(NULL, 0, r128worker_main, worker, 0, NULL);
+  }
+  if (!worker->thread) {
+    if (worker->wake) CloseHandle(worker->wake);
+    free(worker->ring);
+    free(memory);
+    return NULL;
+  }
+#else
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->cond, NULL);
+  if (pthread_create(&worker->thread, NULL, r128worker_main, worker)) {
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    free(worker->ring);
+    free(memory);
+    return NULL;
+  }
+#endif
+  return worker;
+}
+
+void r128worker_destroy(r128worker** worker) {
+  r128worker* w = *worker;
+  if (!w) return;
+#ifdef _WIN32
+  w->quit = 1;
+  SetEvent(w->wake);
+  WaitForSingleObject(w->thread, INFINITE);
+  CloseHandle(w->thread);
+  CloseHandle(w->wake);
+#else
+  pthread_mutex_lock(&w->mutex);
+  w->quit = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->thread, NULL);
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->mutex);
+#endif
+  if (w->st) ebur128_destroy(&w->st);
+  free(w->ring);
+  free(w->memory);
+  *worker = NULL;
+}
+
+size_t r128worker_push(r128worker* worker, const float* src, size_t frames,
+                       unsigned int samplerate, unsigned int channels,
+                       unsigned int channel_mask) {
+  size_t head = worker->head;
+  size_t tail = R128WORKER_LOAD(&worker->tail);
+  size_t max_frames, queued = 0;
+
+  if (!channels || !samplerate) return 0;
+  /* keep records small enough that the ring always takes at least two */
+  max_frames = (worker->size / 4 - sizeof(struct r128worker_record)) /
+               (channels * sizeof(float));
+  while (queued < frames) {
+    struct r128worker_record* rec;
+    size_t n = frames - queued;
+    size_t pos = head & (worker->size - 1);
+    size_t free_bytes = worker->size - (head - tail);
+    size_t size, skip = 0;
+    if (n > max_frames) n = max_frames;
+    size = r128worker_record_size(n, channels);
+    if (size > worker->size - pos) skip = worker->size - pos;
+    if (skip + size > free_bytes) {
+      tail = R128WORKER_LOAD(&worker->tail);
+      free_bytes = worker->size - (head - tail);
+      if (skip + size > free_bytes) break;
+    }
+    if (skip) {
+      rec = (struct r128worker_record*) (worker->ring + pos);
+      rec->frames = R128WORKER_WRAP;
+      head += skip;
+      pos = 0;
+    }
+    rec = (struct r128worker_record*) (worker->ring + pos);
+    rec->frames = (unsigned int) n;
+    rec->samplerate = samplerate;
+    rec->channels = channels;
+    rec->channel_mask = channel_mask;
+    memcpy(rec + 1, src + queued * channels, n * channels * sizeof(float));
+    head += size;
+    queued += n;
+  }
+  if (head != worker->head) {
+    R128WORKER_STORE(&worker->head, head);
+    r128worker_wake(worker);
+  }
+  /* the caller may push the rest again, it is counted anyway */
+  worker->dropped += (unsigned long) (frames - queued);
+  return queued;
+}
+
+void r128worker_get_snapshot(r128worker* worker,
+                             r128worker_snapshot* snapshot) {
+  union r128worker_published words;
+  size_t begin, end, i;
+  do {
+    begin = R128WORKER_LOAD(&worker->sequence);
+    for (i = 0; i < R128WORKER_SNAPSHOT_WORDS; ++i) {
+      words.words[i] = R128WORKER_LOAD_RELAXED(&worker->published.words[i]);
+    }
+    R128WORKER_FENCE_ACQUIRE();
+    end = R128WORKER_LOAD_RELAXED(&worker->sequence);
+  } while ((begin & 1) || begin != end);
+  *snapshot = words.snapshot;
+}
+
+void r128worker_set_notify(r128worker* worker,
+                           r128worker_notify_function notify, void* user) {
+  worker->notify = notify;
+  worker->notify_user = user;
+}
+
+unsigned long r128worker_dropped_frames(r128worker* worker) {
+  return worker->dropped;
+}
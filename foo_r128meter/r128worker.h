@@ -0,0 +1,149 @@
+/* See COPYING file for copyright and license details. */
+
+#ifndef R128WORKER_H_
+#define R128WORKER_H_
+
+/** \file r128worker.h
+ *  \brief Background loudness analysis for the meter UI.
+ *
+ *  A worker owns an ebur128_state and a thread that runs it. Audio is handed
+ *  to the worker through a lock-free single-producer/single-consumer ring, so
+ *  the thread that feeds it never waits for the analysis. After every 100 ms
+ *  of audio, the worker publishes a snapshot of the results, which any number
+ *  of threads can read at any time without locking.
+ *
+ *  This file and r128worker.c only depend on ebur128 and on Win32 or POSIX
+ *  threads, not on foobar2000.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/** \brief Opaque worker. */
+typedef struct r128worker r128worker;
+
+/** Peaks are reported for this many channels at most. */
+#define R128WORKER_MAX_CHANNELS 8
+
+/** \brief Bits of r128worker_snapshot::valid. */
+enum {
+  R128WORKER_HAS_MOMENTARY   = (1 << 0),
+  R128WORKER_HAS_SHORTTERM   = (1 << 1),
+  R128WORKER_HAS_INTEGRATED  = (1 << 2),
+  R128WORKER_HAS_RANGE       = (1 << 3),
+  R128WORKER_HAS_SAMPLE_PEAK = (1 << 4),
+  R128WORKER_HAS_TRUE_PEAK   = (1 << 5)
+};
+
+/** \brief Results of the audio analysed so far.
+ *
+ *  Loudness is in LUFS, loudness range in LU and peaks are linear (1.0 is
+ *  0 dBFS). A value is only valid if its bit is set in valid, which depends
+ *  on the mode of the worker.
+ */
+typedef struct {
+  /** Number of 100 ms blocks analysed, increases with every snapshot. */
+  unsigned long block;
+  /** Bitmap of R128WORKER_HAS_* values. */
+  unsigned int valid;
+  /** Number of valid peaks, at most R128WORKER_MAX_CHANNELS. */
+  unsigned int channels;
+  double momentary;
+  double shortterm;
+  double integrated;
+  double range;
+  /** Largest momentary and short-term loudness so far. */
+  double max_momentary;
+  double max_shortterm;
+  /** Seconds of audio analysed. */
+  double duration;
+  double sample_peak[R128WORKER_MAX_CHANNELS];
+  double true_peak[R128WORKER_MAX_CHANNELS];
+} r128worker_snapshot;
+
+/** \brief Called by the worker thread after it published snapshots. */
+typedef void (*r128worker_notify_function)(void* user);
+
+/** \brief Create a worker and start its thread.
+ *
+ *  @param mode ebur128 mode bitmap, see ebur128_init.
+ *  @param ring_bytes capacity of the ring. Rounded up to a power of two, at
+ *                    least 64 KiB. Audio that does not fit is not queued,
+ *                    see r128worker_push.
+ *  @return worker on success, NULL on memory allocation or thread creation
+ *          error.
+ */
+r128worker* r128worker_create(int mode, size_t ring_bytes);
+
+/** \brief Stop the thread and destroy the worker.
+ *
+ *  @param worker pointer to a worker, set to NULL.
+ */
+void r128worker_destroy(r128worker** worker);
+
+/** \brief Queue interleaved float frames for analysis.
+ *
+ *  Must only be called by one thread at a time. Never blocks. The format may
+ *  change from one call to the next.
+ *
+ *  @param worker worker.
+ *  @param src interleaved samples, channels per frame.
+ *  @param frames number of frames.
+ *  @param samplerate sample rate of src.
+ *  @param channels number of channels of src.
+ *  @param channel_mask speaker positions of the channels in the order of the
+ *                      WAVEFORMATEXTENSIBLE dwChannelMask bits, as used by
+ *                      foobar2000's channel config. Channels other than front
+ *                      left/right/center and back left/right are not used
+ *                      for loudness.
+ *  @return number of frames queued. Less than frames if the ring is full.
+ *          The rest may be pushed again later, but is counted by
+ *          r128worker_dropped_frames either way.
+ */
+size_t r128worker_push(r128worker* worker, const float* src, size_t frames,
+                       unsigned int samplerate, unsigned int channels,
+                       unsigned int channel_mask);
+
+/** \brief Get the latest snapshot.
+ *
+ *  May be called from any number of threads at once. Never blocks, but
+ *  retries the copy if the worker published a new snapshot in the meantime.
+ *
+ *  @param worker worker.
+ *  @param snapshot receives the snapshot. All zero before the first 100 ms
+ *                  of audio have been analysed.
+ */
+void r128worker_get_snapshot(r128worker* worker,
+                             r128worker_snapshot* snapshot);
+
+/** \brief Set a function to be called when there are new snapshots.
+ *
+ *  The function is called on the worker thread, once after each batch of
+ *  queued audio that completed at least one 100 ms block, so it is not
+ *  called more often than the audio is pushed. It must not call back into
+ *  the worker except for r128worker_get_snapshot. Must be set before the
+ *  first call to r128worker_push.
+ *
+ *  @param worker worker.
+ *  @param notify function, or NULL for none.
+ *  @param user passed to notify.
+ */
+void r128worker_set_notify(r128worker* worker,
+                           r128worker_notify_function notify, void* user);
+
+/** \brief Get the number of frames not queued because the ring was full.
+ *
+ *  Counts every frame that r128worker_push did not queue, whether or not it
+ *  was pushed again later, so this is an upper bound of the audio that was
+ *  not analysed. Must be called from the thread that calls r128worker_push.
+ */
+unsigned long r128worker_dropped_frames(r128worker* worker);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* R128WORKER_H_ */
@@ -19,5 +19,6 @@
 #include "foobar2000/ATLHelpers/ATLHelpers.h"
 
 #include "ebur128.h"
+#include "r128worker.h"
 
 #include "foo_r128meter_version.h"
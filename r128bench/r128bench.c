@@ -0,0 +1,1478 @@
+/* r128bench - micro-benchmarks for ebur128.c
+ *
+ * Times every ebur128_add_frames_* function over a matrix of modes, sample
+ * rates, channel counts and chunk sizes, and every query function against
+ * the length of the session, and ebur128_init for every mode, also for many
+ * streams at once on the heap and in arenas. A stress test
+ * creates, feeds and destroys states on several threads at once and checks
+ * their results, a history test follows the memory and the results of
+ * measurements that last for hours and a window test checks sliding windows
+ * against a brute-force computation. ebur128.c is included directly so that
+ * its allocations can be counted through the EBUR128_MALLOC hooks, which
+ * the fault check also uses to make allocations fail and to find leaks. A
+ * planar check compares interleaved and planar input, a pool check one thread
+ * with several, and a worker check runs r128worker.c against ebur128.c.
+ *
+ * Output is one tab separated line per measurement, see bench_usage. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* counted atomically, the stress test allocates on several threads */
+static unsigned long bench_allocs;
+/* blocks allocated and not freed yet */
+static long bench_live;
+/* number of the allocation that fails in the fault test, 0 for none */
+static unsigned long bench_fail_at;
+
+static int bench_fail(void) {
+  unsigned long n = __sync_add_and_fetch(&bench_allocs, 1);
+  return bench_fail_at && n == bench_fail_at;
+}
+
+static void* bench_malloc(size_t size) {
+  void* p = bench_fail() ? NULL : malloc(size);
+  if (p) __sync_fetch_and_add(&bench_live, 1);
+  return p;
+}
+
+static void* bench_calloc(size_t count, size_t size) {
+  void* p = bench_fail() ? NULL : calloc(count, size);
+  if (p) __sync_fetch_and_add(&bench_live, 1);
+  return p;
+}
+
+static void* bench_realloc(void* ptr, size_t size) {
+  void* p = bench_fail() ? NULL : realloc(ptr, size);
+  if (p && !ptr) __sync_fetch_and_add(&bench_live, 1);
+  return p;
+}
+
+static void bench_free(void* ptr) {
+  if (ptr) __sync_fetch_and_sub(&bench_live, 1);
+  free(ptr);
+}
+
+/* cleared by -X to time the scalar filter */
+static int bench_simd = 1;
+/* threads of the add measurements, set by -j */
+static unsigned int bench_threads = 1;
+
+#define EBUR128_USE_SIMD bench_simd
+#define EBUR128_MALLOC  bench_malloc
+#define EBUR128_CALLOC  bench_calloc
+#define EBUR128_REALLOC bench_realloc
+#define EBUR128_FREE    bench_free
+#include "ebur128.c"
+#include "r128worker.c"
+
+#define BENCH_MAX_LIST 16
+/* most channels of the planar types, whose pointers are kept on the stack */
+#define BENCH_MAX_CHANNELS 64
+/* minimum measuring time of a query in seconds */
+#define BENCH_QUERY_TIME 0.02
+/* states per thread and seconds of audio per state in the stress test */
+#define BENCH_STRESS_STATES 1000
+#define BENCH_STRESS_SECONDS 0.5
+/* seconds of audio per state in the planar check */
+#define BENCH_PLANAR_SECONDS 6.0
+/* thread counts compared with a single thread by the pool check */
+static const unsigned int bench_pool_threads[] = {2, 3, 4};
+
+struct bench_mode {
+  const char* name;
+  int mode;
+};
+
+static const struct bench_mode bench_modes[] = {
+  {"M",           EBUR128_MODE_M},
+  {"S",           EBUR128_MODE_S},
+  {"I",           EBUR128_MODE_I},
+  {"LRA",         EBUR128_MODE_LRA},
+  {"I+LRA",       EBUR128_MODE_I | EBUR128_MODE_LRA},
+  {"I+LRA+H",     EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_HISTOGRAM},
+  {"I+LRA+F",     EBUR128_MODE_I | EBUR128_MODE_LRA |
+                  EBUR128_MODE_HISTORY_FLOAT},
+  {"I+LRA+L16",   EBUR128_MODE_I | EBUR128_MODE_LRA |
+                  EBUR128_MODE_HISTORY_LOG16},
+  {"SAMPLE_PEAK", EBUR128_MODE_SAMPLE_PEAK},
+  {"TRUE_PEAK",   EBUR128_MODE_TRUE_PEAK},
+  {"ALL",         EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK},
+  {"ALL+H",       EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK |
+                  EBUR128_MODE_HISTOGRAM}
+};
+
+#define BENCH_MODES (sizeof(bench_modes) / sizeof(bench_modes[0]))
+
+/* the planar types use ebur128_add_frames_planar_* */
+static const char* bench_types[] = {"short", "int", "float", "double",
+                                    "planar_float", "planar_double"};
+
+#define BENCH_TYPES (sizeof(bench_types) / sizeof(bench_types[0]))
+
+struct bench_list {
+  unsigned long values[BENCH_MAX_LIST];
+  size_t size;
+};
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned long long bench_rng = 88172645463325252ULL;
+
+/* Noise with a slowly changing level, so that gating and LRA have something
+ * to do. */
+static double* bench_signal(size_t frames, unsigned int channels,
+                            unsigned long samplerate) {
+  double* d = (double*) malloc(frames * channels * sizeof(double));
+  size_t i;
+  unsigned int c;
+  if (!d) return NULL;
+  for (i = 0; i < frames; ++i) {
+    double t = (double) i / samplerate;
+    double level = 0.02 + 0.5 * (0.5 + 0.5 * sin(t * 0.9)) *
+                   (fmod(t, 7.0) < 5.0 ? 1.0 : 0.05);
+    for (c = 0; c < channels; ++c) {
+      bench_rng ^= bench_rng << 13;
+      bench_rng ^= bench_rng >> 7;
+      bench_rng ^= bench_rng << 17;
+      d[i * channels + c] = level *
+          ((double) (bench_rng >> 11) / 9007199254740992.0 * 2.0 - 1.0);
+    }
+  }
+  return d;
+}
+
+/* Converts the signal to the sample type of ebur128_add_frames_<type>. The
+ * planar types get a block that starts with one pointer per channel, followed
+ * by the samples of each channel in turn. */
+static void* bench_convert(const double* d, size_t frames,
+                           unsigned int channels, int type) {
+  size_t samples = frames * channels, i;
+  unsigned int c;
+  void* out;
+  switch (type) {
+    case 0:
+      out = malloc(samples * sizeof(short));
+      if (out) {
+        for (i = 0; i < samples; ++i) {
+          ((short*) out)[i] = (short) (d[i] * 32767.0);
+        }
+      }
+      return out;
+    case 1:
+      out = malloc(samples * sizeof(int));
+      if (out) {
+        for (i = 0; i < samples; ++i) {
+          ((int*) out)[i] = (int) (d[i] * 2147483647.0);
+        }
+      }
+      return out;
+    case 2:
+      out = malloc(samples * sizeof(float));
+      if (out) {
+        for (i = 0; i < samples; ++i) ((float*) out)[i] = (float) d[i];
+      }
+      return out;
+    case 3:
+      out = malloc(samples * sizeof(double));
+      if (out) memcpy(out, d, samples * sizeof(double));
+      return out;
+    case 4:
+      out = malloc(channels * sizeof(float*) + samples * sizeof(float));
+      if (out) {
+        float** planes = (float**) out;
+        for (c = 0; c < channels; ++c) {
+          planes[c] = (float*) (planes + channels) + c * frames;
+          for (i = 0; i < frames; ++i) {
+            planes[c][i] = (float) d[i * channels + c];
+          }
+        }
+      }
+      return out;
+    default:
+      out = malloc(channels * sizeof(double*) + samples * sizeof(double));
+      if (out) {
+        double** planes = (double**) out;
+        for (c = 0; c < channels; ++c) {
+          planes[c] = (double*) (planes + channels) + c * frames;
+          for (i = 0; i < frames; ++i) planes[c][i] = d[i * channels + c];
+        }
+      }
+      return out;
+  }
+}
+
+static int bench_add_planar(ebur128_state* st, int type, const void* src,
+                            size_t offset, size_t frames) {
+  const float* f[BENCH_MAX_CHANNELS];
+  const double* d[BENCH_MAX_CHANNELS];
+  unsigned int c;
+  if (st->channels > BENCH_MAX_CHANNELS) return EBUR128_ERROR_INVALID_MODE;
+  if (type == 4) {
+    for (c = 0; c < st->channels; ++c) {
+      f[c] = ((const float* const*) src)[c] + offset;
+    }
+    return ebur128_add_frames_planar_float(st, f, frames);
+  }
+  for (c = 0; c < st->channels; ++c) {
+    d[c] = ((const double* const*) src)[c] + offset;
+  }
+  return ebur128_add_frames_planar_double(st, d, frames);
+}
+
+static int bench_add(ebur128_state* st, int type, const void* src,
+                     size_t offset, size_t frames) {
+  size_t i = offset * st->channels;
+  switch (type) {
+    case 0: return ebur128_add_frames_short(st, (const short*) src + i,
+                                            frames);
+    case 1: return ebur128_add_frames_int(st, (const int*) src + i, frames);
+    case 2: return ebur128_add_frames_float(st, (const float*) src + i,
+                                            frames);
+    case 3: return ebur128_add_frames_double(st, (const double*) src + i,
+                                             frames);
+    default: return bench_add_planar(st, type, src, offset, frames);
+  }
+}
+
+/* Feeds frames of src in chunks; returns the number of calls or 0. */
+static unsigned long bench_feed(ebur128_state* st, int type, const void* src,
+                                size_t frames, size_t chunk) {
+  unsigned long calls = 0;
+  size_t pos = 0;
+  while (pos < frames) {
+    size_t n = frames - pos < chunk ? frames - pos : chunk;
+    if (bench_add(st, type, src, pos, n)) return 0;
+    pos += n;
+    ++calls;
+  }
+  return calls;
+}
+
+static int bench_add_frames(const struct bench_list* types,
+                            const struct bench_list* modes,
+                            const struct bench_list* rates,
+                            const struct bench_list* channels,
+                            const struct bench_list* chunks,
+                            double seconds) {
+  size_t ri, ci, ti, mi, ki;
+  for (ri = 0; ri < rates->size; ++ri)
+  for (ci = 0; ci < channels->size; ++ci) {
+    unsigned long rate = rates->values[ri];
+    unsigned int ch = (unsigned int) channels->values[ci];
+    size_t frames = (size_t) (seconds * rate);
+    double* signal = bench_signal(frames, ch, rate);
+    if (!signal) return 1;
+    for (ti = 0; ti < types->size; ++ti) {
+      int type = (int) types->values[ti];
+      void* src = bench_convert(signal, frames, ch, type);
+      if (!src) return 1;
+      for (mi = 0; mi < modes->size; ++mi)
+      for (ki = 0; ki < chunks->size; ++ki) {
+        const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+        /* 0 means one second */
+        size_t chunk = chunks->values[ki] ? chunks->values[ki] : rate;
+        ebur128_state* st = ebur128_init(ch, rate, mode->mode);
+        unsigned long calls, allocs;
+        double t;
+        if (!st) return 1;
+        if (bench_threads > 1 && ebur128_set_threads(st, bench_threads)) {
+          ebur128_destroy(&st);
+          return 1;
+        }
+        allocs = bench_allocs;
+        t = bench_now();
+        calls = bench_feed(st, type, src, frames, chunk);
+        t = bench_now() - t;
+        allocs = bench_allocs - allocs;
+        ebur128_destroy(&st);
+        if (!calls) return 1;
+        printf("add\t%s\t%s\t%lu\t%u\t%lu\t%.3f\t%.3f\n",
+               bench_types[type], mode->name, rate, ch,
+               (unsigned long) chunk, t * 1e9 / ((double) frames * ch),
+               (double) allocs / calls);
+        fflush(stdout);
+      }
+      free(src);
+    }
+    free(signal);
+  }
+  return 0;
+}
+
+enum bench_query {
+  BENCH_MOMENTARY,
+  BENCH_SHORTTERM,
+  BENCH_WINDOW,
+  BENCH_GLOBAL,
+  BENCH_GLOBAL_MULTIPLE,
+  BENCH_RANGE,
+  BENCH_RANGE_MULTIPLE,
+  BENCH_RELATIVE_THRESHOLD,
+  BENCH_SAMPLE_PEAK,
+  BENCH_PREV_SAMPLE_PEAK,
+  BENCH_TRUE_PEAK,
+  BENCH_PREV_TRUE_PEAK,
+  BENCH_QUERIES
+};
+
+static const char* bench_query_names[] = {
+  "loudness_momentary",
+  "loudness_shortterm",
+  "loudness_window",
+  "loudness_global",
+  "loudness_global_multiple",
+  "loudness_range",
+  "loudness_range_multiple",
+  "relative_threshold",
+  "sample_peak",
+  "prev_sample_peak",
+  "true_peak",
+  "prev_true_peak"
+};
+
+static int bench_query(ebur128_state** sts, enum bench_query query) {
+  double out;
+  switch (query) {
+    case BENCH_MOMENTARY: return ebur128_loudness_momentary(sts[0], &out);
+    case BENCH_SHORTTERM: return ebur128_loudness_shortterm(sts[0], &out);
+    case BENCH_WINDOW: return ebur128_loudness_window(sts[0], 3000, &out);
+    case BENCH_GLOBAL: return ebur128_loudness_global(sts[0], &out);
+    case BENCH_GLOBAL_MULTIPLE:
+      return ebur128_loudness_global_multiple(sts, 2, &out);
+    case BENCH_RANGE: return ebur128_loudness_range(sts[0], &out);
+    case BENCH_RANGE_MULTIPLE:
+      return ebur128_loudness_range_multiple(sts, 2, &out);
+    case BENCH_RELATIVE_THRESHOLD:
+      return ebur128_relative_threshold(sts[0], &out);
+    case BENCH_SAMPLE_PEAK: return ebur128_sample_peak(sts[0], 0, &out);
+    case BENCH_PREV_SAMPLE_PEAK:
+      return ebur128_prev_sample_peak(sts[0], 0, &out);
+    case BENCH_TRUE_PEAK: return ebur128_true_peak(sts[0], 0, &out);
+    case BENCH_PREV_TRUE_PEAK: return ebur128_prev_true_peak(sts[0], 0, &out);
+    default: return 1;
+  }
+}
+
+/* Times the queries on two stereo 48 kHz states after each session length.
+ * The two states make the *_multiple queries comparable to the single
+ * ones. */
+static int bench_queries(const struct bench_list* modes,
+                         const struct bench_list* sessions) {
+  const unsigned long rate = 48000;
+  const size_t frames = 60 * rate;
+  double* signal = bench_signal(frames, 2, rate);
+  size_t mi, si;
+  int q;
+
+  if (!signal) return 1;
+  for (mi = 0; mi < modes->size; ++mi) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    ebur128_state* sts[2];
+    unsigned long fed = 0;
+    sts[0] = ebur128_init(2, rate, mode->mode);
+    sts[1] = ebur128_init(2, rate, mode->mode);
+    if (!sts[0] || !sts[1]) return 1;
+    ebur128_set_max_window(sts[0], 3000);
+    for (si = 0; si < sessions->size; ++si) {
+      /* sessions are given in minutes and have to be increasing */
+      while (fed < sessions->values[si]) {
+        if (!bench_feed(sts[0], 3, signal, frames, rate / 10) ||
+            !bench_feed(sts[1], 3, signal, frames, rate / 10)) {
+          return 1;
+        }
+        ++fed;
+      }
+      for (q = 0; q < BENCH_QUERIES; ++q) {
+        unsigned long calls = 0, allocs = bench_allocs;
+        double t = bench_now(), elapsed;
+        int error = bench_query(sts, (enum bench_query) q);
+        if (error == EBUR128_ERROR_INVALID_MODE) continue;
+        do {
+          int i;
+          for (i = 0; i < 16; ++i) bench_query(sts, (enum bench_query) q);
+          calls += 16;
+          elapsed = bench_now() - t;
+        } while (elapsed < BENCH_QUERY_TIME);
+        allocs = bench_allocs - allocs;
+        printf("query\t%s\t%s\t%lu\t%.3f\t%.3f\n",
+               bench_query_names[q], mode->name, fed,
+               elapsed * 1e9 / (calls + 1), (double) allocs / (calls + 1));
+        fflush(stdout);
+      }
+    }
+    ebur128_destroy(&sts[1]);
+    ebur128_destroy(&sts[0]);
+  }
+  free(signal);
+  return 0;
+}
+
+/* Times ebur128_init, not including ebur128_destroy. */
+static int bench_init(const struct bench_list* modes,
+                      const struct bench_list* rates,
+                      const struct bench_list* channels) {
+  size_t mi, ri, ci;
+  for (mi = 0; mi < modes->size; ++mi)
+  for (ri = 0; ri < rates->size; ++ri)
+  for (ci = 0; ci < channels->size; ++ci) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    unsigned long rate = rates->values[ri];
+    unsigned int ch = (unsigned int) channels->values[ci];
+    unsigned long calls = 0, allocs = bench_allocs;
+    double elapsed = 0.0, t;
+    do {
+      ebur128_state* st;
+      t = bench_now();
+      st = ebur128_init(ch, rate, mode->mode);
+      elapsed += bench_now() - t;
+      if (!st) return 1;
+      ebur128_destroy(&st);
+      ++calls;
+    } while (elapsed < BENCH_QUERY_TIME);
+    /* one destroy for each init */
+    allocs = bench_allocs - allocs;
+    printf("init\t%s\t%lu\t%u\t%.3f\t%.3f\n", mode->name, rate, ch,
+           elapsed * 1e9 / calls, (double) allocs / calls);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+/* Creates and destroys streams states at once, on the heap with
+ * ebur128_init and in one block of memory with ebur128_init_arena. */
+static int bench_streams(const struct bench_list* modes,
+                         const struct bench_list* rates,
+                         const struct bench_list* channels,
+                         unsigned long streams) {
+  ebur128_state** sts = (ebur128_state**) calloc(streams, sizeof(*sts));
+  size_t mi, ri, ci;
+  int arena;
+  if (!sts) return 1;
+  for (mi = 0; mi < modes->size; ++mi)
+  for (ri = 0; ri < rates->size; ++ri)
+  for (ci = 0; ci < channels->size; ++ci)
+  for (arena = 0; arena < 2; ++arena) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    unsigned long rate = rates->values[ri];
+    unsigned int ch = (unsigned int) channels->values[ci];
+    size_t size = ebur128_arena_size(ch, rate, mode->mode), bytes = 0;
+    char* memory = arena ? (char*) malloc(streams * size) : NULL;
+    unsigned long allocs, i;
+    double t_init, t_destroy;
+    if (!size || (arena && !memory)) return 1;
+    allocs = bench_allocs;
+    t_init = bench_now();
+    for (i = 0; i < streams; ++i) {
+      sts[i] = arena ? ebur128_init_arena(memory + i * size, size, ch, rate,
+                                          mode->mode)
+                     : ebur128_init(ch, rate, mode->mode);
+      if (!sts[i]) return 1;
+    }
+    t_init = bench_now() - t_init;
+    allocs = bench_allocs - allocs;
+    for (i = 0; i < streams; ++i) bytes += ebur128_get_footprint(sts[i]);
+    t_destroy = bench_now();
+    for (i = 0; i < streams; ++i) ebur128_destroy(&sts[i]);
+    t_destroy = bench_now() - t_destroy;
+    free(memory);
+    printf("streams\t%s\t%s\t%lu\t%u\t%lu\t%.3f\t%.3f\t%.1f\t%.3f\n",
+           arena ? "arena" : "heap", mode->name, rate, ch, streams,
+           t_init * 1e9 / streams, t_destroy * 1e9 / streams,
+           (double) bytes / streams, (double) allocs / streams);
+    fflush(stdout);
+  }
+  free(sts);
+  return 0;
+}
+
+/* Feeds hours of audio to one stereo 48 kHz state per mode and reports,
+ * after every hour, the memory it holds per hour of history, its integrated
+ * loudness and loudness range and how long those two queries take. */
+static int bench_history(const struct bench_list* modes,
+                         unsigned long hours) {
+  const unsigned long rate = 48000;
+  const size_t frames = 60 * rate;
+  double* signal = bench_signal(frames, 2, rate);
+  void* src = signal ? bench_convert(signal, frames, 2, 2) : NULL;
+  size_t mi;
+  unsigned long h, m, calls;
+
+  if (!src) return 1;
+  for (mi = 0; mi < modes->size; ++mi) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    ebur128_state* st = ebur128_init(2, rate, mode->mode);
+    if (!st) return 1;
+    for (h = 1; h <= hours; ++h) {
+      double integrated = 0.0, range = 0.0, t_global, t_range;
+      for (m = 0; m < 60; ++m) {
+        if (!bench_feed(st, 2, src, frames, rate / 10)) return 1;
+      }
+      calls = 0;
+      t_global = bench_now();
+      do {
+        ebur128_loudness_global(st, &integrated);
+        ++calls;
+      } while (bench_now() - t_global < BENCH_QUERY_TIME);
+      t_global = (bench_now() - t_global) / calls;
+      calls = 0;
+      t_range = bench_now();
+      do {
+        ebur128_loudness_range(st, &range);
+        ++calls;
+      } while (bench_now() - t_range < BENCH_QUERY_TIME);
+      t_range = (bench_now() - t_range) / calls;
+      printf("history\t%s\t%lu\t%.0f\t%.6f\t%.6f\t%.3f\t%.3f\n",
+             mode->name, h, (double) ebur128_get_footprint(st) / h,
+             integrated, range, t_global * 1e9, t_range * 1e9);
+      fflush(stdout);
+    }
+    ebur128_destroy(&st);
+  }
+  free(src);
+  free(signal);
+  return 0;
+}
+
+/* Energy of a gating block as the state of st stores it. */
+static double bench_stored_energy(ebur128_state* st, double z) {
+  if (st->d->use_histogram) {
+    return st->d->histogram_energies[find_histogram_index(st, z)];
+  }
+  switch (st->d->block_list.encoding) {
+    case EBUR128_BLOCKS_FLOAT: return (float) z;
+    case EBUR128_BLOCKS_LOG16:
+      return ebur128_log16_energy(ebur128_log16_code(z));
+    default: return z;
+  }
+}
+
+/* Feeds three windows of audio to a stereo 48 kHz state per mode with a
+ * history of one window, and after every second compares
+ * ebur128_loudness_global with a brute-force gating of the last window of
+ * block energies. The audio is fed in 100 ms chunks, so every chunk
+ * completes one gating block, which is read from the state right away.
+ * Reports the time to add a second of audio, the time of the query and the
+ * largest difference in LU. */
+static int bench_window(const struct bench_list* modes,
+                        unsigned long minutes) {
+  const unsigned long rate = 48000;
+  const size_t frames = 60 * rate;
+  const size_t window = minutes * 600;
+  double* signal = bench_signal(frames, 2, rate);
+  void* src = signal ? bench_convert(signal, frames, 2, 2) : NULL;
+  double* blocks = (double*) malloc(3 * window * sizeof(double));
+  size_t mi, chunk, count, i;
+  int error = 1;
+
+  if (!src || !blocks) goto exit;
+  for (mi = 0; mi < modes->size; ++mi) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    ebur128_state* st = ebur128_init(2, rate, mode->mode);
+    double t_add = 0.0, t_global = 0.0, max_error = 0.0, t;
+    unsigned long queries = 0;
+    if (!st) goto exit;
+    if ((mode->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
+      ebur128_destroy(&st);
+      continue;
+    }
+    ebur128_set_max_history(st, minutes * 60000);
+    count = 0;
+    for (chunk = 0; chunk < 3 * window; ++chunk) {
+      double z = 0.0, loudness, reference;
+      t = bench_now();
+      if (bench_add(st, 2, src, chunk % 600 * (rate / 10), rate / 10)) {
+        goto exit;
+      }
+      t_add += bench_now() - t;
+      if (chunk >= 3) {
+        ebur128_energy_in_interval(st, 4, &z);
+        if (z >= absolute_gate_energy) {
+          blocks[count++] = bench_stored_energy(st, z);
+        }
+      }
+      if (chunk % 10 != 9) continue;
+      t = bench_now();
+      ebur128_loudness_global(st, &loudness);
+      t_global += bench_now() - t;
+      ++queries;
+      {
+        /* the last window of blocks above the absolute gate */
+        size_t first = count > window ? count - window : 0, above = 0;
+        double sum = 0.0, threshold;
+        for (i = first; i < count; ++i) sum += blocks[i];
+        threshold = sum / (count - first) * relative_gate_factor;
+        sum = 0.0;
+        for (i = first; i < count; ++i) {
+          if (blocks[i] >= threshold) {
+            sum += blocks[i];
+            ++above;
+          }
+        }
+        reference = ebur128_energy_to_loudness(sum / above);
+      }
+      if (fabs(loudness - reference) > max_error) {
+        max_error = fabs(loudness - reference);
+      }
+    }
+    printf("window\t%s\t%lu\t%.3f\t%.3f\t%.3g\n", mode->name, minutes,
+           t_add * 1e9 / queries, t_global * 1e9 / queries, max_error);
+    fflush(stdout);
+    ebur128_destroy(&st);
+    if (max_error > 1e-6) goto exit;
+  }
+  error = 0;
+
+exit:
+  free(blocks);
+  free(src);
+  free(signal);
+  return error;
+}
+
+/* Largest difference between the results of a and b, in LU or linear peak.
+ * Results that a does not support are skipped. */
+static double bench_difference(ebur128_state* a, ebur128_state* b) {
+  double x[6], y[6], d = 0.0;
+  int i, errors[6];
+  errors[0] = ebur128_loudness_momentary(a, &x[0]);
+  errors[1] = ebur128_loudness_shortterm(a, &x[1]);
+  errors[2] = ebur128_loudness_global(a, &x[2]);
+  errors[3] = ebur128_loudness_range(a, &x[3]);
+  errors[4] = ebur128_sample_peak(a, 0, &x[4]);
+  errors[5] = ebur128_true_peak(a, 0, &x[5]);
+  ebur128_loudness_momentary(b, &y[0]);
+  ebur128_loudness_shortterm(b, &y[1]);
+  ebur128_loudness_global(b, &y[2]);
+  ebur128_loudness_range(b, &y[3]);
+  ebur128_sample_peak(b, 0, &y[4]);
+  ebur128_true_peak(b, 0, &y[5]);
+  for (i = 0; i < 6; ++i) {
+    if (!errors[i] && x[i] != y[i] && fabs(x[i] - y[i]) > d) {
+      d = fabs(x[i] - y[i]);
+    }
+  }
+  return d;
+}
+
+static int bench_checkpoint(const struct bench_list* modes,
+                            unsigned long minutes) {
+  const unsigned long rate = 48000;
+  const size_t frames = 60 * rate;
+  const size_t chunks = minutes * 600;
+  double* signal = bench_signal(frames, 2, rate);
+  void* src = signal ? bench_convert(signal, frames, 2, 2) : NULL;
+  size_t mi, chunk;
+  int error = 1;
+
+  if (!src) goto exit;
+  for (mi = 0; mi < modes->size; ++mi) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    ebur128_state* a = ebur128_init(2, rate, mode->mode);
+    ebur128_state* b = ebur128_init(2, rate, mode->mode);
+    ebur128_state* c = ebur128_init(2, rate, mode->mode);
+    ebur128_state* restored = NULL;
+    ebur128_state* parts[2];
+    void* buffer = NULL;
+    size_t size = 0;
+    double t_serialize = 0.0, t_deserialize = 0.0, t;
+    double restore_error = 0.0, merge_error = 0.0, x[2], y[2];
+    int i, errors[2], failed = !a || !b || !c;
+
+    for (chunk = 0; chunk < chunks && !failed; ++chunk) {
+      size_t offset = chunk % 600 * (rate / 10);
+      if (chunk == chunks / 2) {
+        t = bench_now();
+        size = ebur128_serialize(a, NULL, 0);
+        buffer = malloc(size);
+        if (buffer) ebur128_serialize(a, buffer, size);
+        t_serialize = bench_now() - t;
+        t = bench_now();
+        if (buffer) restored = ebur128_deserialize(buffer, size);
+        t_deserialize = bench_now() - t;
+        if (!restored) failed = 1;
+      }
+      if (bench_add(a, 2, src, offset, rate / 10) ||
+          (restored && bench_add(restored, 2, src, offset, rate / 10)) ||
+          bench_add(chunk < chunks / 2 ? b : c, 2, src, offset, rate / 10)) {
+        failed = 1;
+      }
+    }
+    if (!failed) {
+      restore_error = bench_difference(a, restored);
+      /* merging must give the same as combining the live states */
+      parts[0] = b;
+      parts[1] = c;
+      errors[0] = ebur128_loudness_global_multiple(parts, 2, &x[0]);
+      errors[1] = ebur128_loudness_range_multiple(parts, 2, &x[1]);
+      if (ebur128_merge(b, c)) failed = 1;
+      ebur128_loudness_global(b, &y[0]);
+      ebur128_loudness_range(b, &y[1]);
+      for (i = 0; i < 2; ++i) {
+        if (!errors[i] && x[i] != y[i] && fabs(x[i] - y[i]) > merge_error) {
+          merge_error = fabs(x[i] - y[i]);
+        }
+      }
+      printf("checkpoint\t%s\t%lu\t%lu\t%.3f\t%.3f\t%.3g\t%.3g\n",
+             mode->name, minutes, (unsigned long) size, t_serialize * 1e9,
+             t_deserialize * 1e9, restore_error, merge_error);
+      fflush(stdout);
+      if (restore_error > 1e-9 || merge_error > 1e-9) failed = 1;
+    }
+    free(buffer);
+    if (restored) ebur128_destroy(&restored);
+    if (a) ebur128_destroy(&a);
+    if (b) ebur128_destroy(&b);
+    if (c) ebur128_destroy(&c);
+    if (failed) goto exit;
+  }
+  error = 0;
+
+exit:
+  free(src);
+  free(signal);
+  return error;
+}
+
+/* Runs init, a second of audio, set_max_window, another second,
+ * set_max_history, a third second and destroy, and stops at the first
+ * error. Returns 1 if any call reported a failed allocation. */
+static int bench_fault_run(int mode, const void* src, unsigned long rate) {
+  ebur128_state* st = ebur128_init(2, rate, mode);
+  double loudness;
+  int error = 0, step;
+
+  if (!st) return 1;
+  for (step = 0; step < 5 && !error; ++step) {
+    switch (step) {
+      case 1: error = ebur128_set_max_window(st, 6000); break;
+      case 3: error = ebur128_set_max_history(st, 20000); break;
+      default: error = bench_add(st, 2, src, 0, rate);
+    }
+    if (error == EBUR128_ERROR_NO_CHANGE) error = 0;
+  }
+  if (!error && (mode & EBUR128_MODE_I) == EBUR128_MODE_I) {
+    error = ebur128_loudness_global(st, &loudness);
+  }
+  ebur128_destroy(&st);
+  return error == EBUR128_ERROR_NOMEM;
+}
+
+/* Makes every allocation of bench_fault_run fail in turn and checks that
+ * the failure is reported, that nothing else fails and that nothing
+ * leaks. */
+static int bench_faults(const struct bench_list* modes) {
+  const unsigned long rate = 48000;
+  double* signal = bench_signal(rate, 2, rate);
+  void* src = signal ? bench_convert(signal, rate, 2, 2) : NULL;
+  size_t mi;
+  int error = 1;
+
+  if (!src) goto exit;
+  for (mi = 0; mi < modes->size; ++mi) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    unsigned long n, points = 0, errors = 0;
+    for (n = 1;; ++n) {
+      long live = bench_live;
+      int reported, failed;
+      bench_fail_at = bench_allocs + n;
+      reported = bench_fault_run(mode->mode, src, rate);
+      failed = bench_allocs >= bench_fail_at;
+      bench_fail_at = 0;
+      if (reported != failed) ++errors;
+      if (bench_live != live) ++errors;
+      if (!failed) break;
+      ++points;
+    }
+    printf("faults\t%s\t%lu\t%lu\n", mode->name, points, errors);
+    fflush(stdout);
+    if (errors) goto exit;
+  }
+  error = 0;
+
+exit:
+  free(src);
+  free(signal);
+  return error;
+}
+
+/* Results compared by the stress test, as error code and value pairs. */
+struct bench_results {
+  int errors[6];
+  double values[6];
+};
+
+static void bench_get_results(ebur128_state* st, struct bench_results* r) {
+  memset(r, 0, sizeof(*r));
+  r->errors[0] = ebur128_loudness_momentary(st, &r->values[0]);
+  r->errors[1] = ebur128_loudness_shortterm(st, &r->values[1]);
+  r->errors[2] = ebur128_loudness_global(st, &r->values[2]);
+  r->errors[3] = ebur128_loudness_range(st, &r->values[3]);
+  r->errors[4] = ebur128_sample_peak(st, 0, &r->values[4]);
+  r->errors[5] = ebur128_true_peak(st, 0, &r->values[5]);
+}
+
+static int bench_results(ebur128_state* st, int type, const void* src,
+                         size_t frames, struct bench_results* r) {
+  if (!bench_feed(st, type, src, frames, 4800)) return 1;
+  bench_get_results(st, r);
+  return 0;
+}
+
+/* Returns 1 if any result of a and b differs in any bit, including the peaks
+ * of every channel. */
+static int bench_differ(ebur128_state* a, ebur128_state* b) {
+  struct bench_results x, y;
+  double p[2];
+  unsigned int c;
+  int error;
+  bench_get_results(a, &x);
+  bench_get_results(b, &y);
+  if (memcmp(&x, &y, sizeof(x))) return 1;
+  for (c = 1; c < a->channels; ++c) {
+    error = ebur128_sample_peak(a, c, &p[0]);
+    ebur128_sample_peak(b, c, &p[1]);
+    if (!error && memcmp(&p[0], &p[1], sizeof(p[0]))) return 1;
+    error = ebur128_true_peak(a, c, &p[0]);
+    ebur128_true_peak(b, c, &p[1]);
+    if (!error && memcmp(&p[0], &p[1], sizeof(p[0]))) return 1;
+  }
+  return 0;
+}
+
+struct bench_stress {
+  const struct bench_list* modes;
+  const void* src;
+  size_t frames;
+  /* results of each mode on a single thread */
+  struct bench_results expected[BENCH_MAX_LIST];
+  unsigned long mismatches;
+  pthread_t thread;
+};
+
+static void* bench_stress_thread(void* arg) {
+  struct bench_stress* s = (struct bench_stress*) arg;
+  unsigned long i, mismatches = 0;
+  for (i = 0; i < BENCH_STRESS_STATES; ++i) {
+    size_t m = i % s->modes->size;
+    ebur128_state* st = ebur128_init(2, 48000,
+                                     bench_modes[s->modes->values[m]].mode);
+    struct bench_results r;
+    if (!st || bench_results(st, 2, s->src, s->frames, &r) ||
+        memcmp(&r, &s->expected[m], sizeof(r))) {
+      ++mismatches;
+    }
+    if (st) ebur128_destroy(&st);
+  }
+  s->mismatches = mismatches;
+  return NULL;
+}
+
+/* Creates, feeds and destroys BENCH_STRESS_STATES states on each of threads
+ * threads at once, cycling through the modes, and checks that every state
+ * gives the same results as on a single thread. Build with
+ * -fsanitize=thread to check for data races. */
+static int bench_stress(const struct bench_list* modes, unsigned long threads) {
+  const unsigned long rate = 48000;
+  const size_t frames = (size_t) (BENCH_STRESS_SECONDS * rate);
+  double* signal = bench_signal(frames, 2, rate);
+  void* src = signal ? bench_convert(signal, frames, 2, 2) : NULL;
+  struct bench_stress* s = NULL;
+  unsigned long i, mismatches = 0;
+  size_t m;
+  double t;
+  int error = 1;
+
+  if (!src) goto exit;
+  s = (struct bench_stress*) calloc(threads, sizeof(*s));
+  if (!s) goto exit;
+  for (m = 0; m < modes->size; ++m) {
+    ebur128_state* st = ebur128_init(2, rate,
+                                     bench_modes[modes->values[m]].mode);
+    if (!st) goto exit;
+    error = bench_results(st, 2, src, frames, &s[0].expected[m]);
+    ebur128_destroy(&st);
+    if (error) goto exit;
+  }
+  t = bench_now();
+  for (i = 0; i < threads; ++i) {
+    s[i].modes = modes;
+    s[i].src = src;
+    s[i].frames = frames;
+    memcpy(s[i].expected, s[0].expected, sizeof(s[0].expected));
+    if (pthread_create(&s[i].thread, NULL, bench_stress_thread, &s[i])) {
+      threads = i;
+      error = 1;
+      break;
+    }
+  }
+  for (i = 0; i < threads; ++i) {
+    pthread_join(s[i].thread, NULL);
+    mismatches += s[i].mismatches;
+  }
+  t = bench_now() - t;
+  if (!error) {
+    printf("stress\t%lu\t%lu\t%.3f\t%lu\n", threads,
+           threads * BENCH_STRESS_STATES,
+           t * 1e9 / (threads * BENCH_STRESS_STATES), mismatches);
+    error = mismatches != 0;
+  }
+
+exit:
+  free(s);
+  free(src);
+  free(signal);
+  return error;
+}
+
+/* Feeds the same audio to one state interleaved and to another one planar,
+ * per mode, channel count and sample type, in chunks that do not line up with
+ * the blocks, and checks that all results are identical. */
+static int bench_planar(const struct bench_list* modes,
+                        const struct bench_list* channels) {
+  const unsigned long rate = 48000;
+  const size_t frames = (size_t) (BENCH_PLANAR_SECONDS * rate);
+  size_t ci, mi;
+  int type, error = 0;
+
+  for (ci = 0; ci < channels->size && !error; ++ci) {
+    unsigned int ch = (unsigned int) channels->values[ci];
+    double* signal = bench_signal(frames, ch, rate);
+    if (!signal) return 1;
+    for (type = 2; type < 4 && !error; ++type) {
+      void* src = bench_convert(signal, frames, ch, type);
+      void* planes = bench_convert(signal, frames, ch, type + 2);
+      for (mi = 0; mi < modes->size && src && planes; ++mi) {
+        const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+        ebur128_state* a = ebur128_init(ch, rate, mode->mode);
+        ebur128_state* b = ebur128_init(ch, rate, mode->mode);
+        int mismatch = 1;
+        if (a && b && bench_feed(a, type, src, frames, 1000) &&
+            bench_feed(b, type + 2, planes, frames, 1000)) {
+          mismatch = bench_differ(a, b);
+        }
+        printf("planar\t%s\t%s\t%u\t%d\n", bench_types[type + 2],
+               mode->name, ch, mismatch);
+        fflush(stdout);
+        if (a) ebur128_destroy(&a);
+        if (b) ebur128_destroy(&b);
+        if (mismatch) error = 1;
+      }
+      if (!src || !planes) error = 1;
+      free(planes);
+      free(src);
+    }
+    free(signal);
+  }
+  return error;
+}
+
+/* Counts every channel after the first six in the loudness, which ignores
+ * them by default, so that every group of the pool contributes to it. */
+static void bench_count_channels(ebur128_state* st) {
+  unsigned int c;
+  for (c = 6; c < st->channels; ++c) ebur128_set_channel(st, c, EBUR128_Mp000);
+}
+
+/* Feeds the same audio to one state per mode and channel count on a single
+ * thread and to others with worker pools of several threads, in chunks that
+ * are large enough for the pool, and checks that all results are identical. */
+static int bench_pool(const struct bench_list* modes,
+                      const struct bench_list* channels) {
+  const unsigned long rate = 48000;
+  const size_t frames = (size_t) (BENCH_PLANAR_SECONDS * rate);
+  const size_t chunk = EBUR128_POOL_MIN_SAMPLES + 1000;
+  size_t ci, mi, ti;
+  int error = 0;
+
+  for (ci = 0; ci < channels->size && !error; ++ci) {
+    unsigned int ch = (unsigned int) channels->values[ci];
+    double* signal = bench_signal(frames, ch, rate);
+    void* src = signal ? bench_convert(signal, frames, ch, 2) : NULL;
+    if (!src) error = 1;
+    for (mi = 0; mi < modes->size && !error; ++mi) {
+      const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+      ebur128_state* single = ebur128_init(ch, rate, mode->mode);
+      if (single) bench_count_channels(single);
+      if (!single || !bench_feed(single, 2, src, frames, chunk)) error = 1;
+      for (ti = 0; ti < sizeof(bench_pool_threads) /
+                        sizeof(bench_pool_threads[0]) && !error; ++ti) {
+        unsigned int threads = bench_pool_threads[ti];
+        ebur128_state* st = ebur128_init(ch, rate, mode->mode);
+        int mismatch = 1;
+        if (st) bench_count_channels(st);
+        if (st && !ebur128_set_threads(st, threads) &&
+            bench_feed(st, 2, src, frames, chunk)) {
+          mismatch = bench_differ(single, st);
+        }
+        printf("pool\t%s\t%u\t%u\t%d\n", mode->name, ch, threads,
+               mismatch);
+        fflush(stdout);
+        if (st) ebur128_destroy(&st);
+        if (mismatch) error = 1;
+      }
+      if (single) ebur128_destroy(&single);
+    }
+    free(src);
+    free(signal);
+  }
+  return error;
+}
+
+/* Stream of the worker check. The format changes six times, the fourth time
+ * only the channel mask, and no part is a whole number of blocks. map is the
+ * ebur128 channel that r128worker has to use for each channel of the mask. */
+static const struct bench_format {
+  unsigned int samplerate;
+  unsigned int channels;
+  unsigned int channel_mask;
+  double seconds;
+  int map[R128WORKER_MAX_CHANNELS];
+} bench_formats[] = {
+  {48000, 2, 0x3,   2.03, {EBUR128_LEFT, EBUR128_RIGHT}},
+  {44100, 2, 0x3,   1.52, {EBUR128_LEFT, EBUR128_RIGHT}},
+  {48000, 6, 0x3F,  2.05, {EBUR128_LEFT, EBUR128_RIGHT, EBUR128_CENTER,
+                           EBUR128_UNUSED, EBUR128_LEFT_SURROUND,
+                           EBUR128_RIGHT_SURROUND}},
+  {48000, 6, 0x60F, 1.08, {EBUR128_LEFT, EBUR128_RIGHT, EBUR128_CENTER,
+                           EBUR128_UNUSED, EBUR128_UNUSED, EBUR128_UNUSED}},
+  {96000, 1, 0x4,   1.01, {EBUR128_CENTER}},
+  {44100, 8, 0x63F, 2.04, {EBUR128_LEFT, EBUR128_RIGHT, EBUR128_CENTER,
+                           EBUR128_UNUSED, EBUR128_LEFT_SURROUND,
+                           EBUR128_RIGHT_SURROUND, EBUR128_UNUSED,
+                           EBUR128_UNUSED}},
+  {48000, 2, 0x3,   2.02, {EBUR128_LEFT, EBUR128_RIGHT}}
+};
+
+#define BENCH_FORMATS (sizeof(bench_formats) / sizeof(bench_formats[0]))
+
+/* What the caller of r128worker_push does with the frames it did not queue:
+ * nothing, as the ring holds the whole stream, push them again until they
+ * are queued, or give up on them. */
+enum { BENCH_FIT, BENCH_RETRY, BENCH_DROP, BENCH_CALLERS };
+
+static const char* bench_callers[] = {"fit", "retry", "drop"};
+
+/* Brings the reference state to a format as r128worker_set_format should. */
+static int bench_worker_format(ebur128_state** ref,
+                               const struct bench_format** current,
+                               const struct bench_format* format, int mode) {
+  unsigned int c;
+  int error;
+  if (*current && (*current)->samplerate == format->samplerate &&
+      (*current)->channels == format->channels &&
+      (*current)->channel_mask == format->channel_mask) {
+    return 0;
+  }
+  if (!*ref) {
+    *ref = ebur128_init(format->channels, format->samplerate, mode);
+    if (!*ref) return 1;
+  } else {
+    error = ebur128_change_parameters(*ref, format->channels,
+                                      format->samplerate);
+    if (error && error != EBUR128_ERROR_NO_CHANGE) return 1;
+  }
+  for (c = 0; c < format->channels; ++c) {
+    ebur128_set_channel(*ref, c, format->map[c]);
+  }
+  *current = format;
+  return 0;
+}
+
+/* Pushes frames, again and again until they are all queued if retry is
+ * set. Returns the number of frames queued. */
+static size_t bench_worker_push(r128worker* worker, const float* src,
+                                size_t frames,
+                                const struct bench_format* format,
+                                int retry) {
+  size_t queued = r128worker_push(worker, src, frames, format->samplerate,
+                                  format->channels, format->channel_mask);
+  while (retry && queued < frames) {
+    sched_yield();
+    queued += r128worker_push(worker, src + queued * format->channels,
+                              frames - queued, format->samplerate,
+                              format->channels, format->channel_mask);
+  }
+  return queued;
+}
+
+/* Waits until the worker analysed everything that was pushed. */
+static void bench_worker_wait(r128worker* worker) {
+  while (R128WORKER_LOAD(&worker->tail) != worker->head) sched_yield();
+}
+
+/* Largest difference between a snapshot and the results of the reference
+ * state, HUGE_VAL if they do not have the same results or the snapshot not
+ * the expected number of blocks. */
+static double bench_worker_error(const r128worker_snapshot* snapshot,
+                                 ebur128_state* ref, double duration,
+                                 unsigned long blocks) {
+  unsigned int valid = R128WORKER_HAS_SAMPLE_PEAK | R128WORKER_HAS_TRUE_PEAK;
+  unsigned int channels = ref->channels < R128WORKER_MAX_CHANNELS ?
+                          ref->channels : R128WORKER_MAX_CHANNELS;
+  double x[4 + 2 * R128WORKER_MAX_CHANNELS], y[4 + 2 * R128WORKER_MAX_CHANNELS];
+  double d = fabs(snapshot->duration - duration);
+  unsigned int c, i, n = 0;
+
+  if (!ebur128_loudness_momentary(ref, &x[n])) {
+    valid |= R128WORKER_HAS_MOMENTARY;
+    y[n++] = snapshot->momentary;
+  }
+  if (!ebur128_loudness_shortterm(ref, &x[n])) {
+    valid |= R128WORKER_HAS_SHORTTERM;
+    y[n++] = snapshot->shortterm;
+  }
+  if (!ebur128_loudness_global(ref, &x[n])) {
+    valid |= R128WORKER_HAS_INTEGRATED;
+    y[n++] = snapshot->integrated;
+  }
+  if (!ebur128_loudness_range(ref, &x[n])) {
+    valid |= R128WORKER_HAS_RANGE;
+    y[n++] = snapshot->range;
+  }
+  for (c = 0; c < channels; ++c) {
+    if (ebur128_sample_peak(ref, c, &x[n])) {
+      valid &= ~(unsigned int) R128WORKER_HAS_SAMPLE_PEAK;
+    } else {
+      y[n++] = snapshot->sample_peak[c];
+    }
+    if (ebur128_true_peak(ref, c, &x[n])) {
+      valid &= ~(unsigned int) R128WORKER_HAS_TRUE_PEAK;
+    } else {
+      y[n++] = snapshot->true_peak[c];
+    }
+  }
+  if (snapshot->valid != valid || snapshot->channels != channels ||
+      snapshot->block != blocks) {
+    return HUGE_VAL;
+  }
+  for (i = 0; i < n; ++i) {
+    if (x[i] != y[i] && fabs(x[i] - y[i]) > d) d = fabs(x[i] - y[i]);
+  }
+  return d;
+}
+
+/* Pushes the stream of bench_formats through a worker in half-second chunks
+ * and feeds the frames it queued to a reference state, then compares the
+ * last snapshot of the worker with the results of the reference. The ring
+ * holds the whole stream for BENCH_FIT and is as small as possible
+ * otherwise, so that the worker overruns. A new sample rate or channel
+ * count starts the blocks of the snapshots anew, a new channel mask does
+ * not. */
+static int bench_worker(const struct bench_list* modes) {
+  float* src[BENCH_FORMATS];
+  size_t frames[BENCH_FORMATS], bytes = 0, f, mi;
+  int caller, error = 1;
+
+  memset(src, 0, sizeof(src));
+  for (f = 0; f < BENCH_FORMATS; ++f) {
+    const struct bench_format* format = &bench_formats[f];
+    double* signal;
+    frames[f] = (size_t) (format->seconds * format->samplerate);
+    signal = bench_signal(frames[f], format->channels, format->samplerate);
+    if (signal) {
+      src[f] = (float*) bench_convert(signal, frames[f], format->channels, 2);
+    }
+    free(signal);
+    if (!src[f]) goto exit;
+    bytes += frames[f] * format->channels * sizeof(float);
+  }
+  for (mi = 0; mi < modes->size; ++mi)
+  for (caller = 0; caller < BENCH_CALLERS; ++caller) {
+    const struct bench_mode* mode = &bench_modes[modes->values[mi]];
+    r128worker* worker = r128worker_create(mode->mode,
+                                           caller == BENCH_FIT ? 2 * bytes : 0);
+    ebur128_state* ref = NULL;
+    const struct bench_format* current = NULL;
+    r128worker_snapshot snapshot;
+    unsigned long dropped, blocks = 0;
+    double duration = 0.0, max_error = HUGE_VAL;
+    size_t pos, n, queued, run = 0;
+    int failed = !worker;
+
+    for (f = 0; f < BENCH_FORMATS && !failed; ++f) {
+      const struct bench_format* format = &bench_formats[f];
+      for (pos = 0; pos < frames[f] && !failed; pos += n) {
+        const float* p = src[f] + pos * format->channels;
+        n = frames[f] - pos;
+        if (n > format->samplerate / 2) n = format->samplerate / 2;
+        queued = bench_worker_push(worker, p, n, format,
+                                   caller == BENCH_RETRY);
+        if (!queued) continue;
+        if (current && (current->samplerate != format->samplerate ||
+                        current->channels != format->channels)) {
+          blocks += (unsigned long) (run / ((current->samplerate + 5) / 10));
+          run = 0;
+        }
+        run += queued;
+        if (bench_worker_format(&ref, &current, format, mode->mode) ||
+            ebur128_add_frames_float(ref, p, queued)) {
+          failed = 1;
+        }
+        duration += (double) queued / format->samplerate;
+      }
+    }
+    if (!failed) {
+      /* snapshots only cover whole blocks, so complete the last one */
+      size_t block = (current->samplerate + 5) / 10;
+      float* silence;
+      bench_worker_wait(worker);
+      n = worker->block_left < block ? worker->block_left : 0;
+      silence = (float*) calloc(n * current->channels + 1, sizeof(float));
+      if (!silence || bench_worker_push(worker, silence, n, current, 1) != n ||
+          ebur128_add_frames_float(ref, silence, n)) {
+        failed = 1;
+      }
+      free(silence);
+      duration += (double) n / current->samplerate;
+      blocks += (unsigned long) ((run + n) / block);
+    }
+    if (!failed) {
+      bench_worker_wait(worker);
+      r128worker_get_snapshot(worker, &snapshot);
+      max_error = bench_worker_error(&snapshot, ref, duration, blocks);
+      dropped = r128worker_dropped_frames(worker);
+      printf("worker\t%s\t%s\t%lu\t%.3g\n", mode->name,
+             bench_callers[caller], dropped, max_error);
+      fflush(stdout);
+      if (caller == BENCH_FIT && dropped) failed = 1;
+    }
+    if (ref) ebur128_destroy(&ref);
+    if (worker) r128worker_destroy(&worker);
+    if (failed || max_error > 1e-9) goto exit;
+  }
+  error = 0;
+
+exit:
+  for (f = 0; f < BENCH_FORMATS; ++f) free(src[f]);
+  return error;
+}
+
+static int bench_parse_list(const char* arg, struct bench_list* list) {
+  char* end;
+  list->size = 0;
+  for (;;) {
+    if (list->size == BENCH_MAX_LIST) return 1;
+    list->values[list->size++] = strtoul(arg, &end, 10);
+    if (end == arg) return 1;
+    if (*end == '\0') return 0;
+    if (*end != ',') return 1;
+    arg = end + 1;
+  }
+}
+
+static int bench_parse_names(const char* arg, const char* const* names,
+                             size_t stride, size_t count,
+                             struct bench_list* list) {
+  list->size = 0;
+  while (*arg) {
+    size_t n = strcspn(arg, ","), i;
+    for (i = 0; i < count; ++i) {
+      const char* name = *(const char* const*) ((const char*) names +
+                                                i * stride);
+      if (strlen(name) == n && !strncmp(arg, name, n)) break;
+    }
+    if (i == count || list->size == BENCH_MAX_LIST) return 1;
+    list->values[list->size++] = i;
+    arg += n;
+    if (*arg == ',') ++arg;
+  }
+  return list->size == 0;
+}
+
+static void bench_usage(void) {
+  fprintf(stderr,
+    "usage: r128bench [options]\n"
+    "  -t types      short,int,float,double,planar_float,planar_double\n"
+    "  -m modes      M,S,I,LRA,I+LRA,I+LRA+H,I+LRA+F,I+LRA+L16,SAMPLE_PEAK,\n"
+    "                TRUE_PEAK,ALL,ALL+H\n"
+    "  -r rates      44100,48000,96000,192000\n"
+    "  -c channels   1,2,6,8,24\n"
+    "  -k chunks     frames per call, 0 is one second (64,1024,0)\n"
+    "  -d seconds    audio per add measurement (2)\n"
+    "  -X            filter all channels with the scalar code, not SIMD\n"
+    "  -j threads    filter the add measurements on this many threads (1)\n"
+    "  -s sessions   session lengths in minutes for queries (1,10,60)\n"
+    "  -A / -Q / -I  only add measurements / only queries / only init\n"
+    "  -S threads    only the stress test on this many threads\n"
+    "  -N streams    only init and destroy of this many states at once\n"
+    "  -H hours      only feed this many hours to each mode and query it\n"
+    "  -W minutes    only check a sliding window of this many minutes\n"
+    "  -C minutes    only check checkpoints and merges of this many minutes\n"
+    "  -F            only check that failed allocations are handled\n"
+    "  -P            only check that planar input gives the same results\n"
+    "  -T            only check that more threads give the same results\n"
+    "  -R            only check the results of r128worker against ebur128\n"
+    "output, tab separated:\n"
+    "  add    type mode rate channels chunk ns/sample allocs/call\n"
+    "  query  function mode minutes ns/call allocs/call\n"
+    "  init   mode rate channels ns/call allocs/call\n"
+    "  streams heap|arena mode rate channels streams ns/init ns/destroy\n"
+    "          bytes/stream allocs/stream\n"
+    "  history mode hours bytes/hour integrated range ns/global ns/range\n"
+    "  window mode minutes ns/second ns/global max_error\n"
+    "  checkpoint mode minutes bytes ns/serialize ns/deserialize\n"
+    "             restore_error merge_error\n"
+    "  faults mode allocations errors\n"
+    "  planar type mode channels mismatch\n"
+    "  pool mode channels threads mismatch\n"
+    "  worker mode fit|retry|drop dropped max_error\n"
+    "  stress threads states ns/state mismatches\n");
+}
+
+int main(int argc, char** argv) {
+  struct bench_list types = {{0, 1, 2, 3, 4, 5}, 6};
+  struct bench_list modes = {{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}, 12};
+  struct bench_list rates = {{44100, 48000, 96000, 192000}, 4};
+  struct bench_list channels = {{1, 2, 6, 8, 24}, 5};
+  struct bench_list chunks = {{64, 1024, 0}, 3};
+  struct bench_list sessions = {{1, 10, 60}, 3};
+  double seconds = 2.0;
+  unsigned long stress = 0, streams = 0, hours = 0, minutes = 0;
+  unsigned long checkpoint = 0;
+  int add = 1, queries = 1, init = 1, faults = 0, planar = 0, pool = 0;
+  int worker = 0;
+  int i, error = 0;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(argv[i], "-A")) {
+      queries = init = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-Q")) {
+      add = init = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-I")) {
+      add = queries = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-X")) {
+      bench_simd = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-F")) {
+      faults = 1;
+      add = queries = init = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-P")) {
+      planar = 1;
+      add = queries = init = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-T")) {
+      pool = 1;
+      add = queries = init = 0;
+      continue;
+    } else if (!strcmp(argv[i], "-R")) {
+      worker = 1;
+      add = queries = init = 0;
+      continue;
+    }
+    if (!arg) {
+      error = 1;
+    } else if (!strcmp(argv[i], "-t")) {
+      error = bench_parse_names(arg, bench_types, sizeof(bench_types[0]),
+                                BENCH_TYPES, &types);
+    } else if (!strcmp(argv[i], "-m")) {
+      error = bench_parse_names(arg, &bench_modes[0].name,
+                                sizeof(bench_modes[0]), BENCH_MODES, &modes);
+    } else if (!strcmp(argv[i], "-r")) {
+      error = bench_parse_list(arg, &rates);
+    } else if (!strcmp(argv[i], "-c")) {
+      error = bench_parse_list(arg, &channels);
+    } else if (!strcmp(argv[i], "-k")) {
+      error = bench_parse_list(arg, &chunks);
+    } else if (!strcmp(argv[i], "-s")) {
+      error = bench_parse_list(arg, &sessions);
+    } else if (!strcmp(argv[i], "-d")) {
+      seconds = atof(arg);
+      error = seconds <= 0.0;
+    } else if (!strcmp(argv[i], "-j")) {
+      bench_threads = (unsigned int) strtoul(arg, NULL, 10);
+      error = bench_threads == 0 || bench_threads > EBUR128_MAX_THREADS;
+    } else if (!strcmp(argv[i], "-N")) {
+      streams = strtoul(arg, NULL, 10);
+      add = queries = init = 0;
+      error = streams == 0;
+    } else if (!strcmp(argv[i], "-H")) {
+      hours = strtoul(arg, NULL, 10);
+      add = queries = init = 0;
+      error = hours == 0;
+    } else if (!strcmp(argv[i], "-W")) {
+      minutes = strtoul(arg, NULL, 10);
+      add = queries = init = 0;
+      error = minutes == 0;
+    } else if (!strcmp(argv[i], "-C")) {
+      checkpoint = strtoul(arg, NULL, 10);
+      add = queries = init = 0;
+      error = checkpoint == 0;
+    } else if (!strcmp(argv[i], "-S")) {
+      stress = strtoul(arg, NULL, 10);
+      add = queries = init = 0;
+      error = stress == 0;
+    } else {
+      error = 1;
+    }
+    if (error) {
+      bench_usage();
+      return 1;
+    }
+    ++i;
+  }
+
+  if (add && bench_add_frames(&types, &modes, &rates, &channels, &chunks,
+                              seconds)) {
+    fprintf(stderr, "r128bench: add_frames failed\n");
+    return 1;
+  }
+  if (queries && bench_queries(&modes, &sessions)) {
+    fprintf(stderr, "r128bench: query failed\n");
+    return 1;
+  }
+  if (init && bench_init(&modes, &rates, &channels)) {
+    fprintf(stderr, "r128bench: init failed\n");
+    return 1;
+  }
+  if (streams && bench_streams(&modes, &rates, &channels, streams)) {
+    fprintf(stderr, "r128bench: streams failed\n");
+    return 1;
+  }
+  if (hours && bench_history(&modes, hours)) {
+    fprintf(stderr, "r128bench: history failed\n");
+    return 1;
+  }
+  if (minutes && bench_window(&modes, minutes)) {
+    fprintf(stderr, "r128bench: window check failed\n");
+    return 1;
+  }
+  if (checkpoint && bench_checkpoint(&modes, checkpoint)) {
+    fprintf(stderr, "r128bench: checkpoint check failed\n");
+    return 1;
+  }
+  if (faults && bench_faults(&modes)) {
+    fprintf(stderr, "r128bench: fault check failed\n");
+    return 1;
+  }
+  if (planar && bench_planar(&modes, &channels)) {
+    fprintf(stderr, "r128bench: planar check failed\n");
+    return 1;
+  }
+  if (pool && bench_pool(&modes, &channels)) {
+    fprintf(stderr, "r128bench: pool check failed\n");
+    return 1;
+  }
+  if (worker && bench_worker(&modes)) {
+    fprintf(stderr, "r128bench: worker check failed\n");
+    return 1;
+  }
+  if (stress && bench_stress(&modes, stress)) {
+    fprintf(stderr, "r128bench: stress test failed\n");
+    return 1;
+  }
+  return 0;
+}
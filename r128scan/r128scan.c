@@ -0,0 +1,719 @@
+/* r128scan - batch loudness scanner built on ebur128.c
+ *
+ * Measures integrated loudness, loudness range and true peak of many files
+ * in parallel. Files are sorted by duration and dealt out to one queue per
+ * worker thread, longest first. A worker that runs out of files steals the
+ * longest remaining file from the fullest queue, so a few long files at the
+ * end cannot hold up the whole run.
+ *
+ * With -s, long files are also split into segments that are analysed like
+ * separate files. Each segment starts with a few seconds of pre-roll from
+ * the end of the previous one, after which ebur128_reset_measurement drops
+ * what was measured so far; the worker that finishes the last segment of a
+ * file merges them in order.
+ *
+ * Supported input: WAV (8/16/24/32 bit PCM, 32/64 bit float, also
+ * WAVE_FORMAT_EXTENSIBLE) and headerless PCM (see -R). */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ebur128.h"
+
+#define SCAN_READ_FRAMES 16384
+/* Pre-roll of every segment but the first. Covers the 3 s short-term window,
+ * which also settles the K-weighting filter and the true peak interpolator
+ * long before. */
+#define SCAN_PREROLL_SECONDS 3
+/* Shorter segments would spend too much time on pre-roll. */
+#define SCAN_MIN_SEGMENT_SECONDS 60
+
+enum scan_format {
+  SCAN_U8,
+  SCAN_S16,
+  SCAN_S24,
+  SCAN_S32,
+  SCAN_F32,
+  SCAN_F64
+};
+
+static const unsigned int scan_format_bytes[] = {1, 2, 3, 4, 4, 8};
+
+struct scan_source {
+  enum scan_format format;
+  unsigned int channels;
+  unsigned long samplerate;
+  long data_offset;
+  unsigned long long frames;
+};
+
+struct scan_file {
+  const char* path;
+  struct scan_source source;
+  double seconds;
+  size_t album;
+  int error;
+  ebur128_state* st;      /* kept until the end for album values */
+  double loudness;
+  double range;
+  double peak;
+  size_t first_segment;   /* segments of the file, in order */
+  size_t segments;
+  size_t pending;         /* segments not analysed yet */
+};
+
+/* The part of a file analysed by one job. Frames [begin - preroll, begin)
+ * only prepare the state, frames [begin, end) are measured. */
+struct scan_segment {
+  size_t file;
+  unsigned long long begin;
+  unsigned long long end;
+  unsigned long long preroll;
+  double seconds;         /* including the pre-roll */
+  int error;
+  ebur128_state* st;
+};
+
+/* One queue per worker. The jobs are indices into the segment list, sorted
+ * by decreasing duration, and are always taken from the front. */
+struct scan_queue {
+  pthread_mutex_t mutex;
+  size_t* jobs;
+  size_t head;
+  size_t tail;
+  double seconds;         /* queued audio, used to pick a victim */
+};
+
+struct scan_pool {
+  struct scan_file* files;
+  struct scan_segment* segments;
+  struct scan_queue* queues;
+  unsigned int threads;
+  int keep_states;
+  int mode;
+};
+
+/* Protects scan_file::pending. */
+static pthread_mutex_t scan_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long read_le(const unsigned char* p, int bytes) {
+  unsigned long v = 0;
+  while (bytes--) {
+    v = (v << 8) | p[bytes];
+  }
+  return v;
+}
+
+static long file_size(FILE* f) {
+  long size;
+  if (fseek(f, 0, SEEK_END)) return -1;
+  size = ftell(f);
+  if (fseek(f, 0, SEEK_SET)) return -1;
+  return size;
+}
+
+/* Reads the WAV header and leaves the file at the start of the data. */
+static int scan_probe_wav(FILE* f, struct scan_source* source) {
+  unsigned char buf[40];
+  unsigned long size, tag = 0, bits = 0, block_align = 0;
+  long total = file_size(f);
+  int have_fmt = 0;
+
+  if (total < 12 || fread(buf, 1, 12, f) != 12 ||
+      memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "WAVE", 4)) {
+    return 1;
+  }
+  for (;;) {
+    if (fread(buf, 1, 8, f) != 8) return 1;
+    size = read_le(buf + 4, 4);
+    if (!memcmp(buf, "fmt ", 4)) {
+      unsigned long n = size < 40 ? size : 40;
+      if (n < 16 || fread(buf, 1, n, f) != n) return 1;
+      tag = read_le(buf, 2);
+      source->channels = (unsigned int) read_le(buf + 2, 2);
+      source->samplerate = read_le(buf + 4, 4);
+      block_align = read_le(buf + 12, 2);
+      bits = read_le(buf + 14, 2);
+      if (tag == 0xFFFE && n >= 26) {
+        tag = read_le(buf + 24, 2);    /* sub format GUID */
+      }
+      if (fseek(f, (long) (size - n + (size & 1)), SEEK_CUR)) return 1;
+      have_fmt = 1;
+    } else if (!memcmp(buf, "data", 4)) {
+      if (!have_fmt || !source->channels || !block_align) return 1;
+      source->data_offset = ftell(f);
+      /* streamed files may have a placeholder size */
+      if (size == 0 || size == 0xFFFFFFFFUL ||
+          (long) size > total - source->data_offset) {
+        size = (unsigned long) (total - source->data_offset);
+      }
+      source->frames = size / block_align;
+      break;
+    } else {
+      if (fseek(f, (long) (size + (size & 1)), SEEK_CUR)) return 1;
+    }
+  }
+  if (tag == 1 && bits == 8) {
+    source->format = SCAN_U8;
+  } else if (tag == 1 && bits == 16) {
+    source->format = SCAN_S16;
+  } else if (tag == 1 && bits == 24) {
+    source->format = SCAN_S24;
+  } else if (tag == 1 && bits == 32) {
+    source->format = SCAN_S32;
+  } else if (tag == 3 && bits == 32) {
+    source->format = SCAN_F32;
+  } else if (tag == 3 && bits == 64) {
+    source->format = SCAN_F64;
+  } else {
+    return 1;
+  }
+  if (block_align != source->channels * scan_format_bytes[source->format]) {
+    return 1;
+  }
+  return 0;
+}
+
+static int scan_is_raw(const char* path) {
+  const char* ext = strrchr(path, '.');
+  return ext && (!strcmp(ext, ".raw") || !strcmp(ext, ".pcm"));
+}
+
+/* Fills in the format and length of a file. raw describes headerless files
+ * and is NULL if they are not accepted. */
+static int scan_probe(const char* path, const struct scan_source* raw,
+                      struct scan_source* source) {
+  FILE* f = fopen(path, "rb");
+  int error = 1;
+  long size;
+
+  if (!f) return 1;
+  if (raw && scan_is_raw(path)) {
+    size = file_size(f);
+    if (size >= 0) {
+      *source = *raw;
+      source->data_offset = 0;
+      source->frames = (unsigned long long) size /
+                       (raw->channels * scan_format_bytes[raw->format]);
+      error = 0;
+    }
+  } else {
+    error = scan_probe_wav(f, source);
+  }
+  fclose(f);
+  return error;
+}
+
+/* Converts little endian samples to the nearest ebur128_add_frames_* type
+ * and feeds them to st. Float input assumes a little endian host. */
+static int scan_add(ebur128_state* st, const struct scan_source* source,
+                    const unsigned char* in, void* out, size_t frames) {
+  size_t i, samples = frames * source->channels;
+  switch (source->format) {
+    case SCAN_U8:
+      for (i = 0; i < samples; ++i) {
+        ((short*) out)[i] = (short) ((in[i] - 128) << 8);
+      }
+      return ebur128_add_frames_short(st, (short*) out, frames);
+    case SCAN_S16:
+      for (i = 0; i < samples; ++i) {
+        ((short*) out)[i] = (short) read_le(in + 2 * i, 2);
+      }
+      return ebur128_add_frames_short(st, (short*) out, frames);
+    case SCAN_S24:
+      for (i = 0; i < samples; ++i) {
+        ((int*) out)[i] = (int) (read_le(in + 3 * i, 3) << 8);
+      }
+      return ebur128_add_frames_int(st, (int*) out, frames);
+    case SCAN_S32:
+      for (i = 0; i < samples; ++i) {
+        ((int*) out)[i] = (int) read_le(in + 4 * i, 4);
+      }
+      return ebur128_add_frames_int(st, (int*) out, frames);
+    case SCAN_F32:
+      memcpy(out, in, samples * sizeof(float));
+      return ebur128_add_frames_float(st, (float*) out, frames);
+    case SCAN_F64:
+      memcpy(out, in, samples * sizeof(double));
+      return ebur128_add_frames_double(st, (double*) out, frames);
+  }
+  return 1;
+}
+
+static int scan_analyse(const struct scan_file* file,
+                        struct scan_segment* segment, int mode) {
+  const struct scan_source* source = &file->source;
+  size_t frame_bytes = source->channels * scan_format_bytes[source->format];
+  unsigned long long preroll = segment->preroll;
+  unsigned long long left = segment->end - segment->begin + preroll;
+  unsigned char* in = NULL;
+  double* out = NULL;
+  FILE* f = NULL;
+  int error = 1;
+
+  segment->st = ebur128_init(source->channels, source->samplerate, mode);
+  if (!segment->st) goto exit;
+  in = (unsigned char*) malloc(SCAN_READ_FRAMES * frame_bytes);
+  out = (double*) malloc(SCAN_READ_FRAMES * source->channels * sizeof(double));
+  f = fopen(file->path, "rb");
+  if (!in || !out || !f ||
+      fseek(f, source->data_offset +
+               (long) ((segment->begin - preroll) * frame_bytes), SEEK_SET)) {
+    goto exit;
+  }
+
+  while (left > 0) {
+    size_t n = left < SCAN_READ_FRAMES ? (size_t) left : SCAN_READ_FRAMES;
+    /* stop at the end of the pre-roll */
+    if (preroll > 0 && n > preroll) n = (size_t) preroll;
+    n = fread(in, frame_bytes, n, f);
+    if (n == 0) break;    /* truncated file, use what is there */
+    if (scan_add(segment->st, source, in, out, n)) goto exit;
+    left -= n;
+    if (preroll > 0) {
+      preroll -= n;
+      if (preroll == 0) ebur128_reset_measurement(segment->st);
+    }
+  }
+  error = 0;
+
+exit:
+  if (f) fclose(f);
+  free(out);
+  free(in);
+  return error;
+}
+
+/* Merges the segments of a file in order and gets its results. The states
+ * of the segments are destroyed, the merged one is kept if keep_states. */
+static void scan_finish(struct scan_pool* pool, struct scan_file* file) {
+  struct scan_segment* segments = &pool->segments[file->first_segment];
+  ebur128_state* st = segments[0].st;
+  unsigned int c;
+  double peak;
+  size_t i;
+
+  file->error = 0;
+  for (i = 0; i < file->segments; ++i) {
+    if (segments[i].error) file->error = 1;
+  }
+  for (i = 1; i < file->segments && !file->error; ++i) {
+    if (ebur128_merge(st, segments[i].st)) file->error = 1;
+  }
+  if (!file->error &&
+      (ebur128_loudness_global(st, &file->loudness) ||
+       ebur128_loudness_range(st, &file->range))) {
+    file->error = 1;
+  }
+  file->peak = 0.0;
+  for (c = 0; c < file->source.channels && !file->error; ++c) {
+    if ((pool->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+      ebur128_true_peak(st, c, &peak);
+    } else {
+      ebur128_sample_peak(st, c, &peak);
+    }
+    if (peak > file->peak) file->peak = peak;
+  }
+  if (!file->error && pool->keep_states) {
+    file->st = st;
+    segments[0].st = NULL;
+  }
+  for (i = 0; i < file->segments; ++i) {
+    if (segments[i].st) ebur128_destroy(&segments[i].st);
+  }
+}
+
+/* Takes the next file from queue q, or -1 if it is empty. */
+static long scan_queue_pop(struct scan_pool* pool, struct scan_queue* q) {
+  long job = -1;
+  pthread_mutex_lock(&q->mutex);
+  if (q->head < q->tail) {
+    job = (long) q->jobs[q->head++];
+    q->seconds -= pool->segments[job].seconds;
+  }
+  pthread_mutex_unlock(&q->mutex);
+  return job;
+}
+
+static long scan_steal(struct scan_pool* pool) {
+  for (;;) {
+    struct scan_queue* victim = NULL;
+    double most = 0.0;
+    unsigned int i;
+    long job;
+    for (i = 0; i < pool->threads; ++i) {
+      struct scan_queue* q = &pool->queues[i];
+      int empty;
+      double seconds;
+      pthread_mutex_lock(&q->mutex);
+      empty = q->head == q->tail;
+      seconds = q->seconds;
+      pthread_mutex_unlock(&q->mutex);
+      if (!empty && (!victim || seconds > most)) {
+        victim = q;
+        most = seconds;
+      }
+    }
+    /* no file is ever added to a queue, so this means we are done */
+    if (!victim) return -1;
+    job = scan_queue_pop(pool, victim);
+    if (job >= 0) return job;
+  }
+}
+
+struct scan_worker {
+  struct scan_pool* pool;
+  unsigned int index;
+};
+
+static void* scan_worker_main(void* arg) {
+  struct scan_worker* worker = (struct scan_worker*) arg;
+  struct scan_pool* pool = worker->pool;
+  long job;
+
+  for (;;) {
+    struct scan_segment* segment;
+    struct scan_file* file;
+    int last;
+    job = scan_queue_pop(pool, &pool->queues[worker->index]);
+    if (job < 0) job = scan_steal(pool);
+    if (job < 0) break;
+    segment = &pool->segments[job];
+    file = &pool->files[segment->file];
+    segment->error = scan_analyse(file, segment, pool->mode);
+    pthread_mutex_lock(&scan_done_mutex);
+    last = --file->pending == 0;
+    pthread_mutex_unlock(&scan_done_mutex);
+    if (last) scan_finish(pool, file);
+  }
+  return NULL;
+}
+
+static struct scan_file* scan_sort_files;
+static struct scan_segment* scan_sort_segments;
+
+static int scan_by_duration(const void* a, const void* b) {
+  double da = scan_sort_segments[*(const size_t*) a].seconds;
+  double db = scan_sort_segments[*(const size_t*) b].seconds;
+  return da < db ? 1 : da > db ? -1 : 0;
+}
+
+/* Splits a file into at most max segments that start on whole seconds as
+ * ebur128 counts them, 10 sub-blocks of (samplerate + 5) / 10 frames, so
+ * that the short-term blocks of every segment fall where they would in one
+ * pass. Returns the number of segments written to out. */
+static size_t scan_split(const struct scan_file* file, size_t index,
+                         size_t max, struct scan_segment* out) {
+  unsigned long long second = (file->source.samplerate + 5) / 10 * 10;
+  unsigned long long seconds = file->source.frames / second;
+  size_t i, n = (size_t) (seconds / SCAN_MIN_SEGMENT_SECONDS);
+
+  if (n > max) n = max;
+  if (n == 0) n = 1;
+  for (i = 0; i < n; ++i) {
+    out[i].file = index;
+    out[i].begin = seconds * i / n * second;
+    out[i].end = i + 1 < n ? seconds * (i + 1) / n * second
+                           : file->source.frames;
+    out[i].preroll = i > 0 ? SCAN_PREROLL_SECONDS * second : 0;
+    out[i].seconds = (double) (out[i].end - out[i].begin + out[i].preroll) /
+                     file->source.samplerate;
+    out[i].error = 0;
+    out[i].st = NULL;
+  }
+  return n;
+}
+
+static size_t scan_dir_length(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash ? (size_t) (slash - path) : 0;
+}
+
+static int scan_by_path(const void* a, const void* b) {
+  return strcmp(scan_sort_files[*(const size_t*) a].path,
+                scan_sort_files[*(const size_t*) b].path);
+}
+
+/* Gives all files in the same directory the same album index and returns
+ * the number of albums. */
+static size_t scan_assign_albums(struct scan_file* files, size_t* order,
+                                 size_t count) {
+  size_t i, albums = 0;
+  for (i = 0; i < count; ++i) order[i] = i;
+  scan_sort_files = files;
+  qsort(order, count, sizeof(size_t), scan_by_path);
+  for (i = 0; i < count; ++i) {
+    const char* path = files[order[i]].path;
+    if (i > 0) {
+      const char* prev = files[order[i - 1]].path;
+      size_t n = scan_dir_length(path);
+      if (n != scan_dir_length(prev) || strncmp(path, prev, n)) ++albums;
+    }
+    files[order[i]].album = albums;
+  }
+  return count ? albums + 1 : 0;
+}
+
+static double scan_db(double v) {
+  return v > 0.0 ? 20.0 * log10(v) : -HUGE_VAL;
+}
+
+static void scan_print_albums(struct scan_file* files, size_t* order,
+                              size_t count) {
+  ebur128_state** sts = (ebur128_state**) malloc(count * sizeof(*sts));
+  size_t i = 0, j, n;
+  if (!sts) return;
+  /* order is still sorted by path from scan_assign_albums */
+  while (i < count) {
+    const char* path = files[order[i]].path;
+    double loudness, range, peak = 0.0;
+    n = 0;
+    for (j = i; j < count && files[order[j]].album == files[order[i]].album;
+         ++j) {
+      struct scan_file* file = &files[order[j]];
+      if (file->error) continue;
+      sts[n++] = file->st;
+      if (file->peak > peak) peak = file->peak;
+    }
+    if (n > 0 &&
+        !ebur128_loudness_global_multiple(sts, n, &loudness) &&
+        !ebur128_loudness_range_multiple(sts, n, &range)) {
+      size_t dir = scan_dir_length(path);
+      printf("%8.2f LUFS %6.2f LU %7.2f dBTP  ALBUM %.*s/ (%lu files)\n",
+             loudness, range, scan_db(peak),
+             dir ? (int) dir : 1, dir ? path : ".", (unsigned long) n);
+    }
+    i = j;
+  }
+  free(sts);
+}
+
+static double scan_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int scan_parse_raw(const char* arg, struct scan_source* raw) {
+  static const char* names[] = {"u8", "s16", "s24", "s32", "f32", "f64"};
+  char format[8];
+  unsigned int i;
+  if (sscanf(arg, "%lu:%u:%7s", &raw->samplerate, &raw->channels,
+             format) != 3 || !raw->samplerate || !raw->channels) {
+    return 1;
+  }
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (!strcmp(format, names[i])) {
+      raw->format = (enum scan_format) i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void scan_usage(void) {
+  fprintf(stderr,
+          "usage: r128scan [-j threads] [-s segments] [-a] [-p] "
+          "[-R rate:channels:format] file...\n"
+          "  -j  number of worker threads (default: number of CPUs)\n"
+          "  -s  split files into up to this many segments of at least a\n"
+          "      minute that are analysed in parallel (default: 1)\n"
+          "  -a  also print album values, one album per directory\n"
+          "  -p  report sample peak instead of true peak (faster)\n"
+          "  -R  format of .raw/.pcm files, format is one of\n"
+          "      u8, s16, s24, s32, f32, f64 (little endian, interleaved)\n");
+}
+
+int main(int argc, char** argv) {
+  struct scan_source raw_source;
+  struct scan_source* raw = NULL;
+  struct scan_pool pool;
+  struct scan_worker* workers = NULL;
+  pthread_t* threads = NULL;
+  struct scan_file* files = NULL;
+  struct scan_segment* segments = NULL;
+  size_t* order = NULL;
+  size_t* jobs = NULL;
+  size_t count = 0, max_segments = 1, total = 0, analysed = 0, i;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double start, elapsed, audio_seconds = 0.0;
+  int album = 0, opt, ret = 1;
+  unsigned int t;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.threads = cpus > 0 ? (unsigned int) cpus : 1;
+  pool.mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK |
+              EBUR128_MODE_HISTOGRAM;
+  while ((opt = getopt(argc, argv, "j:s:apR:")) != -1) {
+    switch (opt) {
+      case 'j':
+        pool.threads = (unsigned int) atoi(optarg);
+        if (pool.threads == 0) {
+          scan_usage();
+          return 1;
+        }
+        break;
+      case 's':
+        max_segments = (size_t) atoi(optarg);
+        if (max_segments == 0) {
+          scan_usage();
+          return 1;
+        }
+        break;
+      case 'a':
+        album = 1;
+        break;
+      case 'p':
+        pool.mode = EBUR128_MODE_I | EBUR128_MODE_LRA |
+                    EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_HISTOGRAM;
+        break;
+      case 'R':
+        if (scan_parse_raw(optarg, &raw_source)) {
+          scan_usage();
+          return 1;
+        }
+        raw = &raw_source;
+        break;
+      default:
+        scan_usage();
+        return 1;
+    }
+  }
+  count = (size_t) (argc - optind);
+  if (count == 0) {
+    scan_usage();
+    return 1;
+  }
+
+  start = scan_now();
+  files = (struct scan_file*) calloc(count, sizeof(struct scan_file));
+  order = (size_t*) malloc(count * sizeof(size_t));
+  segments = (struct scan_segment*) malloc(count * max_segments *
+                                           sizeof(struct scan_segment));
+  jobs = (size_t*) malloc(count * max_segments * sizeof(size_t));
+  if (!files || !order || !segments || !jobs) {
+    fprintf(stderr, "r128scan: out of memory\n");
+    goto exit;
+  }
+  pool.files = files;
+  pool.segments = segments;
+  pool.keep_states = album;
+
+  for (i = 0; i < count; ++i) {
+    files[i].path = argv[optind + i];
+    files[i].error = scan_probe(files[i].path, raw, &files[i].source);
+    if (!files[i].error) {
+      files[i].seconds = (double) files[i].source.frames /
+                         files[i].source.samplerate;
+      files[i].first_segment = total;
+      files[i].segments = scan_split(&files[i], i, max_segments,
+                                     &segments[total]);
+      files[i].pending = files[i].segments;
+      total += files[i].segments;
+    }
+  }
+  if (album) scan_assign_albums(files, order, count);
+
+  if (pool.threads > total) pool.threads = total ? (unsigned int) total : 1;
+  pool.queues = (struct scan_queue*) calloc(pool.threads,
+                                            sizeof(struct scan_queue));
+  workers = (struct scan_worker*) malloc(pool.threads * sizeof(*workers));
+  threads = (pthread_t*) malloc(pool.threads * sizeof(pthread_t));
+  if (!pool.queues || !workers || !threads) {
+    fprintf(stderr, "r128scan: out of memory\n");
+    goto exit;
+  }
+
+  /* deal the segments out longest first, so every queue is sorted as well */
+  for (i = 0; i < total; ++i) jobs[i] = i;
+  scan_sort_segments = segments;
+  qsort(jobs, total, sizeof(size_t), scan_by_duration);
+  for (t = 0; t < pool.threads; ++t) {
+    pool.queues[t].jobs = (size_t*) malloc((total / pool.threads + 1) *
+                                           sizeof(size_t));
+    if (!pool.queues[t].jobs) {
+      fprintf(stderr, "r128scan: out of memory\n");
+      goto exit;
+    }
+    pthread_mutex_init(&pool.queues[t].mutex, NULL);
+  }
+  for (i = 0; i < total; ++i) {
+    struct scan_queue* q = &pool.queues[i % pool.threads];
+    q->jobs[q->tail++] = jobs[i];
+    q->seconds += segments[jobs[i]].seconds;
+  }
+
+  for (t = 0; t < pool.threads; ++t) {
+    int error;
+    workers[t].pool = &pool;
+    workers[t].index = t;
+    error = pthread_create(&threads[t], NULL, scan_worker_main, &workers[t]);
+    if (error) {
+      fprintf(stderr, "r128scan: %s\n", strerror(error));
+      /* the started threads steal the rest */
+      break;
+    }
+  }
+  if (t == 0) goto exit;
+  while (t > 0) {
+    pthread_join(threads[--t], NULL);
+  }
+  elapsed = scan_now() - start;
+
+  for (i = 0; i < count; ++i) {
+    struct scan_file* file = &files[i];
+    if (file->error) {
+      printf("%8s %11s %12s  %s\n", "error", "", "", file->path);
+      continue;
+    }
+    printf("%8.2f LUFS %6.2f LU %7.2f dBTP  %s\n",
+           file->loudness, file->range, scan_db(file->peak), file->path);
+    ++analysed;
+    audio_seconds += file->seconds;
+  }
+  if (album) {
+    scan_assign_albums(files, order, count);
+    scan_print_albums(files, order, count);
+  }
+
+  fprintf(stderr, "%lu of %lu files, %.2f h of audio in %.2f s "
+                  "with %u threads: %.1f files/s, %.2f audio-hours/s\n",
+          (unsigned long) analysed, (unsigned long) count,
+          audio_seconds / 3600.0, elapsed, pool.threads,
+          analysed / elapsed, audio_seconds / 3600.0 / elapsed);
+  ret = analysed == count ? 0 : 2;
+
+exit:
+  if (files) {
+    for (i = 0; i < count; ++i) {
+      if (files[i].st) ebur128_destroy(&files[i].st);
+    }
+  }
+  if (pool.queues) {
+    for (t = 0; t < pool.threads; ++t) {
+      if (pool.queues[t].jobs) {
+        pthread_mutex_destroy(&pool.queues[t].mutex);
+        free(pool.queues[t].jobs);
+      }
+    }
+  }
+  if (segments) {
+    for (i = 0; i < total; ++i) {
+      if (segments[i].st) ebur128_destroy(&segments[i].st);
+    }
+  }
+  free(threads);
+  free(workers);
+  free(pool.queues);
+  free(jobs);
+  free(segments);
+  free(order);
+  free(files);
+  return ret;
+}